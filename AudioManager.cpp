@@ -2,24 +2,24 @@
 #include <cassert>
 
 template <typename T>
-static void mdcReadTo(const Chunk::DataBuffer*& chkDataIt, T& val)
+static void mdcReadTo(MultidataList::ConstIterator& chkDataIt, T& val)
 {
 	static_assert(std::is_arithmetic_v<T>);
-	val = *(const T*)chkDataIt->data();
+	val = *(const T*)(*chkDataIt).data();
 	++chkDataIt;
 }
 
 template <>
-void mdcReadTo(const Chunk::DataBuffer*& chkDataIt, std::string& val)
+void mdcReadTo(MultidataList::ConstIterator& chkDataIt, std::string& val)
 {
-	val = (const char*)chkDataIt->data();
+	val = (const char*)(*chkDataIt).data();
 	++chkDataIt;
 }
 
 template <>
-void mdcReadTo(const Chunk::DataBuffer*& chkDataIt, AudioRef& val)
+void mdcReadTo(MultidataList::ConstIterator& chkDataIt, AudioRef& val)
 {
-	val.id = *(const uint32_t*)chkDataIt->data();
+	val.id = *(const uint32_t*)(*chkDataIt).data();
 	++chkDataIt;
 }
 
@@ -27,32 +27,26 @@ template <typename T>
 static void mdcWrite(Chunk& chunk, const T& val)
 {
 	static_assert(std::is_arithmetic_v<T>);
-	auto& buf = chunk.multidata.emplace_back();
-	buf.resize(sizeof(T));
-	memcpy(buf.data(), &val, sizeof(T));
+	chunk.multidata.append(&val, sizeof(T));
 }
 
 template <>
 void mdcWrite(Chunk& chunk, const std::string& val)
 {
-	auto& buf = chunk.multidata.emplace_back();
-	buf.resize(val.size() + 1);
-	memcpy(buf.data(), val.data(), val.size() + 1);
+	chunk.multidata.appendString(val);
 }
 
 template <>
 void mdcWrite(Chunk& chunk, const AudioRef& val)
 {
-	auto& buf = chunk.multidata.emplace_back();
-	buf.resize(4);
-	memcpy(buf.data(), &val.id, 4);
+	chunk.multidata.append(&val.id, 4);
 }
 
 static constexpr uint32_t byteSwap32(uint32_t v) { return ((v & 0xFF) << 24) | ((v & 0xFF00) << 8) | ((v & 0xFF0000) >> 8) | (v >> 24); };
 
 struct RLoader {
-	const Chunk::DataBuffer*& bufptr;
-	RLoader(const Chunk::DataBuffer*& bufptr) : bufptr(bufptr) {}
+	MultidataList::ConstIterator& bufptr;
+	RLoader(MultidataList::ConstIterator& bufptr) : bufptr(bufptr) {}
 	template<typename T> void member(T& val, const char* name) { mdcReadTo(bufptr, val); }
 };
 
@@ -89,7 +83,7 @@ void AudioManager::load(const Chunk& ands, const Chunk& sndr)
 		using T = typename decltype(what)::type;
 		const Chunk* chk = ands.findSubchunk(byteSwap32(tag));
 		assert(chk != nullptr);
-		const Chunk::DataBuffer* bufptr = chk->multidata.data();
+		MultidataList::ConstIterator bufptr = chk->multidata.begin();
 		uint32_t mostlyOne, numObjects;
 		mdcReadTo(bufptr, mostlyOne);
 		mdcReadTo(bufptr, numObjects);
@@ -102,12 +96,16 @@ void AudioManager::load(const Chunk& ands, const Chunk& sndr)
 			obj->reflect(rl);
 			if constexpr (std::is_same_v<T, SetAudioObject>) {
 				SetAudioObject* set = (SetAudioObject*)obj.get();
-				const Chunk::DataBuffer* setsPtr = chk->subchunks[i].multidata.empty() ? &chk->subchunks[i].maindata : chk->subchunks[i].multidata.data();
-				uint32_t numEntries;
-				mdcReadTo(setsPtr, numEntries);
-				set->sounds.resize(numEntries);
-				for (auto& entry : set->sounds)
-					mdcReadTo(setsPtr, entry);
+				const Chunk& setsChunk = chk->subchunks[i];
+				// an empty set only has its number of entries, as maindata
+				if (!setsChunk.multidata.empty()) {
+					MultidataList::ConstIterator setsPtr = setsChunk.multidata.begin();
+					uint32_t numEntries;
+					mdcReadTo(setsPtr, numEntries);
+					set->sounds.resize(numEntries);
+					for (auto& entry : set->sounds)
+						mdcReadTo(setsPtr, entry);
+				}
 			}
 			allocateSlot(id);
 			audioObjects[id] = std::move(obj);
@@ -121,7 +119,7 @@ void AudioManager::load(const Chunk& ands, const Chunk& sndr)
 	loadType('MMPS', TypeIndicator<ImpactAudioObject>());
 	loadType('ROMS', TypeIndicator<RoomAudioObject>());
 
-	const Chunk::DataBuffer* sndrPtr = sndr.multidata.data();
+	MultidataList::ConstIterator sndrPtr = sndr.multidata.begin();
 	for (size_t i = 0; i < sndr.multidata.size(); i += 2) {
 		uint32_t id;
 		std::string name;
@@ -178,7 +176,7 @@ std::pair<Chunk, Chunk> AudioManager::save() const
 
 	Chunk sndr;
 	sndr.tag = byteSwap32('SNDR');
-	sndr.multidata.reserve(2 * audioNames.size());
+	sndr.multidata.reserve(2 * audioNames.size(), 24 * audioNames.size());
 	for (size_t id = 1; id < audioNames.size();  ++id) {
 		auto& name = audioNames[id];
 		if (!name.empty()) {
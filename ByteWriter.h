@@ -4,14 +4,20 @@
 #include <string>
 #include <string_view>
 #include <type_traits>
+#include <utility>
 
-// Adapter for container that adds methods to append arbitrary binary data
+// Adapter for container that adds methods to append arbitrary binary data.
+// With a reference type as Container, it appends to an existing container.
 template<typename Container> class ByteWriter {
 public:
-	using Byte = typename Container::value_type;
+	using Byte = typename std::remove_reference_t<Container>::value_type;
 	static_assert(sizeof(Byte) == 1, "The container's element type must have the size of a byte (char, uint8_t).");
 
+	ByteWriter() = default;
+	explicit ByteWriter(Container container) : buffer(std::forward<Container>(container)) {}
+
 	size_t size() const { return buffer.size(); }
+	void reserve(size_t capacity) { buffer.reserve(capacity); }
 
 	void addData(const void* data, size_t length) {
 		const Byte* ptr = static_cast<const Byte*>(data);
@@ -0,0 +1,81 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#include "ChunkArena.h"
+
+#include <algorithm>
+
+static size_t AlignUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+ChunkArena::ChunkArena(size_t initialSize) : firstCapacity(initialSize)
+{
+	if (initialSize)
+		firstBlock.reset(new uint8_t[initialSize]);
+}
+
+bool ChunkArena::owns(const void* ptr) const
+{
+	const uint8_t* p = (const uint8_t*)ptr;
+	if (p >= firstBlock.get() && p < firstBlock.get() + firstCapacity)
+		return true;
+	std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+	if (!sealed)
+		lock.lock();
+	for (const Block& block : extraBlocks)
+		if (p >= block.memory.get() && p < block.memory.get() + block.capacity)
+			return true;
+	return false;
+}
+
+size_t ChunkArena::usedSize() const
+{
+	size_t total = std::min(firstUsed.load(), firstCapacity);
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const Block& block : extraBlocks)
+		total += block.used;
+	return total;
+}
+
+void* ChunkArena::do_allocate(size_t bytes, size_t alignment)
+{
+	if (sealed)
+		return upstream->allocate(bytes, alignment);
+
+	// Fast path: bump the first block
+	size_t used = firstUsed.load(std::memory_order_relaxed);
+	while (true) {
+		size_t start = AlignUp((size_t)firstBlock.get() + used, alignment) - (size_t)firstBlock.get();
+		if (start + bytes > firstCapacity)
+			break;
+		if (firstUsed.compare_exchange_weak(used, start + bytes, std::memory_order_relaxed))
+			return firstBlock.get() + start;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!extraBlocks.empty()) {
+		Block& last = extraBlocks.back();
+		size_t start = AlignUp((size_t)last.memory.get() + last.used, alignment) - (size_t)last.memory.get();
+		if (start + bytes <= last.capacity) {
+			last.used = start + bytes;
+			return last.memory.get() + start;
+		}
+	}
+	Block& block = extraBlocks.emplace_back();
+	block.capacity = std::max(bytes + alignment, minExtraBlockSize);
+	block.memory.reset(new uint8_t[block.capacity]);
+	size_t start = AlignUp((size_t)block.memory.get(), alignment) - (size_t)block.memory.get();
+	block.used = start + bytes;
+	return block.memory.get() + start;
+}
+
+void ChunkArena::do_deallocate(void* ptr, size_t bytes, size_t alignment)
+{
+	// Arena memory is released all at once with the arena
+	if (!owns(ptr))
+		upstream->deallocate(ptr, bytes, alignment);
+}
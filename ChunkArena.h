@@ -0,0 +1,58 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+// Bump allocator for the data buffers of a chunk tree.
+// Memory is handed out from blocks that are only released when the arena is destroyed,
+// so deallocating arena memory is a no-op. Allocation is thread-safe.
+// Once sealed (e.g. after loading), new allocations go to the heap instead,
+// so edited buffers don't leave dead space in the arena.
+class ChunkArena : public std::pmr::memory_resource {
+public:
+	explicit ChunkArena(size_t initialSize);
+	ChunkArena(const ChunkArena&) = delete;
+	ChunkArena& operator=(const ChunkArena&) = delete;
+
+	void seal() { sealed = true; }
+	bool owns(const void* ptr) const;
+
+	// Bytes handed out from the arena blocks
+	size_t usedSize() const;
+
+protected:
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+	struct Block {
+		std::unique_ptr<uint8_t[]> memory;
+		size_t capacity = 0;
+		size_t used = 0;
+	};
+
+	// The first block is sized for the whole load and is allocated from lock-free
+	std::unique_ptr<uint8_t[]> firstBlock;
+	size_t firstCapacity;
+	std::atomic<size_t> firstUsed = 0;
+
+	// Further blocks when the first one is full, sized for the allocation that needed them.
+	// Only added to before sealing, so the list can be read without locking once sealed.
+	static constexpr size_t minExtraBlockSize = 64 * 1024;
+	mutable std::mutex mutex;
+	std::vector<Block> extraBlocks;
+
+	std::atomic<bool> sealed = false;
+	std::pmr::memory_resource* upstream = std::pmr::new_delete_resource();
+};
@@ -0,0 +1,42 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Fast non-cryptographic 64-bit hash of a byte range, for finding duplicate data.
+// Equal hashes do not guarantee equal data, always compare the bytes afterwards.
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0)
+{
+	static constexpr uint64_t k1 = 0x9E3779B185EBCA87ull, k2 = 0xC2B2AE3D27D4EB4Full;
+	const uint8_t* ptr = (const uint8_t*)data;
+	uint64_t h = seed ^ (size * k1);
+	auto mix = [&h](uint64_t v) {
+		v *= k2;
+		v = (v << 31) | (v >> 33);
+		h ^= v * k1;
+		h = ((h << 27) | (h >> 37)) * k1 + k2;
+	};
+	for (; size >= 8; size -= 8, ptr += 8) {
+		uint64_t v;
+		memcpy(&v, ptr, 8);
+		mix(v);
+	}
+	if (size) {
+		uint64_t v = 0;
+		memcpy(&v, ptr, size);
+		mix(v);
+	}
+	// final avalanche
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
@@ -5,34 +5,140 @@
 
 #pragma once
 
+#include <cassert>
 #include <cstddef>
 #include <cstring>
+#include <memory_resource>
+#include <type_traits>
 
+// Growable array of trivially copyable elements.
+// Unlike std::vector, resizing leaves new elements uninitialized, and the storage
+// can come from any std::pmr::memory_resource (e.g. a per-pack arena).
+// Copy construction allocates from the default heap, moves take over the buffer and its resource.
 template <class T> class DynArray {
+	static_assert(std::is_trivially_copyable_v<T>, "DynArray only holds trivially copyable types");
+
 private:
-	T* pointer;
-	size_t length;
+	T* pointer = nullptr;
+	size_t length = 0;
+	size_t capacity_ = 0;
+	std::pmr::memory_resource* resource = std::pmr::new_delete_resource();
 
 	void freeP() {
-		if (length)
-			delete[] pointer;
+		if (pointer)
+			resource->deallocate(pointer, capacity_ * sizeof(T), alignof(T));
 		pointer = nullptr;
 		length = 0;
+		capacity_ = 0;
 	}
 
-	void setsize(size_t newlen) {
-		if (newlen)
-			pointer = new T[newlen];
-		length = newlen;
+	// Move the contents to a new buffer of given capacity (must be >= length).
+	void reallocate(size_t newcap) {
+		assert(newcap >= length);
+		T* newptr = newcap ? static_cast<T*>(resource->allocate(newcap * sizeof(T), alignof(T))) : nullptr;
+		if (length)
+			memcpy(newptr, pointer, length * sizeof(T));
+		if (pointer)
+			resource->deallocate(pointer, capacity_ * sizeof(T), alignof(T));
+		pointer = newptr;
+		capacity_ = newcap;
+	}
+
+	void grow(size_t mincap) {
+		size_t newcap = capacity_ + capacity_ / 2;
+		reallocate(newcap < mincap ? mincap : newcap);
+	}
+
+	void steal(DynArray& other) {
+		pointer = other.pointer; length = other.length; capacity_ = other.capacity_; resource = other.resource;
+		other.pointer = nullptr; other.length = 0; other.capacity_ = 0;
 	}
 
 public:
+	using value_type = T;
+
+	// Change the number of elements. Existing elements are kept, new ones are left uninitialized.
+	// A non-empty array grows geometrically, so repeated appends are amortized.
 	void resize(size_t newlen) {
+		if (newlen > capacity_) {
+			if (length)
+				grow(newlen);
+			else
+				reallocate(newlen);
+		}
+		length = newlen;
+	}
+	void reserve(size_t newcap) {
+		if (newcap > capacity_)
+			reallocate(newcap);
+	}
+	void shrink_to_fit() {
+		if (capacity_ > length)
+			reallocate(length);
+	}
+	void clear() { length = 0; }
+
+	void assign(const T* first, size_t count) {
+		length = 0;
+		reserve(count);
+		if (count)
+			memcpy(pointer, first, count * sizeof(T));
+		length = count;
+	}
+
+	void append(const T* first, size_t count) {
+		if (!count)
+			return;
+		if (length + count > capacity_) {
+			// the source might be part of this array
+			if (first >= pointer && first < pointer + length) {
+				size_t index = first - pointer;
+				grow(length + count);
+				first = pointer + index;
+			}
+			else
+				grow(length + count);
+		}
+		memcpy(pointer + length, first, count * sizeof(T));
+		length += count;
+	}
+
+	T* insert(T* pos, const T* first, const T* last) {
+		size_t index = pos - pointer;
+		size_t count = last - first;
+		if (index == length) {
+			append(first, count);
+			return pointer + index;
+		}
+		assert(index < length);
+		DynArray tail(resource);
+		tail.assign(first, count);
+		resize(length + count);
+		memmove(pointer + index + count, pointer + index, (length - count - index) * sizeof(T));
+		if (count)
+			memcpy(pointer + index, tail.pointer, count * sizeof(T));
+		return pointer + index;
+	}
+
+	void push_back(const T& value) { append(&value, 1); }
+
+	// Take ownership of a buffer of 'cap' elements allocated from 'res', of which 'len' are used.
+	void adopt(T* ptr, size_t len, size_t cap, std::pmr::memory_resource* res = std::pmr::new_delete_resource()) {
+		assert(len <= cap);
+		freeP();
+		pointer = ptr; length = len; capacity_ = cap; resource = res;
+	}
+
+	// Drop the buffer and draw future storage from 'res' instead.
+	void setResource(std::pmr::memory_resource* res) {
 		freeP();
-		setsize(newlen);
+		resource = res;
 	}
+	std::pmr::memory_resource* getResource() const { return resource; }
 
 	size_t size() const { return length; }
+	size_t capacity() const { return capacity_; }
+	bool empty() const { return length == 0; }
 	T* data() { return pointer; }
 	const T* data() const { return pointer; }
 
@@ -44,11 +150,14 @@ public:
 	T& operator[] (size_t index) { return pointer[index]; }
 	const T& operator[] (size_t index) const { return pointer[index]; }
 
-	DynArray() { pointer = nullptr; length = 0; }
-	DynArray(int len) { setsize(len); }
-	DynArray(const DynArray &other) { setsize(other.length); memcpy(pointer, other.pointer, length * sizeof(T)); }
-	DynArray(DynArray &&other) noexcept { pointer = other.pointer; length = other.length; other.pointer = nullptr; other.length = 0; }
-	void operator=(const DynArray &other) { resize(other.length); memcpy(pointer, other.pointer, length * sizeof(T)); }
-	void operator=(DynArray &&other) noexcept { freeP(); pointer = other.pointer; length = other.length; other.pointer = nullptr; other.length = 0; }
+	DynArray() = default;
+	explicit DynArray(std::pmr::memory_resource* res) : resource(res) {}
+	DynArray(int len) { resize(len); }
+	DynArray(size_t len, std::pmr::memory_resource* res) : resource(res) { resize(len); }
+	DynArray(const T* first, size_t count, std::pmr::memory_resource* res = std::pmr::new_delete_resource()) : resource(res) { assign(first, count); }
+	DynArray(const DynArray &other) { assign(other.pointer, other.length); }
+	DynArray(DynArray &&other) noexcept { steal(other); }
+	DynArray& operator=(const DynArray &other) { if (this != &other) assign(other.pointer, other.length); return *this; }
+	DynArray& operator=(DynArray &&other) noexcept { if (this != &other) { freeP(); steal(other); } return *this; }
 	~DynArray() { freeP(); }
 };
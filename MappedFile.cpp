@@ -0,0 +1,50 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#include "MappedFile.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+bool MappedFile::open(const std::filesystem::path& path)
+{
+	close();
+	// FILE_SHARE_DELETE lets other programs (and our own saves) rename or replace the file while it is mapped.
+	// The view keeps the old contents, and Scene::SaveSceneSPK closes the archive before replacing it.
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		return false;
+	}
+	fileHandle = file;
+	length = (size_t)fileSize.QuadPart;
+	if (length == 0)
+		return true; // empty files cannot be mapped
+
+	mappingHandle = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mappingHandle)
+		pointer = (const uint8_t*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!pointer) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (pointer)
+		UnmapViewOfFile(pointer);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+	if (fileHandle)
+		CloseHandle(fileHandle);
+	fileHandle = mappingHandle = nullptr;
+	pointer = nullptr;
+	length = 0;
+}
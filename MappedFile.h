@@ -0,0 +1,33 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// Read-only memory mapping of a whole file.
+// The file can still be read, renamed or deleted by others while mapped, but not written to.
+class MappedFile {
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() { close(); }
+
+	bool open(const std::filesystem::path& path);
+	void close();
+
+	bool isOpen() const { return fileHandle != nullptr; }
+	const uint8_t* data() const { return pointer; }
+	size_t size() const { return length; }
+
+private:
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+	const uint8_t* pointer = nullptr;
+	size_t length = 0;
+};
@@ -0,0 +1,389 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#include "MatrixCodec.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MATRIXCODEC_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles intrinsics of any instruction set, GCC and Clang need them enabled per function
+#if defined(__GNUC__) || defined(__clang__)
+#define MATRIXCODEC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define MATRIXCODEC_TARGET_AVX2
+#endif
+
+namespace {
+
+constexpr float fixedOne = 1073741824.0f; // 2^30
+
+// Reference implementations, as the scene was originally loaded and saved
+
+Matrix DecodeOne(const SpkMatrixQuad& quad, const Vector3& position)
+{
+	Matrix matrix = Matrix::getTranslationMatrix(position);
+	const int32_t mtxoff[4] = { quad.zx, quad.zy, quad.yx, quad.yy };
+	float mc[4];
+	for (int i = 0; i < 4; i++)
+		mc[i] = (float)((double)mtxoff[i] / 1073741824.0); // divide by 2^30
+	Vector3 rv[3];
+	rv[2] = Vector3(mc[0], mc[1], std::sqrt(std::max(0.0f, 1.0f - mc[0]*mc[0] - mc[1]*mc[1])));
+	rv[1] = Vector3(mc[2], mc[3], std::sqrt(std::max(0.0f, 1.0f - mc[2]*mc[2] - mc[3]*mc[3])));
+	if (quad.zx & 1) rv[2].z = -rv[2].z;
+	if (quad.yx & 1) rv[1].z = -rv[1].z;
+	rv[0] = rv[1].cross(rv[2]);
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 3; j++)
+			matrix.m[i][j] = rv[i].coord[j];
+	return matrix;
+}
+
+// Multiplies by 2^30 and converts to uint32_t as the original x64 code does: truncated to 64 bits,
+// keeping the low 32 ones. The conversion of NaN (or infinity) is undefined in C++, it gives 0 here.
+// -0.0 gives 0 like +0.0.
+uint32_t ToFixed(float value)
+{
+	float scaled = value * fixedOne;
+	if (!(std::fabs(scaled) < 9223372036854775808.0f)) // 2^63, false for NaN
+		return 0;
+	return (uint32_t)(int64_t)scaled;
+}
+
+void EncodeOne(const Matrix& matrix, SpkMatrixQuad& quad, Vector3& position)
+{
+	position = matrix.getTranslationVector();
+	uint32_t cmtx[4];
+	cmtx[0] = ToFixed(matrix._31) & ~1u;
+	cmtx[1] = ToFixed(matrix._32);
+	if (matrix._33 < 0) cmtx[0] |= 1; // not for -0.0 and NaN
+	cmtx[2] = ToFixed(matrix._21) & ~1u;
+	cmtx[3] = ToFixed(matrix._22);
+	if (matrix._23 < 0) cmtx[2] |= 1;
+	quad = { (int32_t)cmtx[0], (int32_t)cmtx[1], (int32_t)cmtx[2], (int32_t)cmtx[3] };
+}
+
+void DecodeScalar(const SpkMatrixQuad* quads, const Vector3* positions, Matrix* matrices, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		matrices[i] = DecodeOne(quads[i], positions[i]);
+}
+
+void EncodeScalar(const Matrix* matrices, SpkMatrixQuad* quads, Vector3* positions, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		EncodeOne(matrices[i], quads[i], positions[i]);
+}
+
+#ifdef MATRIXCODEC_X86
+
+// The SIMD versions work on the quads transposed to one register per component, each lane being an object.
+// - Converting the int to float and multiplying by 2^-30 rounds the same as the reference's division in double,
+//   as scaling by a power of two is exact.
+// - The products and differences are done in the same order without FMA, max(t, 0) gives 0 for NaN as std::max(0, t),
+//   and the sign is flipped by XORing the sign bit like the negation.
+// - float to int32 truncation matches ToFixed for values within the int32 range, and gives 0x80000000 for NaN,
+//   so the NaN lanes are set to 0 like ToFixed does. -0.0 is truncated to 0 and, as in the reference,
+//   doesn't set the low bit since the comparison with 0 is false for it and for NaN.
+//   Groups of objects with any value out of the int32 range (scaled matrices, infinity) are encoded by the reference code.
+
+void DecodeSse2(const SpkMatrixQuad* quads, const Vector3* positions, Matrix* matrices, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / fixedOne);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i lowBit = _mm_set1_epi32(1);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i q0 = _mm_loadu_si128((const __m128i*)&quads[i]);
+		__m128i q1 = _mm_loadu_si128((const __m128i*)&quads[i + 1]);
+		__m128i q2 = _mm_loadu_si128((const __m128i*)&quads[i + 2]);
+		__m128i q3 = _mm_loadu_si128((const __m128i*)&quads[i + 3]);
+		__m128i t0 = _mm_unpacklo_epi32(q0, q1);
+		__m128i t1 = _mm_unpacklo_epi32(q2, q3);
+		__m128i t2 = _mm_unpackhi_epi32(q0, q1);
+		__m128i t3 = _mm_unpackhi_epi32(q2, q3);
+		__m128i zx = _mm_unpacklo_epi64(t0, t1);
+		__m128i zy = _mm_unpackhi_epi64(t0, t1);
+		__m128i yx = _mm_unpacklo_epi64(t2, t3);
+		__m128i yy = _mm_unpackhi_epi64(t2, t3);
+
+		__m128 a = _mm_mul_ps(_mm_cvtepi32_ps(zx), scale);
+		__m128 b = _mm_mul_ps(_mm_cvtepi32_ps(zy), scale);
+		__m128 c = _mm_mul_ps(_mm_cvtepi32_ps(yx), scale);
+		__m128 d = _mm_mul_ps(_mm_cvtepi32_ps(yy), scale);
+		__m128 z2 = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(a, a)), _mm_mul_ps(b, b)), zero));
+		__m128 z1 = _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(c, c)), _mm_mul_ps(d, d)), zero));
+		z2 = _mm_xor_ps(z2, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(zx, lowBit), 31)));
+		z1 = _mm_xor_ps(z1, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(yx, lowBit), 31)));
+
+		// row 0 = row 1 x row 2
+		__m128 r0x = _mm_sub_ps(_mm_mul_ps(d, z2), _mm_mul_ps(z1, b));
+		__m128 r0y = _mm_sub_ps(_mm_mul_ps(z1, a), _mm_mul_ps(c, z2));
+		__m128 r0z = _mm_sub_ps(_mm_mul_ps(c, b), _mm_mul_ps(d, a));
+		__m128 r0w = zero, r1w = zero, r2w = zero;
+		_MM_TRANSPOSE4_PS(r0x, r0y, r0z, r0w);
+		_MM_TRANSPOSE4_PS(c, d, z1, r1w);
+		_MM_TRANSPOSE4_PS(a, b, z2, r2w);
+		const __m128 rows[3][4] = { { r0x, r0y, r0z, r0w }, { c, d, z1, r1w }, { a, b, z2, r2w } };
+		for (int k = 0; k < 4; ++k) {
+			Matrix& matrix = matrices[i + k];
+			_mm_storeu_ps(matrix.m[0], rows[0][k]);
+			_mm_storeu_ps(matrix.m[1], rows[1][k]);
+			_mm_storeu_ps(matrix.m[2], rows[2][k]);
+			const Vector3& position = positions[i + k];
+			_mm_storeu_ps(matrix.m[3], _mm_setr_ps(position.x, position.y, position.z, 1.0f));
+		}
+	}
+	DecodeScalar(quads + i, positions + i, matrices + i, count - i);
+}
+
+// float to int32 truncation, 0 for NaN
+inline __m128i TruncateSse2(__m128 v)
+{
+	return _mm_and_si128(_mm_cvttps_epi32(v), _mm_castps_si128(_mm_cmpord_ps(v, v)));
+}
+
+void EncodeSse2(const Matrix* matrices, SpkMatrixQuad* quads, Vector3* positions, size_t count)
+{
+	const __m128 scale = _mm_set1_ps(fixedOne);
+	const __m128 limit = _mm_set1_ps(2147483648.0f); // 2^31
+	const __m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 zero = _mm_setzero_ps();
+	const __m128i lowBit = _mm_set1_epi32(1);
+	const __m128i notLowBit = _mm_set1_epi32(~1);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		// rows 2 and 1, transposed to X, Y, Z, W
+		__m128 x2 = _mm_loadu_ps(matrices[i].m[2]), y2 = _mm_loadu_ps(matrices[i + 1].m[2]);
+		__m128 z2 = _mm_loadu_ps(matrices[i + 2].m[2]), w2 = _mm_loadu_ps(matrices[i + 3].m[2]);
+		__m128 x1 = _mm_loadu_ps(matrices[i].m[1]), y1 = _mm_loadu_ps(matrices[i + 1].m[1]);
+		__m128 z1 = _mm_loadu_ps(matrices[i + 2].m[1]), w1 = _mm_loadu_ps(matrices[i + 3].m[1]);
+		_MM_TRANSPOSE4_PS(x2, y2, z2, w2);
+		_MM_TRANSPOSE4_PS(x1, y1, z1, w1);
+
+		__m128 vzx = _mm_mul_ps(x2, scale), vzy = _mm_mul_ps(y2, scale);
+		__m128 vyx = _mm_mul_ps(x1, scale), vyy = _mm_mul_ps(y1, scale);
+		// not(|v| >= 2^31) is true for NaN
+		__m128 inRange = _mm_and_ps(_mm_and_ps(_mm_cmpnge_ps(_mm_and_ps(vzx, signMask), limit), _mm_cmpnge_ps(_mm_and_ps(vzy, signMask), limit)),
+			_mm_and_ps(_mm_cmpnge_ps(_mm_and_ps(vyx, signMask), limit), _mm_cmpnge_ps(_mm_and_ps(vyy, signMask), limit)));
+		if (_mm_movemask_ps(inRange) != 15) {
+			EncodeScalar(matrices + i, quads + i, positions + i, 4);
+			continue;
+		}
+
+		__m128i zx = _mm_or_si128(_mm_and_si128(TruncateSse2(vzx), notLowBit), _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(z2, zero)), lowBit));
+		__m128i zy = TruncateSse2(vzy);
+		__m128i yx = _mm_or_si128(_mm_and_si128(TruncateSse2(vyx), notLowBit), _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(z1, zero)), lowBit));
+		__m128i yy = TruncateSse2(vyy);
+
+		// back to one quad per register
+		__m128i t0 = _mm_unpacklo_epi32(zx, zy);
+		__m128i t1 = _mm_unpacklo_epi32(yx, yy);
+		__m128i t2 = _mm_unpackhi_epi32(zx, zy);
+		__m128i t3 = _mm_unpackhi_epi32(yx, yy);
+		_mm_storeu_si128((__m128i*)&quads[i], _mm_unpacklo_epi64(t0, t1));
+		_mm_storeu_si128((__m128i*)&quads[i + 1], _mm_unpackhi_epi64(t0, t1));
+		_mm_storeu_si128((__m128i*)&quads[i + 2], _mm_unpacklo_epi64(t2, t3));
+		_mm_storeu_si128((__m128i*)&quads[i + 3], _mm_unpackhi_epi64(t2, t3));
+		for (int k = 0; k < 4; ++k)
+			positions[i + k] = matrices[i + k].getTranslationVector();
+	}
+	EncodeScalar(matrices + i, quads + i, positions + i, count - i);
+}
+
+// 4x4 transposes within each 128-bit lane
+MATRIXCODEC_TARGET_AVX2 inline void Transpose4x4Lanes(__m256& r0, __m256& r1, __m256& r2, __m256& r3)
+{
+	__m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpacklo_ps(r2, r3);
+	__m256 t2 = _mm256_unpackhi_ps(r0, r1), t3 = _mm256_unpackhi_ps(r2, r3);
+	r0 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+	r1 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+	r2 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	r3 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+MATRIXCODEC_TARGET_AVX2 inline __m256 LoadRowPair(const Matrix& low, const Matrix& high, int row)
+{
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(low.m[row])), _mm_loadu_ps(high.m[row]), 1);
+}
+
+// All ones in the lanes where -2^31 < v < 2^31, and for NaN
+MATRIXCODEC_TARGET_AVX2 inline __m256 InInt32Range(__m256 v)
+{
+	const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	return _mm256_cmp_ps(_mm256_and_ps(v, absMask), _mm256_set1_ps(2147483648.0f), _CMP_NGE_UQ);
+}
+
+// float to int32 truncation, 0 for NaN
+MATRIXCODEC_TARGET_AVX2 inline __m256i TruncateAvx2(__m256 v)
+{
+	return _mm256_and_si256(_mm256_cvttps_epi32(v), _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_ORD_Q)));
+}
+
+// Objects i..i+3 are in the low lanes, i+4..i+7 in the high lanes
+MATRIXCODEC_TARGET_AVX2 void DecodeAvx2(const SpkMatrixQuad* quads, const Vector3* positions, Matrix* matrices, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / fixedOne);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256i lowBit = _mm256_set1_epi32(1);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 q[4];
+		for (int k = 0; k < 4; ++k)
+			q[k] = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps((const float*)&quads[i + k])), _mm_loadu_ps((const float*)&quads[i + 4 + k]), 1);
+		Transpose4x4Lanes(q[0], q[1], q[2], q[3]);
+		__m256i zx = _mm256_castps_si256(q[0]), zy = _mm256_castps_si256(q[1]);
+		__m256i yx = _mm256_castps_si256(q[2]), yy = _mm256_castps_si256(q[3]);
+
+		__m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(zx), scale);
+		__m256 b = _mm256_mul_ps(_mm256_cvtepi32_ps(zy), scale);
+		__m256 c = _mm256_mul_ps(_mm256_cvtepi32_ps(yx), scale);
+		__m256 d = _mm256_mul_ps(_mm256_cvtepi32_ps(yy), scale);
+		__m256 z2 = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_sub_ps(one, _mm256_mul_ps(a, a)), _mm256_mul_ps(b, b)), zero));
+		__m256 z1 = _mm256_sqrt_ps(_mm256_max_ps(_mm256_sub_ps(_mm256_sub_ps(one, _mm256_mul_ps(c, c)), _mm256_mul_ps(d, d)), zero));
+		z2 = _mm256_xor_ps(z2, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(zx, lowBit), 31)));
+		z1 = _mm256_xor_ps(z1, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(yx, lowBit), 31)));
+
+		__m256 r0x = _mm256_sub_ps(_mm256_mul_ps(d, z2), _mm256_mul_ps(z1, b));
+		__m256 r0y = _mm256_sub_ps(_mm256_mul_ps(z1, a), _mm256_mul_ps(c, z2));
+		__m256 r0z = _mm256_sub_ps(_mm256_mul_ps(c, b), _mm256_mul_ps(d, a));
+		__m256 r0w = zero, r1w = zero, r2w = zero;
+		Transpose4x4Lanes(r0x, r0y, r0z, r0w);
+		Transpose4x4Lanes(c, d, z1, r1w);
+		Transpose4x4Lanes(a, b, z2, r2w);
+		const __m256 rows[3][4] = { { r0x, r0y, r0z, r0w }, { c, d, z1, r1w }, { a, b, z2, r2w } };
+		for (int k = 0; k < 4; ++k) {
+			for (int row = 0; row < 3; ++row) {
+				_mm_storeu_ps(matrices[i + k].m[row], _mm256_castps256_ps128(rows[row][k]));
+				_mm_storeu_ps(matrices[i + 4 + k].m[row], _mm256_extractf128_ps(rows[row][k], 1));
+			}
+		}
+		for (int k = 0; k < 8; ++k) {
+			const Vector3& position = positions[i + k];
+			_mm_storeu_ps(matrices[i + k].m[3], _mm_setr_ps(position.x, position.y, position.z, 1.0f));
+		}
+	}
+	DecodeSse2(quads + i, positions + i, matrices + i, count - i);
+}
+
+MATRIXCODEC_TARGET_AVX2 void EncodeAvx2(const Matrix* matrices, SpkMatrixQuad* quads, Vector3* positions, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(fixedOne);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256i lowBit = _mm256_set1_epi32(1);
+	const __m256i notLowBit = _mm256_set1_epi32(~1);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 r2[4], r1[4];
+		for (int k = 0; k < 4; ++k) {
+			r2[k] = LoadRowPair(matrices[i + k], matrices[i + 4 + k], 2);
+			r1[k] = LoadRowPair(matrices[i + k], matrices[i + 4 + k], 1);
+		}
+		Transpose4x4Lanes(r2[0], r2[1], r2[2], r2[3]);
+		Transpose4x4Lanes(r1[0], r1[1], r1[2], r1[3]);
+
+		__m256 vzx = _mm256_mul_ps(r2[0], scale), vzy = _mm256_mul_ps(r2[1], scale);
+		__m256 vyx = _mm256_mul_ps(r1[0], scale), vyy = _mm256_mul_ps(r1[1], scale);
+		__m256 inRange = _mm256_and_ps(_mm256_and_ps(InInt32Range(vzx), InInt32Range(vzy)), _mm256_and_ps(InInt32Range(vyx), InInt32Range(vyy)));
+		if (_mm256_movemask_ps(inRange) != 255) {
+			EncodeSse2(matrices + i, quads + i, positions + i, 8);
+			continue;
+		}
+
+		__m256i zx = _mm256_or_si256(_mm256_and_si256(TruncateAvx2(vzx), notLowBit),
+			_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(r2[2], zero, _CMP_LT_OQ)), lowBit));
+		__m256i zy = TruncateAvx2(vzy);
+		__m256i yx = _mm256_or_si256(_mm256_and_si256(TruncateAvx2(vyx), notLowBit),
+			_mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(r1[2], zero, _CMP_LT_OQ)), lowBit));
+		__m256i yy = TruncateAvx2(vyy);
+
+		__m256 out[4] = { _mm256_castsi256_ps(zx), _mm256_castsi256_ps(zy), _mm256_castsi256_ps(yx), _mm256_castsi256_ps(yy) };
+		Transpose4x4Lanes(out[0], out[1], out[2], out[3]);
+		for (int k = 0; k < 4; ++k) {
+			_mm_storeu_ps((float*)&quads[i + k], _mm256_castps256_ps128(out[k]));
+			_mm_storeu_ps((float*)&quads[i + 4 + k], _mm256_extractf128_ps(out[k], 1));
+		}
+		for (int k = 0; k < 8; ++k)
+			positions[i + k] = matrices[i + k].getTranslationVector();
+	}
+	EncodeSse2(matrices + i, quads + i, positions + i, count - i);
+}
+
+bool CpuHasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	const bool osxsave = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) // the OS saves the YMM registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+} // namespace
+
+MatrixCodec::Isa MatrixCodec::GetBestIsa()
+{
+#ifdef MATRIXCODEC_X86
+	static const Isa best = CpuHasAvx2() ? Isa::AVX2 : Isa::SSE2;
+	return best;
+#else
+	return Isa::Scalar;
+#endif
+}
+
+const char* MatrixCodec::GetIsaName(Isa isa)
+{
+	switch (isa) {
+	case Isa::Scalar: return "scalar";
+	case Isa::SSE2: return "SSE2";
+	case Isa::AVX2: return "AVX2";
+	}
+	return "?";
+}
+
+void MatrixCodec::Decode(Span<const SpkMatrixQuad> quads, Span<const Vector3> positions, Span<Matrix> matrices, Isa isa)
+{
+	assert(quads.size() == matrices.size() && positions.size() == matrices.size());
+	switch (isa) {
+#ifdef MATRIXCODEC_X86
+	case Isa::AVX2: DecodeAvx2(quads.data(), positions.data(), matrices.data(), matrices.size()); return;
+	case Isa::SSE2: DecodeSse2(quads.data(), positions.data(), matrices.data(), matrices.size()); return;
+#endif
+	default: DecodeScalar(quads.data(), positions.data(), matrices.data(), matrices.size()); return;
+	}
+}
+
+void MatrixCodec::Encode(Span<const Matrix> matrices, Span<SpkMatrixQuad> quads, Span<Vector3> positions, Isa isa)
+{
+	assert(quads.size() == matrices.size() && positions.size() == matrices.size());
+	switch (isa) {
+#ifdef MATRIXCODEC_X86
+	case Isa::AVX2: EncodeAvx2(matrices.data(), quads.data(), positions.data(), matrices.size()); return;
+	case Isa::SSE2: EncodeSse2(matrices.data(), quads.data(), positions.data(), matrices.size()); return;
+#endif
+	default: EncodeScalar(matrices.data(), quads.data(), positions.data(), matrices.size()); return;
+	}
+}
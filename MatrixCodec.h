@@ -0,0 +1,33 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include "Span.h"
+#include "SpkSections.h"
+#include "vecmat.h"
+
+// Batch conversion between object matrices and their Pack.SPK form:
+// rotation as a SpkMatrixQuad in PMTX, position in PPOS.
+// The SIMD implementations give bit-identical results to the scalar one.
+namespace MatrixCodec {
+	enum class Isa {
+		Scalar,
+		SSE2,
+		AVX2,
+	};
+
+	// Best instruction set supported by the CPU
+	Isa GetBestIsa();
+	const char* GetIsaName(Isa isa);
+
+	// Matrices from the rotations and positions, all spans must have the same size
+	void Decode(Span<const SpkMatrixQuad> quads, Span<const Vector3> positions, Span<Matrix> matrices, Isa isa = GetBestIsa());
+
+	// Rotations and positions from the matrices.
+	// The rotation's X and Y components are truncated to 2.30 fixed point as by a float to uint32_t conversion,
+	// NaN giving 0.
+	void Encode(Span<const Matrix> matrices, Span<SpkMatrixQuad> quads, Span<Vector3> positions, Isa isa = GetBestIsa());
+}
@@ -312,17 +312,14 @@ std::optional<std::pair<Mesh, std::optional<Chunk>>> ImportWithAssimp(const std:
 
 		// HMTX: Bone transform matrices
 
-		hmtx.multidata.resize(numBones);
-		uint32_t boneIndex = 0;
+		hmtx.multidata.reserve(numBones, numBones * sizeof(double) * 4 * 3);
 		for (auto& [boneName, boneInfo] : boneInfos) {
-			hmtx.multidata[boneIndex].resize(sizeof(double) * 4 * 3);
-			double* mat = (double*)hmtx.multidata[boneIndex].data();
+			double* mat = (double*)hmtx.multidata.append(sizeof(double) * 4 * 3).data();
 			for (int row = 3; row >= 0; --row) {
 				*mat++ = (double)boneInfo->transform.m[row][0];
 				*mat++ = (double)boneInfo->transform.m[row][1];
 				*mat++ = (double)boneInfo->transform.m[row][2];
 			}
-			boneIndex += 1;
 		}
 
 		// HPRE: Bone info
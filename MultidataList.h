@@ -0,0 +1,107 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+
+#include "DynArray.h"
+#include "Span.h"
+
+// Multidata of a chunk: a list of byte strings laid out one after the other in a single buffer,
+// as in the serialized chunk, with a table of where each element ends.
+// Appending an element only grows the two buffers, which can come from any memory resource like DynArray.
+// Elements are accessed as spans, which are invalidated by appending.
+class MultidataList {
+public:
+	template <class T> class BasicIterator {
+		T* bytes; const uint32_t* end; uint32_t start;
+	public:
+		BasicIterator(T* bytes, const uint32_t* end, uint32_t start) : bytes(bytes), end(end), start(start) {}
+		Span<T> operator*() const { return { bytes + start, *end - start }; }
+		BasicIterator& operator++() { start = *(end++); return *this; }
+		bool operator==(const BasicIterator& other) const { return end == other.end; }
+		bool operator!=(const BasicIterator& other) const { return end != other.end; }
+	};
+	using Iterator = BasicIterator<uint8_t>;
+	using ConstIterator = BasicIterator<const uint8_t>;
+
+	MultidataList() = default;
+	explicit MultidataList(std::pmr::memory_resource* resource) : bytes(resource), ends(resource) {}
+
+	size_t size() const { return ends.size(); }
+	bool empty() const { return ends.empty(); }
+	// Sum of the sizes of all elements
+	size_t totalSize() const { return bytes.size(); }
+	// All elements, contiguous
+	const uint8_t* data() const { return bytes.data(); }
+
+	Span<uint8_t> operator[](size_t index) { return { bytes.data() + start(index), ends[index] - start(index) }; }
+	Span<const uint8_t> operator[](size_t index) const { return { bytes.data() + start(index), ends[index] - start(index) }; }
+
+	Iterator begin() { return { bytes.data(), ends.data(), 0 }; }
+	Iterator end() { return { bytes.data(), ends.data() + ends.size(), 0 }; }
+	ConstIterator begin() const { return { bytes.data(), ends.data(), 0 }; }
+	ConstIterator end() const { return { bytes.data(), ends.data() + ends.size(), 0 }; }
+
+	// Adds an element of given size, left uninitialized
+	Span<uint8_t> append(size_t size) {
+		assert(bytes.size() + size <= UINT32_MAX);
+		size_t offset = bytes.size();
+		bytes.resize(offset + size);
+		ends.push_back((uint32_t)bytes.size());
+		return { bytes.data() + offset, size };
+	}
+	Span<uint8_t> append(const void* data, size_t size) {
+		Span<uint8_t> element = append(size);
+		if (size)
+			memcpy(element.data(), data, size);
+		return element;
+	}
+	// Adds a null-terminated string
+	Span<uint8_t> appendString(std::string_view str) {
+		Span<uint8_t> element = append(str.size() + 1);
+		memcpy(element.data(), str.data(), str.size());
+		element[str.size()] = 0;
+		return element;
+	}
+
+	// Replaces the elements by the ones with the given sizes, stored contiguously at data
+	void assign(Span<const uint32_t> sizes, const uint8_t* data) {
+		ends.resize(sizes.size());
+		uint32_t offset = 0;
+		for (size_t i = 0; i < sizes.size(); ++i)
+			ends[i] = offset += sizes[i];
+		bytes.assign(data, offset);
+	}
+
+	void reserve(size_t count, size_t totalBytes) {
+		ends.reserve(count);
+		bytes.reserve(totalBytes);
+	}
+	void clear() {
+		bytes.clear();
+		ends.clear();
+	}
+
+	// Drops the elements and draws future storage from the resource instead
+	void setResource(std::pmr::memory_resource* resource) {
+		bytes.setResource(resource);
+		ends.setResource(resource);
+	}
+
+private:
+	DynArray<uint8_t> bytes;
+	DynArray<uint32_t> ends;
+
+	uint32_t start(size_t index) const {
+		assert(index < ends.size());
+		return index ? ends[index - 1] : 0;
+	}
+};
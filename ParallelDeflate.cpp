@@ -0,0 +1,141 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#include "ParallelDeflate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <miniz/miniz.h>
+
+// CRC32 combination from zlib, by multiplying with the CRC of length2 zeros in GF(2)
+static uint32_t Gf2MatrixTimes(const uint32_t* mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void Gf2MatrixSquare(uint32_t* square, const uint32_t* mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = Gf2MatrixTimes(mat, mat[n]);
+}
+
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+	if (length2 == 0)
+		return crc1;
+
+	uint32_t even[32], odd[32];
+	// operator for one zero bit
+	odd[0] = 0xEDB88320;
+	uint32_t row = 1;
+	for (int n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	Gf2MatrixSquare(even, odd); // two zero bits
+	Gf2MatrixSquare(odd, even); // four zero bits
+
+	// apply length2 zeros to crc1, starting with one zero byte
+	do {
+		Gf2MatrixSquare(even, odd);
+		if (length2 & 1)
+			crc1 = Gf2MatrixTimes(even, crc1);
+		length2 >>= 1;
+		if (length2 == 0)
+			break;
+		Gf2MatrixSquare(odd, even);
+		if (length2 & 1)
+			crc1 = Gf2MatrixTimes(odd, crc1);
+		length2 >>= 1;
+	} while (length2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+bool DeflateParallel(Span<DeflateJob> jobs, int level, unsigned int numThreads, size_t blockSize)
+{
+	struct Block {
+		DeflateJob* job;
+		size_t offset, size;
+		bool last;
+		std::vector<uint8_t> compressed;
+		uint32_t crc32 = 0;
+	};
+	std::vector<Block> blocks;
+	for (DeflateJob& job : jobs) {
+		size_t offset = 0;
+		do {
+			size_t size = std::min(blockSize, job.size - offset);
+			blocks.push_back({ &job, offset, size, offset + size == job.size, {}, 0 });
+			offset += size;
+		} while (offset < job.size);
+	}
+
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	numThreads = (unsigned int)std::min<size_t>(numThreads, blocks.size());
+
+	// Raw deflate (negative window bits) as ZIP entries have no zlib header.
+	// All blocks but the last end with a full flush, so that they are byte-aligned and
+	// don't refer to the previous blocks, and the last one finishes the stream.
+	const int flags = (int)tdefl_create_comp_flags_from_zip_params(level, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+	std::atomic<size_t> next = 0;
+	std::atomic<bool> failed = false;
+	auto worker = [&blocks, &next, &failed, flags]() {
+		tdefl_compressor* compressor = tdefl_compressor_alloc();
+		if (!compressor) {
+			failed = true;
+			return;
+		}
+		auto putBuf = [](const void* buf, int len, void* user) -> mz_bool {
+			auto* out = (std::vector<uint8_t>*)user;
+			out->insert(out->end(), (const uint8_t*)buf, (const uint8_t*)buf + len);
+			return MZ_TRUE;
+		};
+		std::vector<uint8_t> input;
+		size_t i;
+		while ((i = next++) < blocks.size()) {
+			Block& block = blocks[i];
+			input.resize(block.size);
+			if (block.size)
+				block.job->read(block.offset, input.data(), block.size);
+			block.crc32 = (uint32_t)mz_crc32(MZ_CRC32_INIT, input.data(), block.size);
+			block.compressed.reserve(block.size / 2);
+			tdefl_init(compressor, putBuf, &block.compressed, flags);
+			tdefl_status status = tdefl_compress_buffer(compressor, input.data(), block.size, block.last ? TDEFL_FINISH : TDEFL_FULL_FLUSH);
+			if (status != (block.last ? TDEFL_STATUS_DONE : TDEFL_STATUS_OKAY))
+				failed = true;
+		}
+		tdefl_compressor_free(compressor);
+	};
+	std::vector<std::thread> threads;
+	for (unsigned int t = 1; t < numThreads; ++t)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+	if (failed)
+		return false;
+
+	for (DeflateJob& job : jobs) {
+		job.compressed.clear();
+		job.crc32 = MZ_CRC32_INIT;
+	}
+	for (Block& block : blocks) {
+		DeflateJob& job = *block.job;
+		job.compressed.insert(job.compressed.end(), block.compressed.begin(), block.compressed.end());
+		job.crc32 = Crc32Combine(job.crc32, block.crc32, block.size);
+	}
+	return true;
+}
@@ -0,0 +1,32 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "Span.h"
+
+// Data to deflate, and the result
+struct DeflateJob {
+	size_t size = 0;
+	// Reads bytes of the data to compress, called from multiple threads at once
+	std::function<void(size_t offset, void* dest, size_t length)> read;
+
+	std::vector<uint8_t> compressed; // raw deflate stream, as stored in ZIP entries
+	uint32_t crc32 = 0;
+};
+
+// Deflates the jobs on multiple threads (0 = number of cores).
+// The data is split in blocks that are compressed independently and then concatenated
+// into a single deflate stream, so a big job is shared between threads too.
+// Returns false if compression failed.
+bool DeflateParallel(Span<DeflateJob> jobs, int level, unsigned int numThreads = 0, size_t blockSize = 4 << 20);
+
+// CRC32 of the concatenation of two buffers, from their CRC32s and the length of the second one
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
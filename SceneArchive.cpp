@@ -0,0 +1,528 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#include "SceneArchive.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <unordered_map>
+
+#include "chunk.h"
+#include "MappedFile.h"
+#include "ParallelDeflate.h"
+
+#include <miniz/miniz.h>
+
+static std::string ToLower(std::string str)
+{
+	for (char& c : str)
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+	return str;
+}
+
+// Deflate level of an entry from its deflate option flags (bits 1 and 2), as written by most ZIP tools.
+// miniz doesn't set them, so the entries it writes all look like they have the normal level.
+static int DeflateLevelFromFlags(uint16_t bitFlags)
+{
+	switch ((bitFlags >> 1) & 3) {
+	case 1: return MZ_BEST_COMPRESSION; // maximum
+	case 2: return 2;                   // fast
+	case 3: return MZ_BEST_SPEED;       // super fast
+	}
+	return MZ_DEFAULT_LEVEL;            // normal
+}
+
+namespace {
+
+class BufferArchiveFile : public ArchiveFile {
+public:
+	explicit BufferArchiveFile(size_t size) : buffer(new uint8_t[size]) { pointer = buffer.get(); length = size; }
+	uint8_t* buf() { return buffer.get(); }
+private:
+	std::unique_ptr<uint8_t[]> buffer;
+};
+
+// File from the cache of small files, shared with other reads of it
+class CachedArchiveFile : public ArchiveFile {
+public:
+	explicit CachedArchiveFile(std::shared_ptr<const BufferArchiveFile> cached) : cached(std::move(cached)) {
+		pointer = this->cached->data();
+		length = this->cached->size();
+	}
+private:
+	std::shared_ptr<const BufferArchiveFile> cached;
+};
+
+class MappedArchiveFile : public ArchiveFile {
+public:
+	bool open(const std::filesystem::path& path) {
+		if (!file.open(path))
+			return false;
+		pointer = file.data();
+		length = file.size();
+		return true;
+	}
+private:
+	MappedFile file;
+};
+
+// ZIP mapped in memory.
+// The central directory is read once when opening, into an index of the entries by name.
+// The entries are then read directly from the mapping without any shared state,
+// so reads can be done from multiple threads at once.
+class ZipSceneArchive : public SceneArchive {
+public:
+	~ZipSceneArchive() {
+		if (readerOpen)
+			mz_zip_reader_end(&reader);
+	}
+
+	bool open(const std::filesystem::path& path) {
+		archivePath = path;
+		if (!file.open(path))
+			return false;
+		mz_zip_zero_struct(&reader);
+		if (!mz_zip_reader_init_mem(&reader, file.data(), file.size(), 0))
+			return false;
+		readerOpen = true;
+		mz_uint numFiles = mz_zip_reader_get_num_files(&reader);
+		entries.reserve(numFiles);
+		for (mz_uint i = 0; i < numFiles; ++i) {
+			mz_zip_archive_file_stat stat;
+			if (!mz_zip_reader_file_stat(&reader, i, &stat) || stat.m_is_directory)
+				continue;
+			Entry& entry = entries.emplace_back();
+			entry.name = stat.m_filename;
+			entry.zipIndex = i;
+			entry.localHeaderOffset = stat.m_local_header_ofs;
+			entry.compSize = stat.m_comp_size;
+			entry.uncompSize = stat.m_uncomp_size;
+			entry.crc32 = stat.m_crc32;
+			entry.method = stat.m_method;
+			entry.bitFlags = stat.m_bit_flag;
+			entry.supported = stat.m_is_supported && !stat.m_is_encrypted;
+			indices.try_emplace(ToLower(entry.name), entries.size() - 1);
+		}
+		return true;
+	}
+
+	// Index of the file in the ZIP, -1 if not found
+	int indexOf(const std::string& name) const {
+		const Entry* entry = findEntry(name);
+		return entry ? (int)entry->zipIndex : -1;
+	}
+
+	// Deflate level of the file: 0 if stored, from its deflate option flags if deflated,
+	// -1 if not found or compressed with another method
+	int levelOf(const std::string& name) const {
+		const Entry* entry = findEntry(name);
+		if (!entry || (entry->method != 0 && entry->method != MZ_DEFLATED))
+			return -1;
+		return (entry->method == 0) ? MZ_NO_COMPRESSION : DeflateLevelFromFlags(entry->bitFlags);
+	}
+
+	// Reader for copying entries to another ZIP, only for the main thread
+	mz_zip_archive* copyReader() const { return &reader; }
+
+	bool isFolder() const override { return false; }
+
+	std::vector<std::string> listFiles() const override {
+		std::vector<std::string> names;
+		names.reserve(entries.size());
+		for (const Entry& entry : entries)
+			names.push_back(entry.name);
+		return names;
+	}
+
+	bool contains(const std::string& name) const override { return findEntry(name) != nullptr; }
+
+	std::unique_ptr<ArchiveFile> readFile(const std::string& name) const override {
+		const Entry* entry = findEntry(name);
+		if (!entry)
+			return nullptr;
+		if (entry->uncompSize > maxCachedSize) {
+			auto contents = std::make_unique<BufferArchiveFile>((size_t)entry->uncompSize);
+			if (!extract(*entry, contents->buf(), nullptr))
+				return nullptr;
+			return contents;
+		}
+
+		// Small files like scripts are cached, as they are read again and again (e.g. includes)
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto& cached = cache[entry];
+		if (!cached) {
+			auto contents = std::make_shared<BufferArchiveFile>((size_t)entry->uncompSize);
+			if (!extract(*entry, contents->buf(), nullptr))
+				return nullptr;
+			cached = std::move(contents);
+		}
+		return std::make_unique<CachedArchiveFile>(cached);
+	}
+
+	bool readFileStreaming(const std::string& name, const std::function<uint8_t* (size_t)>& setSize,
+		const std::function<void(size_t)>& progress) const override
+	{
+		const Entry* entry = findEntry(name);
+		if (!entry)
+			return false;
+		uint8_t* dest = setSize((size_t)entry->uncompSize);
+		return extract(*entry, dest, &progress);
+	}
+
+private:
+	struct Entry {
+		std::string name;
+		mz_uint zipIndex;
+		uint64_t localHeaderOffset;
+		uint64_t compSize, uncompSize;
+		uint32_t crc32;
+		uint16_t method;
+		uint16_t bitFlags;
+		bool supported;
+	};
+
+	static constexpr uint64_t maxCachedSize = 256 * 1024;
+	static constexpr size_t blockSize = 256 * 1024;
+
+	MappedFile file;
+	mutable mz_zip_archive reader;
+	bool readerOpen = false;
+	std::vector<Entry> entries;
+	std::unordered_map<std::string, size_t> indices; // by lowercase name
+	mutable std::mutex cacheMutex;
+	mutable std::unordered_map<const Entry*, std::shared_ptr<const BufferArchiveFile>> cache;
+
+	const Entry* findEntry(const std::string& name) const {
+		auto it = indices.find(ToLower(name));
+		return (it != indices.end()) ? &entries[it->second] : nullptr;
+	}
+
+	// Decompresses the entry to dest (of uncompSize bytes), calling progress after each block,
+	// and checks the CRC
+	bool extract(const Entry& entry, uint8_t* dest, const std::function<void(size_t)>* progress) const {
+		if (!entry.supported || (entry.method != 0 && entry.method != MZ_DEFLATED))
+			return false;
+
+		// The compressed data follows the local header, whose name and extra field may differ from the central directory
+		static constexpr size_t localHeaderSize = 30;
+		const uint8_t* zip = file.data();
+		if (entry.localHeaderOffset + localHeaderSize > file.size())
+			return false;
+		const uint8_t* localHeader = zip + entry.localHeaderOffset;
+		if (localHeader[0] != 'P' || localHeader[1] != 'K' || localHeader[2] != 3 || localHeader[3] != 4)
+			return false;
+		uint64_t dataOffset = entry.localHeaderOffset + localHeaderSize
+			+ (localHeader[26] | (localHeader[27] << 8)) + (localHeader[28] | (localHeader[29] << 8));
+		if (dataOffset + entry.compSize > file.size())
+			return false;
+		const uint8_t* src = zip + dataOffset;
+		const size_t srcSize = (size_t)entry.compSize, destSize = (size_t)entry.uncompSize;
+
+		mz_ulong crc = MZ_CRC32_INIT;
+		if (entry.method == 0) {
+			if (srcSize != destSize)
+				return false;
+			for (size_t pos = 0; pos < destSize;) {
+				size_t n = std::min(blockSize, destSize - pos);
+				memcpy(dest + pos, src + pos, n);
+				crc = mz_crc32(crc, dest + pos, n);
+				pos += n;
+				if (progress)
+					(*progress)(pos);
+			}
+			return (uint32_t)crc == entry.crc32;
+		}
+
+		// Raw deflate, inflated one block of output at a time
+		auto decompressor = std::make_unique<tinfl_decompressor>();
+		tinfl_init(decompressor.get());
+		size_t inPos = 0, outPos = 0;
+		while (true) {
+			size_t inBytes = srcSize - inPos;
+			size_t outBytes = std::min(blockSize, destSize - outPos);
+			tinfl_status status = tinfl_decompress(decompressor.get(), src + inPos, &inBytes, dest, dest + outPos, &outBytes,
+				TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+			crc = mz_crc32(crc, dest + outPos, outBytes);
+			inPos += inBytes;
+			outPos += outBytes;
+			if (progress && outBytes)
+				(*progress)(outPos);
+			if (status == TINFL_STATUS_DONE)
+				break;
+			// More output than the entry's size, or corrupt data
+			if (status != TINFL_STATUS_HAS_MORE_OUTPUT || (outPos == destSize && outBytes == 0))
+				return false;
+		}
+		return outPos == destSize && (uint32_t)crc == entry.crc32;
+	}
+};
+
+// Extracted scene folder, the files are mapped when read
+class FolderSceneArchive : public SceneArchive {
+public:
+	explicit FolderSceneArchive(const std::filesystem::path& path) { archivePath = path; }
+
+	bool isFolder() const override { return true; }
+
+	std::vector<std::string> listFiles() const override {
+		std::vector<std::string> names;
+		std::error_code ec;
+		for (auto it = std::filesystem::recursive_directory_iterator(archivePath, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+			if (it->is_regular_file(ec))
+				names.push_back(std::filesystem::relative(it->path(), archivePath, ec).generic_u8string());
+		return names;
+	}
+
+	bool contains(const std::string& name) const override {
+		std::error_code ec;
+		return std::filesystem::is_regular_file(archivePath / std::filesystem::u8path(name), ec);
+	}
+
+	std::unique_ptr<ArchiveFile> readFile(const std::string& name) const override {
+		auto file = std::make_unique<MappedArchiveFile>();
+		if (!file->open(archivePath / std::filesystem::u8path(name)))
+			return nullptr;
+		return file;
+	}
+
+	bool readFileStreaming(const std::string& name, const std::function<uint8_t* (size_t)>& setSize,
+		const std::function<void(size_t)>& progress) const override
+	{
+		static constexpr size_t blockSize = 1024 * 1024;
+		MappedFile file;
+		if (!file.open(archivePath / std::filesystem::u8path(name)))
+			return false;
+		uint8_t* dest = setSize(file.size());
+		for (size_t pos = 0; pos < file.size();) {
+			size_t n = std::min(blockSize, file.size() - pos);
+			memcpy(dest + pos, file.data() + pos, n);
+			pos += n;
+			progress(pos);
+		}
+		return true;
+	}
+};
+
+// ZIP written to a temporary file
+class ZipArchiveWriter : public SceneArchiveWriter {
+public:
+	ZipArchiveWriter(int level, unsigned int deflateThreads) : level(level), deflateThreads(deflateThreads) {}
+	~ZipArchiveWriter() {
+		if (writerOpen)
+			mz_zip_writer_end(&zip);
+		if (file)
+			fclose(file);
+		std::error_code ec;
+		if (!committed)
+			std::filesystem::remove(tempPath, ec);
+	}
+
+	bool create(const std::filesystem::path& path) {
+		finalPath = path;
+		tempPath = path;
+		tempPath += L".tmp";
+		_wfopen_s(&file, tempPath.c_str(), L"wb");
+		if (!file)
+			return false;
+		mz_zip_zero_struct(&zip);
+		writerOpen = mz_zip_writer_init_cfile(&zip, file, 0);
+		return writerOpen;
+	}
+
+	bool addFile(const std::string& name, const void* data, size_t size) override {
+		return mz_zip_writer_add_mem(&zip, name.c_str(), data, size, level);
+	}
+
+	// With one thread, the chunks are streamed to the ZIP writer, no need to build the whole file in memory.
+	// Else they are deflated together on worker threads, then added as already compressed entries.
+	bool addChunks(Span<const std::pair<std::string, const Chunk*>> chunks) override {
+		MZ_TIME_T fileTime = time(nullptr);
+		if (deflateThreads == 1) {
+			for (const auto& [name, chk] : chunks) {
+				ChunkSerializer serializer(*chk);
+				auto readFunc = [](void* opaque, mz_uint64 offset, void* buf, size_t n) -> size_t {
+					return ((ChunkSerializer*)opaque)->read((size_t)offset, buf, n);
+				};
+				if (!mz_zip_writer_add_read_buf_callback(&zip, name.c_str(), readFunc, &serializer, serializer.size(), &fileTime, nullptr, 0, level, nullptr, 0, nullptr, 0))
+					return false;
+			}
+			return true;
+		}
+
+		std::vector<std::unique_ptr<ChunkSerializer>> serializers;
+		std::vector<DeflateJob> jobs(chunks.size());
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			const ChunkSerializer* serializer = serializers.emplace_back(std::make_unique<ChunkSerializer>(*chunks[i].second)).get();
+			jobs[i].size = serializer->size();
+			jobs[i].read = [serializer](size_t offset, void* dest, size_t length) { serializer->readAt(offset, dest, length); };
+		}
+		auto compressStart = std::chrono::steady_clock::now();
+		bool compressed = DeflateParallel({ jobs.data(), jobs.size() }, level, deflateThreads);
+		compressSecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - compressStart).count();
+		if (!compressed)
+			return false;
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			const DeflateJob& job = jobs[i];
+			if (!mz_zip_writer_add_mem_ex_v2(&zip, chunks[i].first.c_str(), job.compressed.data(), job.compressed.size(), nullptr, 0,
+				level | MZ_ZIP_FLAG_COMPRESSED_DATA, job.size, job.crc32, &fileTime, nullptr, 0, nullptr, 0))
+				return false;
+		}
+		return true;
+	}
+
+	// The level of an entry is the source's known level if there is one: an entry it stores
+	// was not made smaller by deflating at that level, as miniz then stores it.
+	// Else it is taken from the entry, and a stored entry is only copied as is when not compressing.
+	bool copiesAsIs(const SceneArchive& source, const std::string& name, int sourceLevel, bool recompress) const override {
+		auto* sourceZip = dynamic_cast<const ZipSceneArchive*>(&source);
+		if (recompress || !sourceZip)
+			return false;
+		int entryLevel = sourceZip->levelOf(name);
+		if (entryLevel >= 0 && sourceLevel >= 0)
+			entryLevel = sourceLevel;
+		return entryLevel >= 0 && entryLevel >= level;
+	}
+
+	bool copyFile(const SceneArchive& source, const std::string& name, int sourceLevel, bool recompress) override {
+		if (copiesAsIs(source, name, sourceLevel, recompress)) {
+			const auto& sourceZip = static_cast<const ZipSceneArchive&>(source);
+			int index = sourceZip.indexOf(name);
+			return index != -1 && mz_zip_writer_add_from_zip_reader(&zip, sourceZip.copyReader(), (mz_uint)index);
+		}
+		auto contents = source.readFile(name);
+		return contents && addFile(name, contents->data(), contents->size());
+	}
+
+	// Nothing to do, the new ZIP only has the files added to it
+	void removeFile(const std::string& /*name*/) override {}
+
+	bool finish() override {
+		bool success = mz_zip_writer_finalize_archive(&zip);
+		mz_zip_writer_end(&zip);
+		writerOpen = false;
+		bytesWritten = (uint64_t)_ftelli64(file);
+		success = (fclose(file) == 0) && success;
+		file = nullptr;
+		return success;
+	}
+
+	bool commit() override {
+		std::error_code ec;
+		std::filesystem::rename(tempPath, finalPath, ec);
+		committed = !ec;
+		return committed;
+	}
+
+private:
+	mz_zip_archive zip;
+	bool writerOpen = false;
+	FILE* file = nullptr;
+	std::filesystem::path finalPath, tempPath;
+	bool committed = false;
+	int level;
+	unsigned int deflateThreads;
+};
+
+// Files written uncompressed into a folder with buffered I/O
+class FolderArchiveWriter : public SceneArchiveWriter {
+public:
+	explicit FolderArchiveWriter(const std::filesystem::path& path) : folder(path) {}
+
+	bool addFile(const std::string& name, const void* data, size_t size) override {
+		return writeFile(name, [data, size](FILE* file) { return size == 0 || fwrite(data, size, 1, file) == 1; });
+	}
+
+	bool addChunks(Span<const std::pair<std::string, const Chunk*>> chunks) override {
+		for (const auto& [name, chk] : chunks) {
+			ChunkSerializer serializer(*chk);
+			if (!writeFile(name, [&serializer](FILE* file) { return serializer.writeToFile(file); }))
+				return false;
+		}
+		return true;
+	}
+
+	// The files are written uncompressed, whatever their source
+	bool copiesAsIs(const SceneArchive& /*source*/, const std::string& /*name*/, int /*sourceLevel*/, bool /*recompress*/) const override { return true; }
+
+	bool copyFile(const SceneArchive& source, const std::string& name, int /*sourceLevel*/, bool /*recompress*/) override {
+		// Saving to the folder the scene was opened from: the file is already there
+		std::error_code ec;
+		if (source.isFolder() && std::filesystem::equivalent(source.path(), folder, ec))
+			return true;
+		auto contents = source.readFile(name);
+		return contents && addFile(name, contents->data(), contents->size());
+	}
+
+	void removeFile(const std::string& name) override {
+		std::error_code ec;
+		std::filesystem::remove(folder / std::filesystem::u8path(name), ec);
+	}
+
+	bool finish() override { return !failed; }
+	bool commit() override { return !failed; }
+
+private:
+	std::filesystem::path folder;
+	bool failed = false;
+
+	// Writes the file next to the old one first, so that a failed save doesn't leave it truncated
+	template<typename Func> bool writeFile(const std::string& name, Func func) {
+		std::filesystem::path path = folder / std::filesystem::u8path(name);
+		std::filesystem::path tempPath = path;
+		tempPath += L".tmp";
+		std::error_code ec;
+		std::filesystem::create_directories(path.parent_path(), ec);
+		FILE* file = nullptr;
+		_wfopen_s(&file, tempPath.c_str(), L"wb");
+		bool success = false;
+		if (file) {
+			setvbuf(file, nullptr, _IOFBF, 1024 * 1024);
+			success = func(file);
+			bytesWritten += (uint64_t)_ftelli64(file);
+			success = (fclose(file) == 0) && success;
+		}
+		if (success)
+			std::filesystem::rename(tempPath, path, ec);
+		if (!success || ec) {
+			std::filesystem::remove(tempPath, ec);
+			failed = true;
+			return false;
+		}
+		return true;
+	}
+};
+
+} // namespace
+
+bool SceneArchive::isFolderPath(const std::filesystem::path& path)
+{
+	std::error_code ec;
+	return std::filesystem::is_directory(path, ec);
+}
+
+std::unique_ptr<SceneArchive> SceneArchive::open(const std::filesystem::path& path)
+{
+	if (isFolderPath(path))
+		return std::make_unique<FolderSceneArchive>(path);
+	auto zip = std::make_unique<ZipSceneArchive>();
+	if (!zip->open(path))
+		return nullptr;
+	return zip;
+}
+
+std::unique_ptr<SceneArchiveWriter> SceneArchiveWriter::create(const std::filesystem::path& path, int level, unsigned int deflateThreads)
+{
+	if (SceneArchive::isFolderPath(path))
+		return std::make_unique<FolderArchiveWriter>(path);
+	auto zip = std::make_unique<ZipArchiveWriter>(level, deflateThreads);
+	if (!zip->create(path))
+		return nullptr;
+	return zip;
+}
@@ -0,0 +1,97 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Span.h"
+
+struct Chunk;
+
+// Contents of a file read from a scene archive
+class ArchiveFile {
+public:
+	virtual ~ArchiveFile() = default;
+	const uint8_t* data() const { return pointer; }
+	size_t size() const { return length; }
+
+protected:
+	const uint8_t* pointer = nullptr;
+	size_t length = 0;
+};
+
+// Files of a scene (Pack.SPK, Pack.PAL, ..., scripts), either in a ZIP or in an extracted folder.
+// File names use '/' as separator and are case-insensitive.
+class SceneArchive {
+public:
+	virtual ~SceneArchive() = default;
+
+	// Opens a scene ZIP, or a folder if the path is a directory. Null if it couldn't be opened.
+	static std::unique_ptr<SceneArchive> open(const std::filesystem::path& path);
+	static bool isFolderPath(const std::filesystem::path& path);
+
+	const std::filesystem::path& path() const { return archivePath; }
+	virtual bool isFolder() const = 0;
+
+	virtual std::vector<std::string> listFiles() const = 0;
+	virtual bool contains(const std::string& name) const = 0;
+
+	// Reads a whole file, null if missing or corrupt. Can be called from multiple threads.
+	// Files of folders are memory-mapped, small files of ZIPs (like scripts) are decompressed once and cached.
+	virtual std::unique_ptr<ArchiveFile> readFile(const std::string& name) const = 0;
+
+	// Reads a file block by block: setSize is called first with the file size and returns where to put the contents,
+	// then progress with the number of bytes read so far after each block.
+	// Returns false if the file is missing or corrupt. Can be called from multiple threads.
+	virtual bool readFileStreaming(const std::string& name, const std::function<uint8_t* (size_t)>& setSize,
+		const std::function<void(size_t)>& progress) const = 0;
+
+protected:
+	std::filesystem::path archivePath;
+};
+
+// Writes the files of a scene to a ZIP or a folder
+class SceneArchiveWriter {
+public:
+	virtual ~SceneArchiveWriter() = default;
+
+	// A ZIP is written to a temporary file until commit is called, and is removed if that doesn't happen.
+	// The files of a folder are replaced one by one, each one being written to a temporary file first.
+	// level and deflateThreads only apply to ZIPs (see SaveOptions).
+	static std::unique_ptr<SceneArchiveWriter> create(const std::filesystem::path& path, int level, unsigned int deflateThreads);
+
+	virtual bool addFile(const std::string& name, const void* data, size_t size) = 0;
+	// Adds the chunks, serialized, as files
+	virtual bool addChunks(Span<const std::pair<std::string, const Chunk*>> chunks) = 0;
+	// Whether copyFile would copy the file without compressing it again. Between ZIPs, that is when
+	// the entry is compressed at least as much as the new ZIP would, and recompress is false.
+	// sourceLevel is the deflate level the source's entries are known to have at least, or -1
+	// to rely on the deflate option flags of each entry.
+	virtual bool copiesAsIs(const SceneArchive& source, const std::string& name, int sourceLevel, bool recompress) const = 0;
+	// Copies a file of another archive, compressing it again unless copiesAsIs
+	virtual bool copyFile(const SceneArchive& source, const std::string& name, int sourceLevel, bool recompress) = 0;
+	// Makes sure the file is not in the archive, e.g. the PackRepeat.* left in a folder when a full Pack.* is saved
+	virtual void removeFile(const std::string& name) = 0;
+
+	// Ends writing
+	virtual bool finish() = 0;
+	// Moves the finished archive to its path. When it replaces the source archive, the source must be closed before.
+	virtual bool commit() = 0;
+
+	uint64_t writtenSize() const { return bytesWritten; }
+	double compressSeconds() const { return compressSecs; }
+
+protected:
+	uint64_t bytesWritten = 0;
+	double compressSecs = 0.0;
+};
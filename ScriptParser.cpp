@@ -1,7 +1,7 @@
 #include "ScriptParser.h"
 #include "gameobj.h"
+#include "SceneArchive.h"
 #include <fmt/format.h>
-#include <miniz/miniz.h>
 #include <regex>
 
 static std::string toLower(std::string str)
@@ -151,33 +151,12 @@ struct Tokenizer
 
 ScriptParser::ScriptParser(const Scene& scene) : scene(scene)
 {
-	mz_zip_archive* mzZip = (mz_zip_archive*)malloc(sizeof(mz_zip_archive));
-	mz_zip_zero_struct(mzZip);
-	mz_bool mzreadok = mz_zip_reader_init_mem(mzZip, scene.zipmem.data(), scene.zipmem.size(),
-		MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY | MZ_ZIP_FLAG_VALIDATE_LOCATE_FILE_FLAG);
-	assert(mzreadok);
-	zip = mzZip;
-}
-
-ScriptParser::~ScriptParser()
-{
-	mz_zip_reader_end((mz_zip_archive*)zip);
-	free(zip);
+	assert(scene.archive);
 }
 
 //std::string parseNativeImportsFromScript(const Scene& scene, const std::string& scriptFilePath)
 void ScriptParser::parseFile(const std::string& scriptFilePath)
 {
-	struct ZippedFile {
-		void* bytes = nullptr; size_t length = 0;
-		ZippedFile(mz_zip_archive* zip, const char* path) {
-			bytes = mz_zip_reader_extract_file_to_heap(zip, path, &length, 0);
-			if (!bytes)
-				throw ScriptParserError(fmt::format("Could not find file {}", path));
-		}
-		~ZippedFile() { if (bytes) free(bytes); }
-	};
-
 	std::string processedFilePath = scriptFilePath;
 	for (char& c : processedFilePath)
 		if (c == '\\')
@@ -187,8 +166,10 @@ void ScriptParser::parseFile(const std::string& scriptFilePath)
 	processedFilePath = std::regex_replace(processedFilePath, multiSlashes, "/");
 	processedFilePath = std::regex_replace(processedFilePath, removeDotDot, "");
 
-	ZippedFile file((mz_zip_archive*)zip, processedFilePath.c_str());
-	Tokenizer tok((const char*)file.bytes, file.length);
+	std::unique_ptr<ArchiveFile> file = scene.archive->readFile(processedFilePath);
+	if (!file)
+		throw ScriptParserError(fmt::format("Could not find file {}", processedFilePath));
+	Tokenizer tok((const char*)file->data(), file->size());
 
 	auto nextTokenAsType = [&tok](Tokenizer::TokenType expectedType)
 		{
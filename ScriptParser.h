@@ -17,7 +17,6 @@ class ScriptParser
 {
 public:
 	ScriptParser(const Scene& scene);
-	~ScriptParser();
 	void parseFile(const std::string& scriptFilePath);
 
 	struct ImportedProperty {
@@ -37,5 +36,4 @@ public:
 
 private:
 	const Scene& scene;
-	void* zip;
 };
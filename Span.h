@@ -0,0 +1,35 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+// Non-owning view over a contiguous range of elements (C++17 has no std::span).
+template <class T> class Span {
+private:
+	T* pointer = nullptr;
+	size_t length = 0;
+
+public:
+	Span() = default;
+	Span(T* pointer, size_t length) : pointer(pointer), length(length) {}
+	template <class U, class = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+	Span(const Span<U>& other) : pointer(other.data()), length(other.size()) {}
+
+	size_t size() const { return length; }
+	bool empty() const { return length == 0; }
+	T* data() const { return pointer; }
+
+	T* begin() const { return pointer; }
+	T* end() const { return pointer + length; }
+
+	T& operator[] (size_t index) const { assert(index < length); return pointer[index]; }
+
+	Span subspan(size_t offset, size_t count) const { assert(offset + count <= length); return Span(pointer + offset, count); }
+	Span subspan(size_t offset) const { assert(offset <= length); return Span(pointer + offset, length - offset); }
+};
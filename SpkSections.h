@@ -0,0 +1,121 @@
+// c47edit - Scene editor for HM C47
+// Copyright (C) 2018-2022 AdrienTD
+// Licensed under the GPL3+.
+// See LICENSE file for more details.
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "chunk.h"
+#include "Span.h"
+
+// Typed views over the object sections of Pack.SPK (PHEA, PPOS, PMTX, PVER, PFAC, PDAT, PFTX, PUVC...).
+// Every access is checked against the section size with assertions only,
+// so in release builds they compile down to the same pointer arithmetic as raw offsets.
+
+// Object header in PHEA, at the offset given by the low 24 bits of the object chunk tag.
+// It is followed by a SpkGeometryHeader for objects with a mesh (flag 0x20) or a line (flag 0x400),
+// or by a SpkLightHeader for lights (flag 0x80).
+struct SpkObjectHeader {
+	uint32_t dblOffset;      // bytes in PDBL
+	uint32_t excOffset;      // bytes in PEXC + 1, 0 if the object has no EXC chunk
+	uint32_t nameOffset;     // bytes in PNAM
+	uint32_t matrixIndex;    // SpkMatrixQuad in PMTX
+	uint32_t positionOffset; // bytes in PPOS
+	uint16_t type;
+	uint16_t flags;
+};
+
+struct SpkGeometryHeader {
+	uint32_t vertexIndex;  // floats in PVER
+	uint32_t quadIndex;    // uint16 in PFAC, 0 for lines
+	uint32_t triIndex;     // uint16 in PFAC, for lines bytes of the terms in PDAT
+	uint32_t ftxOffset;    // bytes in PFTX + 1 (0 if none), or with bit 31 set, bytes of a SpkMeshExtension in PDAT
+	uint32_t numVertices;
+	uint32_t numQuads;     // 0 for lines
+	uint32_t numTris;      // for lines the number of terms
+	uint32_t color;
+	uint32_t weird;
+};
+
+struct SpkLightHeader {
+	uint32_t param[7];
+};
+
+// Rotation in PMTX: X and Y components of the matrix's Z and Y rows in 2.30 fixed point,
+// with the sign of the row's Z component in bit 0 of the X component
+struct SpkMatrixQuad {
+	int32_t zx, zy, yx, yy;
+};
+
+// Mesh extension in PDAT, texAnimOffset has 1 or 2 elements depending on the type
+struct SpkMeshExtension {
+	uint32_t ftxOffset;
+	uint32_t type;
+	uint32_t texAnimOffset[2];
+};
+
+// Face list in PFTX, followed by numFaces 12-byte faces
+struct SpkFtxHeader {
+	uint32_t textureCoordsIndex; // floats in PUVC
+	uint32_t lightCoordsIndex;   // floats in PUVC
+	uint32_t numFaces;
+};
+
+static_assert(sizeof(SpkObjectHeader) == 24 && sizeof(SpkGeometryHeader) == 36 && sizeof(SpkLightHeader) == 28);
+static_assert(sizeof(SpkMatrixQuad) == 16 && sizeof(SpkFtxHeader) == 12);
+
+// Main data of a section, read as records at byte offsets or as a column of same-sized elements
+class SpkSection {
+public:
+	SpkSection() = default;
+	explicit SpkSection(ChunkView chunk) : bytes(chunk.maindata()) {}
+
+	size_t size() const { return bytes.size(); }
+	const uint8_t* data() const { return bytes.data(); }
+
+	template <class T> const T& at(size_t byteOffset) const {
+		static_assert(std::is_trivially_copyable_v<T>);
+		assert(byteOffset + sizeof(T) <= bytes.size());
+		return *(const T*)(bytes.data() + byteOffset);
+	}
+
+	template <class T> Span<const T> array(size_t byteOffset, size_t count) const {
+		assert(byteOffset + count * sizeof(T) <= bytes.size());
+		return { (const T*)(bytes.data() + byteOffset), count };
+	}
+
+	// The whole section as an array of T
+	template <class T> Span<const T> column() const {
+		return { (const T*)bytes.data(), bytes.size() / sizeof(T) };
+	}
+
+	const char* string(size_t byteOffset) const {
+		assert(byteOffset < bytes.size());
+		return (const char*)bytes.data() + byteOffset;
+	}
+
+private:
+	Span<const uint8_t> bytes;
+};
+
+// PHEA, the object headers
+class SpkHeaderSection : public SpkSection {
+public:
+	using SpkSection::SpkSection;
+
+	// Header of an object, from its chunk tag
+	const SpkObjectHeader& object(uint32_t objectTag) const { return at<SpkObjectHeader>(objectTag & 0xFFFFFF); }
+	const SpkGeometryHeader& geometry(const SpkObjectHeader& header) const { return follow<SpkGeometryHeader>(header); }
+	const SpkLightHeader& light(const SpkObjectHeader& header) const { return follow<SpkLightHeader>(header); }
+
+private:
+	template <class T> const T& follow(const SpkObjectHeader& header) const {
+		size_t offset = (const uint8_t*)(&header + 1) - data();
+		return at<T>(offset);
+	}
+};
@@ -4,148 +4,409 @@
 // See LICENSE file for more details.
 
 #include "chunk.h"
-#include <map>
+#include "ChunkArena.h"
+#include "ContentHash.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <cassert>
 #include <cstring>
-#include "ByteWriter.h"
+
+Chunk::Chunk(const Chunk& other) : tag(other.tag), generation(other.generation), multidata(other.multidata), subchunks(other.subchunks), maindata(other.maindata)
+{
+}
+
+Chunk::Chunk(Chunk&& other) noexcept : arena(std::move(other.arena)), tag(other.tag), generation(other.generation), multidata(std::move(other.multidata)), subchunks(std::move(other.subchunks)), maindata(std::move(other.maindata))
+{
+}
 
 Chunk::~Chunk() = default;
 
+void Chunk::swap(Chunk& other) noexcept
+{
+	std::swap(arena, other.arena);
+	std::swap(tag, other.tag);
+	std::swap(generation, other.generation);
+	std::swap(multidata, other.multidata);
+	subchunks.swap(other.subchunks);
+	std::swap(maindata, other.maindata);
+	tagIndex.index.reset();
+	other.tagIndex.index.reset();
+	invalidateTagIndex();
+	other.invalidateTagIndex();
+}
+
+std::shared_ptr<const Chunk::TagIndex> Chunk::getTagIndex(bool rebuild) const
+{
+	std::shared_ptr<const TagIndex> index = std::atomic_load(&tagIndex.index);
+	if (!rebuild && index && index->subchunksData == subchunks.data() && index->subchunksSize == subchunks.size()
+		&& index->subchunksVersion == subchunksVersion)
+		return index;
+
+	// Threads finding the index outdated at the same time each build their own, and the last one is kept
+	auto built = std::make_shared<TagIndex>();
+	built->entries.resize(subchunks.size());
+	for (size_t i = 0; i < subchunks.size(); ++i)
+		built->entries[i] = { subchunks[i].tag, (uint32_t)i };
+	std::sort(built->entries.begin(), built->entries.end());
+	built->subchunksData = subchunks.data();
+	built->subchunksSize = subchunks.size();
+	built->subchunksVersion = subchunksVersion;
+	index = std::move(built);
+	std::atomic_store(&tagIndex.index, index);
+	return index;
+}
+
+// Entries of a sorted tag index with the tag
+static std::pair<const std::pair<uint32_t, uint32_t>*, const std::pair<uint32_t, uint32_t>*> EqualTagRange(
+	const std::vector<std::pair<uint32_t, uint32_t>>& entries, uint32_t tagkey)
+{
+	using Entry = std::pair<uint32_t, uint32_t>;
+	return std::equal_range(entries.data(), entries.data() + entries.size(), Entry(tagkey, 0),
+		[](const Entry& a, const Entry& b) { return a.first < b.first; });
+}
+
+std::pair<const Chunk::TagIndexEntry*, const Chunk::TagIndexEntry*> Chunk::tagIndexRange(uint32_t tagkey, std::shared_ptr<const TagIndex>& index) const
+{
+	// Found entries are checked against the subchunks, a miss is trusted
+	auto matches = [this](const TagIndexEntry* first, const TagIndexEntry* last) {
+		return std::all_of(first, last, [this](const TagIndexEntry& e) { return e.second < subchunks.size() && subchunks[e.second].tag == e.first; });
+	};
+	index = getTagIndex();
+	auto range = EqualTagRange(index->entries, tagkey);
+	if (!matches(range.first, range.second)) {
+		index = getTagIndex(true);
+		range = EqualTagRange(index->entries, tagkey);
+	}
+	return range;
+}
+
 const Chunk *Chunk::findSubchunk(uint32_t tagkey) const
 {
-	for (const Chunk& sub : subchunks)
-		if (sub.tag == tagkey)
-			return &sub;
-	return nullptr;
+	if (subchunks.size() < tagIndexMinSubchunks) {
+		for (const Chunk& sub : subchunks)
+			if (sub.tag == tagkey)
+				return &sub;
+		return nullptr;
+	}
+
+	std::shared_ptr<const TagIndex> index = getTagIndex();
+	auto [first, last] = EqualTagRange(index->entries, tagkey);
+	if (first == last)
+		return nullptr;
+	if (first->second < subchunks.size() && subchunks[first->second].tag == tagkey)
+		return &subchunks[first->second];
+
+	// The subchunks were modified in place without invalidateTagIndex()
+	index = getTagIndex(true);
+	std::tie(first, last) = EqualTagRange(index->entries, tagkey);
+	return (first != last) ? &subchunks[first->second] : nullptr;
 }
 
-void Chunk::load(void *bytes)
+Chunk::TagRange<const Chunk> Chunk::findSubchunks(uint32_t tagkey) const
 {
-	Chunk *chk = this;
+	std::shared_ptr<const TagIndex> index;
+	auto [first, last] = tagIndexRange(tagkey, index);
+	return { subchunks.data(), first, last, std::move(index) };
+}
 
-	uint32_t* pnt = (uint32_t*)bytes;
+Chunk::TagRange<Chunk> Chunk::findSubchunks(uint32_t tagkey)
+{
+	std::shared_ptr<const TagIndex> index;
+	auto [first, last] = std::as_const(*this).tagIndexRange(tagkey, index);
+	return { subchunks.data(), first, last, std::move(index) };
+}
 
-	chk->tag = *(pnt++);
-	uint32_t it = *(pnt++);
-	uint32_t chksize = it & 0x3FFFFFFF;
-	bool has_subchunks = it & 0x80000000;
-	bool has_multidata = it & 0x40000000;
+Span<const uint8_t> ChunkView::MultidataRange::operator[](uint32_t index) const
+{
+	assert(index < count);
+	const uint8_t* data = first;
+	for (uint32_t i = 0; i < index; ++i)
+		data += lengths[i];
+	return { data, lengths[index] };
+}
 
-	uint32_t odat;
-	if(has_subchunks || has_multidata)
-		odat = *(pnt++);
-	else
-		odat = 8;
+ChunkView::SubchunkRange ChunkView::subchunks() const
+{
+	if (!hasSubchunks())
+		return { nullptr, 0 };
+	const uint32_t* pnt = header() + 4;
+	if (hasMultidata())
+		pnt += 1 + numMultidata();
+	return { (const uint8_t*)pnt, numSubchunks() };
+}
 
-	uint32_t num_subchunks;
-	if(has_subchunks) num_subchunks = *(pnt++);
-	else num_subchunks = 0;
+ChunkView::MultidataRange ChunkView::multidata() const
+{
+	if (!hasMultidata())
+		return { nullptr, nullptr, 0 };
+	return { multidataLengths(), pointer + dataOffset(), numMultidata() };
+}
 
-	if(has_multidata)
-	{
-		uint32_t num_datas = *(pnt++);
-		chk->multidata.resize(num_datas);
-		for(auto& dat : chk->multidata)
-		{
-			uint32_t datlen = *(pnt++);
-			dat.resize(datlen);
-		}
-	}
-	else	chk->multidata.clear();
+Span<const uint8_t> ChunkView::maindata() const
+{
+	if (hasMultidata())
+		return {};
+	uint32_t odat = dataOffset();
+	return { pointer + odat, size() - odat };
+}
 
-	// Subchunks
-	chk->subchunks.resize(num_subchunks);
-	for(auto& subchunk : subchunks)
-	{
-		subchunk.load(pnt);
-		uint32_t sublen = pnt[1] & 0x3FFFFFFF;
-		pnt = (uint32_t*)( (char*)pnt + sublen );
-	}
+ChunkView ChunkView::findSubchunk(uint32_t tagkey) const
+{
+	if (!valid())
+		return {};
+	for (ChunkView sub : subchunks())
+		if (sub.tag() == tagkey)
+			return sub;
+	return {};
+}
 
-	// Data / Multidata
-	char *dp = (char*)bytes + odat;
-	if(has_multidata)
-	{
-		for(auto& dat : multidata)
-		{
-			memcpy(dat.data(), dp, dat.size());
-			dp += dat.size();
-		}
-		// clear maindata
+Chunk ChunkView::materialize() const
+{
+	Chunk chk;
+	materializeTo(chk);
+	return chk;
+}
+
+// Copies the chunk's own data, without the subchunks
+static void MaterializeData(ChunkView view, Chunk& chk, std::pmr::memory_resource* resource)
+{
+	chk.tag = view.tag();
+
+	// The multidata is contiguous in the view as in the list
+	ChunkView::MultidataRange mdRange = view.multidata();
+	chk.multidata.setResource(resource);
+	chk.multidata.assign({ mdRange.lengths, mdRange.count }, mdRange.first);
+
+	Span<const uint8_t> main = view.maindata();
+	chk.maindata = Chunk::DataBuffer(main.data(), main.size(), resource);
+}
+
+void ChunkView::materializeTo(Chunk& chk, std::pmr::memory_resource* resource) const
+{
+	MaterializeData(*this, chk, resource);
+
+	SubchunkRange subRange = subchunks();
+	chk.subchunks.resize(subRange.size());
+	size_t i = 0;
+	for (ChunkView sub : subRange)
+		sub.materializeTo(chk.subchunks[i++], resource);
+}
+
+void Chunk::load(const void *bytes)
+{
+	// The data of a chunk tree is never bigger than its serialized size,
+	// so the arena doesn't need more than one block
+	ChunkView view(bytes);
+	Chunk chk;
+	chk.arena = std::make_shared<ChunkArena>(view.size());
+	view.materializeTo(chk, chk.arena.get());
+	chk.arena->seal();
+	*this = std::move(chk);
+}
+
+void Chunk::loadParallel(const void *bytes, unsigned int numThreads)
+{
+	ChunkView view(bytes);
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	Chunk chk;
+	chk.arena = std::make_shared<ChunkArena>(view.size());
+	ChunkArena* arena = chk.arena.get();
+
+	// Header-only scan to find where each subchunk begins, so that
+	// the subtrees can be copied independently
+	std::vector<ChunkView> index;
+	index.reserve(view.numSubchunks());
+	for (ChunkView sub : view.subchunks())
+		index.push_back(sub);
+
+	numThreads = (unsigned int)std::min<size_t>(numThreads, index.size());
+	if (numThreads <= 1) {
+		view.materializeTo(chk, arena);
 	}
-	else
-	{
-		uint32_t mainlen = chksize - odat;
-		maindata.resize(mainlen);
-		memcpy(maindata.data(), dp, maindata.size());
+	else {
+		MaterializeData(view, chk, arena);
+		chk.subchunks.resize(index.size());
+		std::atomic<size_t> next = 0;
+		auto worker = [&chk, arena, &index, &next]() {
+			size_t i;
+			while ((i = next++) < index.size())
+				index[i].materializeTo(chk.subchunks[i], arena);
+		};
+		std::vector<std::thread> threads;
+		for (unsigned int t = 1; t < numThreads; ++t)
+			threads.emplace_back(worker);
+		worker();
+		for (auto& thread : threads)
+			thread.join();
 	}
+	arena->seal();
+	*this = std::move(chk);
 }
 
-static void WriteChunkToStringBuf(ByteWriter<std::string>& sb, Chunk *chk)
+ChunkSerializer::ChunkSerializer(const Chunk& chk)
+{
+	layout(chk);
+	// Headers are referenced by index during the layout since headerWords may reallocate
+	for (Segment& seg : segments)
+		if (!seg.data)
+			seg.data = (const uint8_t*)(headerWords.data() + seg.headerIndex);
+}
+
+void ChunkSerializer::layout(const Chunk& chk)
 {
 	// Header
-	uint32_t begoff = (uint32_t)sb.size();
-	sb.addU32(chk->tag);
-	bool hasmultidata = !chk->multidata.empty();
-	bool hassubchunks = !chk->subchunks.empty();
-	sb.addS32(0); // reserved for size
+	size_t begoff = totalSize;
+	size_t hdr = headerWords.size();
+	bool hasmultidata = !chk.multidata.empty();
+	bool hassubchunks = !chk.subchunks.empty();
+	headerWords.push_back(chk.tag);
+	headerWords.push_back(0); // reserved for size
 	if (hasmultidata || hassubchunks)
-		sb.addS32(0); // reserved for data offset
-	if (hassubchunks) {
-		uint32_t num_subchunks = (uint32_t)chk->subchunks.size();
-		sb.addU32(num_subchunks);
-	}
-	if (hasmultidata)
-	{
-		uint32_t num_datas = (uint32_t)chk->multidata.size();
-		sb.addU32(num_datas);
-		for (auto& dat : chk->multidata) {
-			uint32_t len = (uint32_t)dat.size();
-			sb.addU32(len);
-		}
+		headerWords.push_back(0); // reserved for data offset
+	if (hassubchunks)
+		headerWords.push_back((uint32_t)chk.subchunks.size());
+	if (hasmultidata) {
+		headerWords.push_back((uint32_t)chk.multidata.size());
+		for (Span<const uint8_t> dat : chk.multidata)
+			headerWords.push_back((uint32_t)dat.size());
 	}
+	size_t hdrsize = 4 * (headerWords.size() - hdr);
+	segments.push_back({ begoff, hdrsize, nullptr, hdr, true });
+	totalSize += hdrsize;
 
 	// Subchunks
-	if (hassubchunks)
-		for (auto& subchunk : chk->subchunks)
-			WriteChunkToStringBuf(sb, &subchunk);
+	for (auto& subchunk : chk.subchunks)
+		layout(subchunk);
 
 	// Data / Multidata
-	uint32_t odat = (uint32_t)sb.size() - begoff;
+	uint32_t odat = (uint32_t)(totalSize - begoff);
+	// Each multidata element is its own segment, as PackRepeat records reference them one by one
+	auto addData = [this](const uint8_t* data, size_t size) {
+		if (size) {
+			segments.push_back({ totalSize, size, data, 0, false });
+			totalSize += size;
+		}
+	};
 	if (hasmultidata)
-		for (auto& dat : chk->multidata)
-			sb.addData(dat.data(), dat.size());
+		for (Span<const uint8_t> dat : chk.multidata)
+			addData(dat.data(), dat.size());
 	else
-		sb.addData(chk->maindata.data(), chk->maindata.size());
-	uint32_t endoff = (uint32_t)sb.size();
+		addData(chk.maindata.data(), chk.maindata.size());
 
 	// Write to the reserved values
-	uint8_t* headerPtr = (uint8_t*)sb.getPointer(begoff);
-	uint32_t lenflags = (endoff - begoff) | (hasmultidata ? 0x40000000 : 0) | (hassubchunks ? 0x80000000 : 0);
-	*(uint32_t*)(headerPtr + 4) = lenflags;
+	headerWords[hdr + 1] = (uint32_t)(totalSize - begoff) | (hasmultidata ? 0x40000000 : 0) | (hassubchunks ? 0x80000000 : 0);
 	if (hasmultidata || hassubchunks)
-		*(uint32_t*)(headerPtr + 8) = odat;
+		headerWords[hdr + 2] = odat;
+}
+
+size_t ChunkSerializer::read(size_t offset, void* dest, size_t n)
+{
+	return readFrom(cursor, offset, dest, n);
+}
+
+size_t ChunkSerializer::readAt(size_t offset, void* dest, size_t n) const
+{
+	size_t localCursor = 0;
+	return readFrom(localCursor, offset, dest, n);
+}
+
+size_t ChunkSerializer::readFrom(size_t& segIndex, size_t offset, void* dest, size_t n) const
+{
+	if (offset >= totalSize)
+		return 0;
+	n = std::min(n, totalSize - offset);
+
+	// Sequential reads continue from the current segment, otherwise look it up
+	const Segment& cur = segments[segIndex];
+	if (offset < cur.offset || offset >= cur.offset + cur.size) {
+		auto it = std::upper_bound(segments.begin(), segments.end(), offset, [](size_t off, const Segment& seg) { return off < seg.offset; });
+		segIndex = (it - segments.begin()) - 1;
+	}
+
+	uint8_t* out = (uint8_t*)dest;
+	size_t copied = 0;
+	while (copied < n) {
+		const Segment& seg = segments[segIndex];
+		size_t segoff = offset + copied - seg.offset;
+		size_t len = std::min(seg.size - segoff, n - copied);
+		memcpy(out + copied, seg.data + segoff, len);
+		copied += len;
+		if (segoff + len == seg.size && segIndex + 1 < segments.size())
+			segIndex += 1;
+	}
+	return copied;
+}
+
+bool ChunkSerializer::writeToFile(FILE* file)
+{
+	for (const Segment& seg : segments)
+		if (fwrite(seg.data, seg.size, 1, file) != 1)
+			return false;
+	return true;
+}
+
+bool ChunkSerializer::writePackRepeat(const RepeatIndex& repeat, std::string& out) const
+{
+	std::string headers, records;
+	auto addU32 = [](std::string& str, uint32_t val) { str.append((const char*)&val, 4); };
+	for (const Segment& seg : segments) {
+		if (seg.isHeader) {
+			headers.append((const char*)seg.data, seg.size);
+			continue;
+		}
+		// the first 4 bytes are written by the record, so smaller data cannot be stored
+		if (seg.size < 4)
+			return false;
+		int64_t repeatoff = repeat.find(seg.data, seg.size);
+		if (repeatoff < 0)
+			return false;
+		addU32(records, (uint32_t)repeatoff);
+		addU32(records, (uint32_t)seg.offset);
+		addU32(records, (uint32_t)seg.size);
+		addU32(records, *(const uint32_t*)seg.data);
+	}
+	out.clear();
+	out.reserve(8 + headers.size() + records.size());
+	addU32(out, (uint32_t)totalSize);
+	addU32(out, (uint32_t)headers.size());
+	out += headers;
+	out += records;
+	return true;
 }
 
 std::string Chunk::saveToString()
 {
-	ByteWriter<std::string> sb;
-	WriteChunkToStringBuf(sb, this);
-	return sb.take();
+	ChunkSerializer serializer(*this);
+	std::string str(serializer.size(), 0);
+	serializer.read(0, str.data(), str.size());
+	return str;
 }
 
-Chunk Chunk::reconstructPackFromRepeat(void *packrep, uint32_t packrepsize, void *repeat)
+Chunk Chunk::reconstructPackFromRepeat(const void *packrep, uint32_t packrepsize, const void *repeat)
 {
 	Chunk mainchk;
 
-	uint32_t *ppnt = (uint32_t*)packrep;
+	const uint32_t *ppnt = (const uint32_t*)packrep;
 	uint32_t reconsoff = *(ppnt + 1);
+	mainchk.arena = std::make_shared<ChunkArena>(*ppnt);
+	ChunkArena* arena = mainchk.arena.get();
 	ppnt += 2;
 
+	// Where each maindata/multidata is located in the full pack
+	struct DataLocation {
+		uint32_t offset;
+		Chunk* chunk;
+		int multiDataIndex; // -1 for maindata
+	};
+	std::vector<DataLocation> locations;
+
 	uint32_t currp = 0;
-	std::map<uint32_t, std::pair<Chunk*, int>> rpmap;
 
-	auto f = [&ppnt, &rpmap, &currp](Chunk *c, const auto& rec) -> void {
+	auto f = [&ppnt, &locations, &currp, arena](Chunk *c, const auto& rec) -> void {
 		uint32_t beg = currp;
 		c->tag = *(ppnt++);
 		uint32_t info = *(ppnt++);
@@ -165,21 +426,29 @@ Chunk Chunk::reconstructPackFromRepeat(void *packrep, uint32_t packrepsize, void
 		uint32_t num_multidata = 0;
 		if (has_multidata) {
 			num_multidata = *(ppnt++);
-			c->multidata.resize(num_multidata);
-			for (auto& dat : c->multidata) {
-				uint32_t datlen = *(ppnt++);
-				dat.resize(datlen);
-			}
+			// reserved first so that growing doesn't leave dead space in the arena
+			size_t totalSize = 0;
+			for (uint32_t md = 0; md < num_multidata; ++md)
+				totalSize += ppnt[md];
+			c->multidata.setResource(arena);
+			c->multidata.reserve(num_multidata, totalSize);
+			for (uint32_t md = 0; md < num_multidata; ++md)
+				c->multidata.append(*(ppnt++));
+		}
+		else {
+			c->maindata.setResource(arena);
 		}
 
+		// Empty data has no reconstruction record, and would share its offset with the next data
 		if (has_multidata) {
 			for (int md = 0; md < (int)num_multidata; ++md) {
-				rpmap[currp + datoff] = { c, md };
+				if (c->multidata[md].size())
+					locations.push_back({ currp + datoff, c, md });
 				datoff += c->multidata[md].size();
 			}
 		}
-		else {
-			rpmap[currp + datoff] = { c, -1 };
+		else if (csize > datoff) {
+			locations.push_back({ currp + datoff, c, -1 });
 		}
 
 		if (has_subchunks) {
@@ -193,21 +462,111 @@ Chunk Chunk::reconstructPackFromRepeat(void *packrep, uint32_t packrepsize, void
 
 	f(&mainchk, f);
 
-	char* reconspnt = (char*)packrep + 8 + reconsoff;
-	ppnt = (uint32_t*)reconspnt;
+	// A chunk's data comes after its subchunks, so the offsets need sorting
+	std::sort(locations.begin(), locations.end(), [](const DataLocation& a, const DataLocation& b) { return a.offset < b.offset; });
+	auto findLocation = [&locations](uint32_t offset) -> const DataLocation& {
+		auto it = std::lower_bound(locations.begin(), locations.end(), offset, [](const DataLocation& loc, uint32_t off) { return loc.offset < off; });
+		if (it == locations.end() || it->offset != offset)
+			throw std::out_of_range("PackRepeat reconstruction offset not found");
+		return *it;
+	};
+
+	const char* reconspnt = (const char*)packrep + 8 + reconsoff;
+	ppnt = (const uint32_t*)reconspnt;
 	uint32_t reconssize = packrepsize - (8 + reconsoff);
-	while ((char*)ppnt - reconspnt < reconssize)
+	while ((const char*)ppnt - reconspnt < reconssize)
 	{
 		uint32_t repeatoff = *(ppnt++);
-		Chunk* c; int multiDataIndex;
-		std::tie(c, multiDataIndex) = rpmap.at(*(ppnt++));
+		const DataLocation& loc = findLocation(*(ppnt++));
 		uint32_t data_size = *(ppnt++);
-		DataBuffer& dataBuf = (multiDataIndex == -1) ? c->maindata : c->multidata[multiDataIndex];
-		assert(multiDataIndex == -1 || dataBuf.size() == data_size);
-		dataBuf.resize(data_size);
-		memcpy(dataBuf.data(), (char*)repeat + repeatoff, dataBuf.size());
+		Span<uint8_t> dataBuf;
+		if (loc.multiDataIndex == -1) {
+			DataBuffer& main = loc.chunk->maindata;
+			if (main.size() != data_size)
+				main.resize(data_size);
+			dataBuf = { main.data(), main.size() };
+		}
+		else {
+			dataBuf = loc.chunk->multidata[loc.multiDataIndex];
+			assert(dataBuf.size() == data_size);
+		}
+		memcpy(dataBuf.data(), (const char*)repeat + repeatoff, dataBuf.size());
 		*(uint32_t*)dataBuf.data() = *(ppnt++);
 	}
 
+	arena->seal();
 	return mainchk;
 }
+
+RepeatIndex::RepeatIndex(const uint8_t* repeat, size_t repeatSize) : repeat(repeat), repeatSize(repeatSize)
+{
+}
+
+uint64_t RepeatIndex::hashRange(const uint8_t* data, size_t size)
+{
+	return HashBytes(data + 4, size - 4, size);
+}
+
+void RepeatIndex::addRange(uint32_t offset, uint32_t size)
+{
+	if (size < 4 || (size_t)offset + size > repeatSize)
+		return;
+	if (!indexedRanges.insert((uint64_t)offset << 32 | size).second)
+		return;
+	ranges.emplace(hashRange(repeat + offset, size), offset);
+}
+
+void RepeatIndex::addChunkTree()
+{
+	// The Repeat file is not trusted to be a valid chunk tree, so check the bounds of everything.
+	// Wrongly indexed ranges are harmless as the bytes are compared when found.
+	auto walk = [this](size_t offset, size_t end, const auto& rec) -> void {
+		if (offset + 8 > end)
+			return;
+		ChunkView chk(repeat + offset);
+		size_t headerSize = 8 + ((chk.hasSubchunks() || chk.hasMultidata()) ? 4 : 0) + (chk.hasSubchunks() ? 4 : 0);
+		if (chk.size() < headerSize || offset + chk.size() > end || chk.dataOffset() > chk.size())
+			return;
+		if (chk.hasMultidata()) {
+			if (offset + headerSize + 4 > end)
+				return;
+			size_t numMultidata = chk.numMultidata();
+			if (headerSize + 4 + 4 * numMultidata > chk.size())
+				return;
+			size_t dataoff = offset + chk.dataOffset();
+			for (Span<const uint8_t> dat : chk.multidata()) {
+				if (dataoff + dat.size() > offset + chk.size())
+					break;
+				addRange((uint32_t)dataoff, (uint32_t)dat.size());
+				dataoff += dat.size();
+			}
+		}
+		else {
+			addRange((uint32_t)(offset + chk.dataOffset()), chk.size() - chk.dataOffset());
+		}
+		if (chk.hasSubchunks()) {
+			size_t suboff = chk.subchunks().first - repeat;
+			for (uint32_t i = 0; i < chk.numSubchunks() && suboff + 8 <= offset + chk.size(); ++i) {
+				uint32_t subsize = ChunkView(repeat + suboff).size();
+				if (subsize == 0)
+					break;
+				rec(suboff, offset + chk.size(), rec);
+				suboff += subsize;
+			}
+		}
+	};
+	walk(0, repeatSize, walk);
+}
+
+int64_t RepeatIndex::find(const uint8_t* data, size_t size) const
+{
+	if (size < 4)
+		return -1;
+	auto [first, last] = ranges.equal_range(hashRange(data, size));
+	for (auto it = first; it != last; ++it) {
+		uint32_t offset = it->second;
+		if ((size_t)offset + size <= repeatSize && !memcmp(repeat + offset + 4, data + 4, size - 4))
+			return offset;
+	}
+	return -1;
+}
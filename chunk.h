@@ -6,28 +6,251 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <memory_resource>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include "DynArray.h"
+#include "MultidataList.h"
+#include "Span.h"
+
+struct Chunk;
+class ChunkArena;
+class RepeatIndex;
+
+// Read-only chunk over a borrowed buffer (e.g. an inflated Pack.SPK).
+// Headers are decoded on access, and data is exposed as spans into the buffer,
+// so the buffer must outlive the view. Use materialize() to get an editable Chunk.
+class ChunkView
+{
+private:
+	const uint8_t* pointer = nullptr;
+
+	const uint32_t* header() const { return (const uint32_t*)pointer; }
+	const uint32_t* multidataLengths() const { return header() + (hasSubchunks() ? 5 : 4); }
+
+public:
+	class SubchunkIterator {
+		const uint8_t* pointer; uint32_t index;
+	public:
+		SubchunkIterator(const uint8_t* pointer, uint32_t index) : pointer(pointer), index(index) {}
+		ChunkView operator*() const { return ChunkView(pointer); }
+		SubchunkIterator& operator++() { pointer += ChunkView(pointer).size(); ++index; return *this; }
+		bool operator==(const SubchunkIterator& other) const { return index == other.index; }
+		bool operator!=(const SubchunkIterator& other) const { return index != other.index; }
+	};
+
+	class MultidataIterator {
+		const uint32_t* length; const uint8_t* data;
+	public:
+		MultidataIterator(const uint32_t* length, const uint8_t* data) : length(length), data(data) {}
+		Span<const uint8_t> operator*() const { return { data, *length }; }
+		MultidataIterator& operator++() { data += *(length++); return *this; }
+		bool operator==(const MultidataIterator& other) const { return length == other.length; }
+		bool operator!=(const MultidataIterator& other) const { return length != other.length; }
+	};
+
+	struct SubchunkRange {
+		const uint8_t* first; uint32_t count;
+		SubchunkIterator begin() const { return { first, 0 }; }
+		SubchunkIterator end() const { return { nullptr, count }; }
+		uint32_t size() const { return count; }
+		bool empty() const { return count == 0; }
+	};
+
+	struct MultidataRange {
+		const uint32_t* lengths; const uint8_t* first; uint32_t count;
+		MultidataIterator begin() const { return { lengths, first }; }
+		MultidataIterator end() const { return { lengths + count, nullptr }; }
+		uint32_t size() const { return count; }
+		bool empty() const { return count == 0; }
+		// O(index), prefer iterating when going through all elements
+		Span<const uint8_t> operator[](uint32_t index) const;
+	};
+
+	ChunkView() = default;
+	explicit ChunkView(const void* bytes) : pointer((const uint8_t*)bytes) {}
+
+	bool valid() const { return pointer != nullptr; }
+	explicit operator bool() const { return valid(); }
+	const uint8_t* bytes() const { return pointer; }
+
+	uint32_t tag() const { return header()[0]; }
+	uint32_t size() const { return header()[1] & 0x3FFFFFFF; }
+	bool hasSubchunks() const { return header()[1] & 0x80000000; }
+	bool hasMultidata() const { return header()[1] & 0x40000000; }
+	uint32_t dataOffset() const { return (hasSubchunks() || hasMultidata()) ? header()[2] : 8; }
+	uint32_t numSubchunks() const { return hasSubchunks() ? header()[3] : 0; }
+	uint32_t numMultidata() const { return hasMultidata() ? multidataLengths()[-1] : 0; }
+
+	SubchunkRange subchunks() const;
+	MultidataRange multidata() const;
+	Span<const uint8_t> maindata() const;
+
+	ChunkView findSubchunk(uint32_t tag) const;
+
+	Chunk materialize() const;
+	// The data buffers of the chunk tree are allocated from the given resource
+	void materializeTo(Chunk& chk, std::pmr::memory_resource* resource = std::pmr::new_delete_resource()) const;
+};
 
 struct Chunk
 {
 	using DataBuffer = DynArray<uint8_t>;
 
+	// Arena holding the data buffers of this chunk tree when it was loaded, null otherwise.
+	// Declared first so that it is destroyed after the buffers.
+	// Only the root of the tree owns it, so copy subchunks instead of moving them out if they need to outlive their tree.
+	std::shared_ptr<ChunkArena> arena;
+
 	uint32_t tag = 0;
-	std::vector<DataBuffer> multidata;
+	// Bumped when the chunk tree is modified. Only maintained for the scene's packs,
+	// so that saving can tell if a pack still matches the one in the original ZIP.
+	uint32_t generation = 0;
+	MultidataList multidata;
 	std::vector<Chunk> subchunks;
 	DataBuffer maindata;
 
+	// Range of the subchunks having the same tag, in their original order.
+	// Keeps the tag index it comes from alive, but is invalidated by modifying the subchunks.
+	template <class C> class TagRange {
+	public:
+		using Entry = std::pair<uint32_t, uint32_t>;
+		class Iterator {
+			C* subchunks; const Entry* pos;
+		public:
+			Iterator(C* subchunks, const Entry* pos) : subchunks(subchunks), pos(pos) {}
+			C& operator*() const { return subchunks[pos->second]; }
+			C* operator->() const { return &subchunks[pos->second]; }
+			Iterator& operator++() { ++pos; return *this; }
+			bool operator==(const Iterator& other) const { return pos == other.pos; }
+			bool operator!=(const Iterator& other) const { return pos != other.pos; }
+		};
+		TagRange(C* subchunks, const Entry* first, const Entry* last, std::shared_ptr<const void> index)
+			: subchunks(subchunks), first(first), last(last), index(std::move(index)) {}
+		Iterator begin() const { return { subchunks, first }; }
+		Iterator end() const { return { subchunks, last }; }
+		size_t size() const { return last - first; }
+		bool empty() const { return first == last; }
+	private:
+		C* subchunks; const Entry* first; const Entry* last;
+		std::shared_ptr<const void> index;
+	};
+
 	Chunk() = default;
 	Chunk(uint32_t tag) : tag(tag) {};
+	// Copies have their data on the heap, not in the arena of the original
+	Chunk(const Chunk& other);
+	Chunk(Chunk&& other) noexcept;
+	Chunk& operator=(Chunk other) noexcept { swap(other); return *this; }
 	~Chunk();
 
+	void swap(Chunk& other) noexcept;
+
+	// findSubchunk uses a sorted tag index for chunks with many subchunks, which can be looked up from multiple threads.
+	// The index is rebuilt when the subchunks are reallocated or their count changes, and found subchunks are checked
+	// against their tag, but a tag that is not in the index is not looked for.
+	// When the tag of a subchunk is changed, or subchunks are replaced, inserted or erased without changing
+	// their storage or count, invalidateTagIndex() must be called for the index to stay exact.
 	const Chunk* findSubchunk(uint32_t tag) const;
 	Chunk* findSubchunk(uint32_t tag) { return (Chunk*)std::as_const(*this).findSubchunk(tag); }
+	TagRange<const Chunk> findSubchunks(uint32_t tag) const;
+	TagRange<Chunk> findSubchunks(uint32_t tag);
+	void invalidateTagIndex() { ++subchunksVersion; }
 
-	void load(void *bytes);
+	// Loads the chunk tree with all of its data in a single arena allocation
+	void load(const void *bytes);
+	// Same as load, but the subchunks of this chunk are loaded by multiple threads (0 = number of cores)
+	void loadParallel(const void *bytes, unsigned int numThreads = 0);
 	std::string saveToString();
-	static Chunk reconstructPackFromRepeat(void *packrep, uint32_t packrepsize, void *repeat);
+	static Chunk reconstructPackFromRepeat(const void *packrep, uint32_t packrepsize, const void *repeat);
+
+private:
+	// (tag, subchunk index) pairs sorted by tag, with the state of the subchunks it was built from
+	using TagIndexEntry = std::pair<uint32_t, uint32_t>;
+	struct TagIndex {
+		std::vector<TagIndexEntry> entries;
+		const Chunk* subchunksData = nullptr;
+		size_t subchunksSize = 0;
+		uint32_t subchunksVersion = 0;
+	};
+	// Lazily built and replaced atomically, not copied with the chunk
+	struct TagIndexHolder {
+		std::shared_ptr<const TagIndex> index;
+
+		TagIndexHolder() = default;
+		TagIndexHolder(const TagIndexHolder&) {}
+		TagIndexHolder& operator=(const TagIndexHolder&) { index.reset(); return *this; }
+	};
+	mutable TagIndexHolder tagIndex;
+	uint32_t subchunksVersion = 0;
+
+	static constexpr size_t tagIndexMinSubchunks = 8;
+	std::shared_ptr<const TagIndex> getTagIndex(bool rebuild = false) const;
+	// Entries of the subchunks with the tag, checked against the subchunks
+	std::pair<const TagIndexEntry*, const TagIndexEntry*> tagIndexRange(uint32_t tag, std::shared_ptr<const TagIndex>& index) const;
+};
+
+// Serializes a chunk tree without assembling it into one buffer.
+// The layout (sizes, data offsets, headers) is computed on construction,
+// the bytes are then produced on demand from the headers and the chunks' own buffers.
+// The chunk tree must not be modified while the serializer is used.
+class ChunkSerializer
+{
+public:
+	explicit ChunkSerializer(const Chunk& chk);
+
+	size_t size() const { return totalSize; }
+
+	// Copy up to n bytes at the given offset to dest, returns the number of bytes copied.
+	// Sequential reads are the fastest.
+	size_t read(size_t offset, void* dest, size_t n);
+	// Same as read, but can be called from multiple threads at once
+	size_t readAt(size_t offset, void* dest, size_t n) const;
+	bool writeToFile(FILE* file);
+	// Write as a PackRepeat file (headers + reconstruction records) referencing data of a Repeat file.
+	// Fails if some data cannot be found in the Repeat file.
+	bool writePackRepeat(const RepeatIndex& repeat, std::string& out) const;
+
+private:
+	struct Segment {
+		size_t offset;
+		size_t size;
+		const uint8_t* data; // null for headers until the layout is done
+		size_t headerIndex;
+		bool isHeader;
+	};
+	std::vector<uint32_t> headerWords;
+	std::vector<Segment> segments;
+	size_t totalSize = 0;
+	size_t cursor = 0;
+
+	void layout(const Chunk& chk);
+	size_t readFrom(size_t& segIndex, size_t offset, void* dest, size_t n) const;
+};
+
+// Finds data blobs in a Repeat.* file by size and content hash, for saving packs as PackRepeat.
+// The first 4 bytes are ignored, as PackRepeat overrides them.
+class RepeatIndex
+{
+public:
+	RepeatIndex(const uint8_t* repeat, size_t repeatSize);
+
+	// Index all data of the Repeat file if it is a chunk tree
+	void addChunkTree();
+	// Offset in the Repeat file of a range that has the same size and bytes (except the first 4), or -1
+	int64_t find(const uint8_t* data, size_t size) const;
+
+private:
+	const uint8_t* repeat;
+	size_t repeatSize;
+	std::unordered_multimap<uint64_t, uint32_t> ranges; // hash -> offset
+	std::unordered_set<uint64_t> indexedRanges; // offset << 32 | size
+
+	void addRange(uint32_t offset, uint32_t size);
+	static uint64_t hashRange(const uint8_t* data, size_t size);
 };
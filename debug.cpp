@@ -4,6 +4,12 @@
 
 #include "debug.h"
 
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <random>
+#include <thread>
 #include <vector>
 
 #define WIN32_LEAN_AND_MEAN
@@ -13,6 +19,9 @@
 #include "gameobj.h"
 #include "imgui/imgui.h"
 #include "classInfo.h"
+#include "MatrixCodec.h"
+#include "MappedFile.h"
+#include "SceneArchive.h"
 
 #include "ScriptParser.h"
 #include <fmt/format.h>
@@ -78,6 +87,7 @@ void IGDebugMenus()
 			uint16_t minI5 = 0xFFFF, maxI5 = 0;
 			auto walkObj = [&](GameObject* obj, auto& rec) -> void {
 				if (obj->mesh) {
+					obj->markModified();
 					for (auto& face : obj->mesh->ftxFaces) {
 						face[0] &= ~0x0200u;
 						if (face[0] & 0x80) {
@@ -119,6 +129,8 @@ void IGDebugMenus()
 		if (ImGui::MenuItem("Delete face anims")) {
 			auto walkObj = [](GameObject* obj, auto& rec) -> void {
 				if (obj->excChunk) {
+					// the EXC chunk can be shared with other objects
+					obj->markModified();
 					auto& subchunks = obj->excChunk->subchunks;
 					for (auto it = subchunks.begin(); it != subchunks.end(); ) {
 						if (it->tag == 'HPMO') {
@@ -176,6 +188,237 @@ void IGDebugMenus()
 				fmt::println("!! Script Parsing Error !!\n{}", error.message);
 			}
 		}
+		if (ImGui::MenuItem("Benchmark pack parsing")) {
+			const std::pair<const char*, Chunk*> packs[] = {
+				{ "PAL", &g_scene.palPack }, { "DXT", &g_scene.dxtPack }, { "LGT", &g_scene.lgtPack },
+				{ "WAV", &g_scene.wavPack }, { "ANM", &g_scene.anmPack }
+			};
+			unsigned int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+			for (auto& [name, pack] : packs) {
+				std::string bytes = pack->saveToString();
+				printf("----- Pack.%s (%zu bytes, %zu subchunks) -----\n", name, bytes.size(), pack->subchunks.size());
+				for (unsigned int numThreads = 1; numThreads <= maxThreads; ++numThreads) {
+					Chunk chk;
+					auto start = std::chrono::steady_clock::now();
+					chk.loadParallel(bytes.data(), numThreads);
+					double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					bool same = chk.saveToString() == bytes;
+					printf("%2u threads: %8.3f ms, %8.1f MB/s%s\n", numThreads, secs * 1000.0, bytes.size() / secs / 1e6, same ? "" : " (DIFFERENT OUTPUT!)");
+				}
+			}
+		}
+		if (ImGui::MenuItem("Benchmark PackRepeat reconstruction") && g_scene.ready && g_scene.archive) {
+			for (const char* ext : { "PAL", "DXT", "ANM", "WAV" }) {
+				std::unique_ptr<ArchiveFile> packFile = g_scene.archive->readFile(std::string("PackRepeat.") + ext);
+				if (!packFile)
+					continue;
+				MappedFile repeat;
+				auto start = std::chrono::steady_clock::now();
+				if (!repeat.open(std::string("Repeat.") + ext))
+					continue;
+				double mapSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				start = std::chrono::steady_clock::now();
+				Chunk pack = Chunk::reconstructPackFromRepeat(packFile->data(), (uint32_t)packFile->size(), repeat.data());
+				double reconsSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				printf("PackRepeat.%s: mapping Repeat.%s %8.3f ms, reconstruction %8.3f ms (%zu subchunks)\n", ext, ext,
+					mapSecs * 1000.0, reconsSecs * 1000.0, pack.subchunks.size());
+			}
+		}
+		if (ImGui::MenuItem("Benchmark findSubchunk")) {
+			std::mt19937 rng(47);
+			for (size_t width : { 4, 8, 32, 256, 4096 }) {
+				Chunk chk;
+				chk.subchunks.resize(width);
+				for (Chunk& sub : chk.subchunks)
+					sub.tag = rng();
+				std::vector<uint32_t> keys(4096);
+				for (uint32_t& key : keys)
+					key = chk.subchunks[rng() % width].tag;
+
+				const int numLookups = 1000000;
+				size_t found = 0;
+				auto start = std::chrono::steady_clock::now();
+				for (int i = 0; i < numLookups; ++i) {
+					uint32_t key = keys[i % keys.size()];
+					for (const Chunk& sub : chk.subchunks)
+						if (sub.tag == key) { found += 1; break; }
+				}
+				double linearSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				start = std::chrono::steady_clock::now();
+				for (int i = 0; i < numLookups; ++i)
+					found += chk.findSubchunk(keys[i % keys.size()]) ? 1 : 0;
+				double indexedSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				printf("%4zu subchunks: linear scan %8.2f ns, findSubchunk %8.2f ns (%zu)\n", width,
+					linearSecs * 1e9 / numLookups, indexedSecs * 1e9 / numLookups, found);
+			}
+		}
+		if (ImGui::MenuItem("Benchmark matrix codec")) {
+			// Random rotations and positions, with a few scaled matrices that need the scalar fallback when encoding,
+			// and a few with -0.0 and NaN, that must be encoded the same by all implementations
+			const size_t count = 100000;
+			std::mt19937 rng(47);
+			std::uniform_real_distribution<float> angle(-3.14159f, 3.14159f), coord(-1000.0f, 1000.0f);
+			std::vector<Matrix> sources(count);
+			for (size_t i = 0; i < count; ++i) {
+				Matrix rotation = Matrix::getRotationXMatrix(angle(rng)) * Matrix::getRotationYMatrix(angle(rng)) * Matrix::getRotationZMatrix(angle(rng));
+				if (i % 64 == 0)
+					rotation *= Matrix::getScaleMatrix(Vector3(3.0f, 3.0f, 3.0f));
+				sources[i] = rotation * Matrix::getTranslationMatrix(Vector3(coord(rng), coord(rng), coord(rng)));
+				if (i % 64 == 1) {
+					sources[i]._31 = sources[i]._22 = sources[i]._33 = -0.0f;
+				}
+				else if (i % 64 == 2) {
+					sources[i]._32 = sources[i]._21 = sources[i]._23 = std::numeric_limits<float>::quiet_NaN();
+				}
+			}
+
+			std::vector<SpkMatrixQuad> refQuads(count), quads(count);
+			std::vector<Vector3> refPositions(count), positions(count);
+			std::vector<Matrix> refMatrices(count), matrices(count);
+			double refEncodeSecs = 0.0, refDecodeSecs = 0.0;
+			const MatrixCodec::Isa bestIsa = MatrixCodec::GetBestIsa();
+			for (auto isa : { MatrixCodec::Isa::Scalar, MatrixCodec::Isa::SSE2, MatrixCodec::Isa::AVX2 }) {
+				if (isa > bestIsa)
+					break;
+				const bool isRef = isa == MatrixCodec::Isa::Scalar;
+				auto& outQuads = isRef ? refQuads : quads;
+				auto& outPositions = isRef ? refPositions : positions;
+				auto& outMatrices = isRef ? refMatrices : matrices;
+				auto start = std::chrono::steady_clock::now();
+				MatrixCodec::Encode({ sources.data(), count }, { outQuads.data(), count }, { outPositions.data(), count }, isa);
+				double encodeSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				start = std::chrono::steady_clock::now();
+				MatrixCodec::Decode({ refQuads.data(), count }, { refPositions.data(), count }, { outMatrices.data(), count }, isa);
+				double decodeSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				if (isRef) {
+					refEncodeSecs = encodeSecs;
+					refDecodeSecs = decodeSecs;
+				}
+				bool same = isRef || (!memcmp(quads.data(), refQuads.data(), count * sizeof(SpkMatrixQuad))
+					&& !memcmp(positions.data(), refPositions.data(), count * sizeof(Vector3))
+					&& !memcmp(matrices.data(), refMatrices.data(), count * sizeof(Matrix)));
+				printf("%-6s encode %8.3f ms (%.2fx), decode %8.3f ms (%.2fx)%s\n", MatrixCodec::GetIsaName(isa),
+					encodeSecs * 1000.0, refEncodeSecs / encodeSecs, decodeSecs * 1000.0, refDecodeSecs / decodeSecs, same ? "" : " (DIFFERENT OUTPUT!)");
+			}
+		}
+		if (ImGui::MenuItem("Benchmark multidata") && g_scene.ready) {
+			// Audio chunks and messages are made of thousands of small multidata elements
+			const int numRounds = 20;
+			size_t numElements = 0, numBytes = 0;
+			auto start = std::chrono::steady_clock::now();
+			for (int round = 0; round < numRounds; ++round) {
+				auto [ands, sndr] = g_scene.audioMgr.save();
+				std::string andsBytes = ands.saveToString(), sndrBytes = sndr.saveToString();
+				Chunk andsLoaded, sndrLoaded;
+				andsLoaded.load(andsBytes.data());
+				sndrLoaded.load(sndrBytes.data());
+				AudioManager audio;
+				audio.load(andsLoaded, sndrLoaded);
+				if (round == 0) {
+					auto count = [&](const Chunk& chk, const auto& rec) -> void {
+						numElements += chk.multidata.size();
+						numBytes += chk.multidata.totalSize();
+						for (const Chunk& sub : chk.subchunks)
+							rec(sub, rec);
+					};
+					count(ands, count);
+					count(sndr, count);
+				}
+			}
+			double audioSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("Audio save+load: %8.3f ms (%zu elements, %zu bytes)\n", audioSecs * 1000.0 / numRounds, numElements, numBytes);
+
+			start = std::chrono::steady_clock::now();
+			for (int round = 0; round < numRounds; ++round) {
+				Chunk msgv('VGSM');
+				msgv.subchunks.reserve(g_scene.msgDefinitions.size());
+				for (auto& [id, msg] : g_scene.msgDefinitions) {
+					Chunk& chk = msgv.subchunks.emplace_back(id);
+					chk.multidata.appendString(msg.first);
+					chk.multidata.appendString(msg.second);
+				}
+				std::string bytes = msgv.saveToString();
+				Chunk loaded;
+				loaded.load(bytes.data());
+			}
+			double msgSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("Messages save+load: %8.3f ms (%zu messages)\n", msgSecs * 1000.0 / numRounds, g_scene.msgDefinitions.size());
+		}
+		if (ImGui::MenuItem("Benchmark ConstructSPK") && g_scene.ready) {
+			const int numRounds = 5;
+			Chunk spk;
+			std::string singleBytes;
+			auto markAllModified = [](GameObject* obj, const auto& rec) -> void {
+				obj->markModified();
+				for (GameObject* child : obj->subobj)
+					rec(child, rec);
+			};
+			// with all objects encoded again, then with all of them taken from the save cache,
+			// giving the object sections back to the cache after each round as a save does
+			auto timeConstruct = [&](unsigned int numThreads, bool allModified, std::string& bytes) {
+				double bestSecs = 1e9;
+				for (int round = 0; round < numRounds; ++round) {
+					if (allModified)
+						markAllModified(g_scene.superroot, markAllModified);
+					auto start = std::chrono::steady_clock::now();
+					spk = g_scene.ConstructSPK(numThreads);
+					bestSecs = std::min(bestSecs, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+					if (round == numRounds - 1)
+						bytes = spk.saveToString();
+					g_scene.KeepObjectSections(spk);
+				}
+				return bestSecs;
+			};
+			for (unsigned int numThreads : { 1u, 0u }) {
+				std::string modifiedBytes, cachedBytes;
+				double modifiedSecs = timeConstruct(numThreads, true, modifiedBytes);
+				double cachedSecs = timeConstruct(numThreads, false, cachedBytes);
+				bool same = cachedBytes == modifiedBytes;
+				if (numThreads == 1)
+					singleBytes = std::move(modifiedBytes);
+				else
+					same = same && modifiedBytes == singleBytes;
+				printf("ConstructSPK %s: %8.3f ms, %8.3f ms with no modified objects, %s output\n",
+					(numThreads == 1) ? "single-threaded" : "parallel       ", modifiedSecs * 1000.0, cachedSecs * 1000.0, same ? "same" : "DIFFERENT");
+			}
+			spk = g_scene.ConstructSPK();
+			for (const char* name : { "PNAM", "PDBL", "PVER", "PFAC", "PDAT", "PUVC", "PEXC" })
+				if (const Chunk* section = spk.findSubchunk(*(const uint32_t*)name))
+					printf("  %s: %zu bytes\n", name, section->maindata.size());
+			g_scene.KeepObjectSections(spk);
+		}
+		if (ImGui::MenuItem("Benchmark save") && g_scene.ready) {
+			std::filesystem::path path = std::filesystem::temp_directory_path() / "c47edit_benchmark.zip";
+			// Saving changes the state used by the next save (save cache, last saved Pack.SPK...),
+			// so it is put back afterwards, and every save starts with an empty save cache
+			std::shared_ptr<SceneSaveCache> savedCache = g_scene.saveCache;
+			Chunk::DataBuffer savedSpkData = g_scene.oldSpkData;
+			std::map<std::string, uint32_t> savedPackGenerations = g_scene.archivePackGenerations;
+			SaveStats savedStats = g_scene.lastSaveStats;
+			double singleSecs = 0.0;
+			for (unsigned int numThreads : { 1u, 0u }) {
+				SaveOptions options;
+				options.deflateThreads = numThreads;
+				options.reuseUnchangedPacks = false;
+				g_scene.saveCache = nullptr;
+				g_scene.oldSpkData = savedSpkData;
+				auto start = std::chrono::steady_clock::now();
+				g_scene.SaveSceneSPK(path, options);
+				double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				if (numThreads == 1) {
+					singleSecs = secs;
+					printf("single-threaded: %8.1f ms\n", secs * 1000.0);
+				}
+				else
+					printf("parallel:        %8.1f ms (%.2fx)\n", secs * 1000.0, singleSecs / secs);
+			}
+			g_scene.saveCache = std::move(savedCache);
+			g_scene.oldSpkData = std::move(savedSpkData);
+			g_scene.archivePackGenerations = std::move(savedPackGenerations);
+			g_scene.lastSaveStats = savedStats;
+			std::error_code ec;
+			std::filesystem::remove(path, ec);
+		}
 		ImGui::EndMenu();
 	}
 }
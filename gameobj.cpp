@@ -3,10 +3,21 @@
 // Licensed under the GPL3+.
 // See LICENSE file for more details.
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <unordered_map>
 
 #include "global.h"
@@ -14,11 +25,17 @@
 #include "chunk.h"
 #include "vecmat.h"
 #include "ByteWriter.h"
+#include "ContentHash.h"
 #include "classInfo.h"
+#include "MappedFile.h"
+#include "SceneArchive.h"
+#include "SpkSections.h"
+#include "MatrixCodec.h"
 
 #include <miniz/miniz.h>
 
-std::unordered_map<GameObject*, size_t> g_objRefCounts;
+uint64_t g_objRefChanges = 0;
+ObjectTable g_objectTable; // before g_scene, whose objects are deleted when it is destroyed
 Scene g_scene;
 
 const char *objtypenames[] = {
@@ -72,61 +89,87 @@ const char *GetObjTypeString(uint32_t ot)
 	return otname;
 }
 
-uint32_t ComputeBytesum(void* data, size_t length) {
+uint32_t ComputeBytesum(const void* data, size_t length) {
 	uint32_t sum = 0;
-	uint8_t* bytes = (uint8_t*)data;
+	const uint8_t* bytes = (const uint8_t*)data;
 	for (size_t i = 0; i < length; ++i)
 		sum += bytes[i];
 	return sum;
 }
 
-static void ReadAssetPacks(Scene* scene, mz_zip_archive* zip)
-{
-	static const auto readFile = [](const std::filesystem::path& filename) {
-		void* repmem; size_t repsize;
-		FILE* repfile = nullptr;
-		_wfopen_s(&repfile, filename.c_str(), L"rb");
-		if (!repfile) ferr("Could not open Repeat.* file.\nBe sure you copied all the 4 files named \"Repeat\" (with .ANM, .DXT, .PAL, .WAV extensions) from the Hitman C47 game's folder into the editor's folder (where c47edit.exe is).");
-		fseek(repfile, 0, SEEK_END);
-		repsize = ftell(repfile);
-		fseek(repfile, 0, SEEK_SET);
-		repmem = malloc(repsize);
-		fread(repmem, repsize, 1, repfile);
-		fclose(repfile);
-		return std::make_pair(repmem, repsize);
-	};
+// The Repeat.* files are mapped once and shared by all scenes opened during the session.
+// The index, for saving packs as PackRepeat, is only built by the first save that needs it.
+struct RepeatFile {
+	MappedFile file;
+	std::unique_ptr<RepeatIndex> index;
+};
 
-	const auto readPack = [&zip](const char* ext, Chunk& pack, bool* outFound = nullptr) {
-		std::string fnPackRepeat = std::string("PackRepeat.") + ext;
-		std::string fnRepeat = std::string("Repeat.") + ext;
-		std::string fnPack = std::string("Pack.") + ext;
-		void* packmem; size_t packsize;
-		packmem = mz_zip_reader_extract_file_to_heap(zip, fnPackRepeat.c_str(), &packsize, 0);
-		if (packmem)
-		{
-			auto [repmem, repsize] = readFile(fnRepeat);
-			pack = Chunk::reconstructPackFromRepeat(packmem, packsize, repmem);
-			free(repmem);
+static const char* const missingRepeatFileError = "Could not open Repeat.* file.\nBe sure you copied all the 4 files named \"Repeat\" (with .ANM, .DXT, .PAL, .WAV extensions) from the Hitman C47 game's folder into the editor's folder (where c47edit.exe is).";
+
+// Can be called from the pack loading threads (with required = false, as ferr must be called from the main thread)
+static RepeatFile* GetRepeatFile(const std::filesystem::path& filename, bool required = true)
+{
+	static std::map<std::filesystem::path, std::unique_ptr<RepeatFile>> repeatFiles;
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+	auto& repeat = repeatFiles[filename];
+	if (!repeat) {
+		auto newRepeat = std::make_unique<RepeatFile>();
+		if (!newRepeat->file.open(filename)) {
+			if (required)
+				ferr(missingRepeatFileError);
+			return nullptr;
 		}
-		else
-		{
-			packmem = mz_zip_reader_extract_file_to_heap(zip, fnPack.c_str(), &packsize, 0);
-			if (!packmem && !outFound) ferr("Failed to find Pack.* or PackRepeat.* in ZIP archive.");
-			if (packmem)
-				pack.load(packmem);
-		}
-		if (outFound)
-			*outFound = packmem;
-		if (packmem)
-			free(packmem);
+		repeat = std::move(newRepeat);
+	}
+	return repeat.get();
+}
+
+// Starts reading all the asset packs concurrently.
+// The futures give an error message, empty on success.
+static std::vector<std::future<std::string>> ReadAssetPacksAsync(Scene* scene)
+{
+	// The packs are loaded at the same time, so each one gets its share of the cores
+	static constexpr unsigned int numPacks = 5;
+	const unsigned int threadsPerPack = std::max(1u, std::thread::hardware_concurrency() / numPacks);
+
+	const auto readPack = [scene, threadsPerPack](const char* ext, Chunk* pack, bool* outFound = nullptr) {
+		return std::async(std::launch::async, [archive = scene->archive, ext, pack, outFound, threadsPerPack]() -> std::string {
+			std::string fnPackRepeat = std::string("PackRepeat.") + ext;
+			std::string fnRepeat = std::string("Repeat.") + ext;
+			std::string fnPack = std::string("Pack.") + ext;
+			std::unique_ptr<ArchiveFile> packFile = archive->readFile(fnPackRepeat);
+			if (packFile)
+			{
+				RepeatFile* repeat = GetRepeatFile(fnRepeat, false);
+				if (!repeat)
+					return missingRepeatFileError;
+				*pack = Chunk::reconstructPackFromRepeat(packFile->data(), (uint32_t)packFile->size(), repeat->file.data());
+			}
+			else
+			{
+				packFile = archive->readFile(fnPack);
+				if (!packFile && !outFound) return "Failed to find Pack.* or PackRepeat.* in the scene archive.";
+				if (packFile)
+					pack->loadParallel(packFile->data(), threadsPerPack);
+			}
+			if (outFound)
+				*outFound = packFile != nullptr;
+			return {};
+		});
 	};
 
-	readPack("PAL", scene->palPack);
-	readPack("DXT", scene->dxtPack);
-	readPack("LGT", scene->lgtPack);
-	readPack("WAV", scene->wavPack);
-	readPack("ANM", scene->anmPack, &scene->hasAnmPack);
+	std::vector<std::future<std::string>> tasks;
+	tasks.push_back(readPack("PAL", &scene->palPack));
+	tasks.push_back(readPack("DXT", &scene->dxtPack));
+	tasks.push_back(readPack("LGT", &scene->lgtPack));
+	tasks.push_back(readPack("WAV", &scene->wavPack));
+	tasks.push_back(readPack("ANM", &scene->anmPack, &scene->hasAnmPack));
+	return tasks;
+}
 
+static void CheckAssetPacks(Scene* scene)
+{
 	if (scene->palPack.tag != 'PAL') ferr("Not a PAL chunk in Repeat.PAL");
 	if (scene->dxtPack.tag != 'DXT') ferr("Not a DXT chunk in Repeat.DXT");
 	if (scene->lgtPack.tag != 'LGT') ferr("Not a LGT chunk in Repeat.LGT");
@@ -163,48 +206,169 @@ void Scene::LoadEmpty()
 	ready = true;
 }
 
-void Scene::LoadSceneSPK(const std::filesystem::path& fn)
+// Pack.SPK being inflated on another thread, and an incremental parser of its top-level chunks
+// that lets the decoder start on a section as soon as it has been completely inflated.
+// Pack.SPK is kept inflated as is in 'data', the chunks are read through views over it.
+class SpkStream {
+public:
+	SpkStream(Chunk::DataBuffer& data, std::function<void(size_t, size_t)> onProgress) : data(data), onProgress(std::move(onProgress)) {}
+	SpkStream(const SpkStream&) = delete;
+	SpkStream& operator=(const SpkStream&) = delete;
+	~SpkStream() { if (thread.joinable()) thread.join(); }
+
+	// Starts inflating Pack.SPK on another thread if streaming, else inflates it entirely before returning
+	void start(const SceneArchive& archive, bool streaming) {
+		if (streaming)
+			thread = std::thread([this, &archive]() { inflate(archive); });
+		else
+			inflate(archive);
+	}
+
+	// Returns the top-level chunk with the given tag once it has been entirely inflated,
+	// or an invalid view if Pack.SPK doesn't have it or inflating failed
+	ChunkView waitSection(uint32_t tag) {
+		while (true) {
+			auto it = sections.find(tag);
+			if (it != sections.end())
+				return it->second;
+			if (nextSection == numSections || !parseNextSection())
+				return {};
+		}
+	}
+
+	// Waits for the end of the inflation, returns the error message, empty if successful
+	std::string waitAll() {
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [this] { return finished; });
+		return error;
+	}
+
+	size_t size() const { return totalSize; }
+
+private:
+	Chunk::DataBuffer& data;
+	std::function<void(size_t, size_t)> onProgress; // (bytes inflated, total size), called by the decoding thread
+	std::thread thread;
+
+	// Inflation state, shared between the threads
+	std::mutex mutex;
+	std::condition_variable cv;
+	size_t available = 0;
+	size_t totalSize = 0;
+	bool finished = false;
+	std::string error;
+
+	// Parser state, only used by the decoding thread
+	size_t nextOffset = 0;
+	uint32_t nextSection = 0, numSections = UINT32_MAX;
+	std::unordered_map<uint32_t, ChunkView> sections;
+
+	void inflate(const SceneArchive& archive) {
+		auto setSize = [this](size_t size) {
+			data.resize(size);
+			std::lock_guard<std::mutex> lock(mutex);
+			totalSize = size;
+			return data.data();
+		};
+		auto progress = [this](size_t pos) {
+			std::lock_guard<std::mutex> lock(mutex);
+			available = pos;
+			cv.notify_all();
+		};
+		bool success = archive.readFileStreaming("Pack.SPK", setSize, progress);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!success)
+			error = "Failed to extract Pack.SPK from the scene archive.";
+		finished = true;
+		cv.notify_all();
+	}
+
+	// Blocks until the bytes [0, end) are inflated, false if they never will be
+	bool waitFor(size_t end) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (available < end && !finished) {
+			cv.wait(lock);
+			size_t bytes = available, total = totalSize;
+			lock.unlock();
+			if (onProgress)
+				onProgress(bytes, total);
+			lock.lock();
+		}
+		return available >= end;
+	}
+
+	bool parseNextSection() {
+		if (nextSection == 0 && nextOffset == 0) {
+			// Header of the SPK chunk itself
+			if (!waitFor(16))
+				return false;
+			ChunkView spk(data.data());
+			if (!spk.hasSubchunks() || spk.hasMultidata())
+				return false;
+			numSections = spk.numSubchunks();
+			nextOffset = 16;
+			if (numSections == 0)
+				return false;
+		}
+		if (!waitFor(nextOffset + 8))
+			return false;
+		ChunkView section(data.data() + nextOffset);
+		if (!waitFor(nextOffset + section.size()))
+			return false;
+		sections.try_emplace(section.tag(), section);
+		nextOffset += section.size();
+		nextSection += 1;
+		return true;
+	}
+};
+
+void Scene::LoadSceneSPK(const std::filesystem::path& fn, const LoadOptions& options)
 {
 	Close();
 
-	FILE* zipfile = nullptr;
-	_wfopen_s(&zipfile, fn.c_str(), L"rb");
-	if (!zipfile) ferr("Could not open the ZIP file.");
-	fseek(zipfile, 0, SEEK_END);
-	size_t zipsize = ftell(zipfile);
-	fseek(zipfile, 0, SEEK_SET);
-	zipmem.resize(zipsize);
-	fread(zipmem.data(), zipsize, 1, zipfile);
-	fclose(zipfile);
-
-	mz_zip_archive zip; void *spkmem; size_t spksize;
-	mz_zip_zero_struct(&zip);
-	mz_bool mzreadok = mz_zip_reader_init_mem(&zip, zipmem.data(), zipsize, 0);
-	if (!mzreadok) ferr("Failed to initialize ZIP reading.");
-	spkmem = mz_zip_reader_extract_file_to_heap(&zip, "Pack.SPK", &spksize, 0);
-	if (!spkmem) ferr("Failed to extract Pack.SPK from ZIP archive.");
-	ReadAssetPacks(this, &zip);
-	mz_zip_reader_end(&zip);
-	Chunk spkchk;
-	spkchk.load(spkmem);
-	free(spkmem);
-	lastSpkFilepath = fn;
+	// The archive stays open while the scene is open, for the scripts and for copying the untouched files when saving
+	archive = SceneArchive::open(fn);
+	if (!archive) ferr("Could not open the scene ZIP file.");
+
+	// Pack.SPK and the asset packs are independent files, so they are read and parsed concurrently.
+	// When streaming, the objects are decoded while Pack.SPK is still being inflated,
+	// each decoding stage starting as soon as the sections it needs are complete.
+	LoadProgress progress;
+	auto reportProgress = [&options, &progress]() {
+		if (options.progress)
+			options.progress(progress);
+	};
+	SpkStream spkStream(oldSpkData, [&progress, &reportProgress](size_t bytes, size_t total) {
+		progress.bytesInflated = bytes;
+		progress.totalBytes = total;
+		reportProgress();
+	});
+	auto packTasks = ReadAssetPacksAsync(this);
+	spkStream.start(*archive, options.streaming);
+
+	// Errors are reported once everything is finished, in the same order as when loading sequentially
+	auto checkErrors = [&spkStream, &packTasks]() {
+		std::string error = spkStream.waitAll();
+		for (auto& task : packTasks) {
+			std::string packError = task.valid() ? task.get() : std::string();
+			if (error.empty())
+				error = std::move(packError);
+		}
+		if (!error.empty()) ferr(error.c_str());
+	};
+	auto section = [&spkStream, &checkErrors](uint32_t tag) {
+		ChunkView view = spkStream.waitSection(tag);
+		if (!view) {
+			checkErrors();
+			ferr("One or more important chunks were not found in Pack.SPK .");
+		}
+		return view;
+	};
 
-	Chunk* prot = spkchk.findSubchunk('TORP');
-	Chunk* pclp = spkchk.findSubchunk('PLCP');
-	Chunk* phea = spkchk.findSubchunk('AEHP');
-	Chunk* pnam = spkchk.findSubchunk('MANP');
-	Chunk* ppos = spkchk.findSubchunk('SOPP');
-	Chunk* pmtx = spkchk.findSubchunk('XTMP');
-	Chunk* pver = spkchk.findSubchunk('REVP');
-	Chunk* pfac = spkchk.findSubchunk('CAFP');
-	Chunk* pftx = spkchk.findSubchunk('XTFP');
-	Chunk* puvc = spkchk.findSubchunk('CVUP');
-	Chunk* pdbl = spkchk.findSubchunk('LBDP');
-	Chunk* pdat = spkchk.findSubchunk('TADP');
-	Chunk* pexc = spkchk.findSubchunk('CXEP');
-	if (!(prot && pclp && phea && pnam && ppos && pmtx && pver && pfac && pftx && puvc && pdbl && pdat && pexc))
-		ferr("One or more important chunks were not found in Pack.SPK .");
+	ChunkView prot = section('TORP');
+	ChunkView pclp = section('PLCP');
+	SpkHeaderSection phea(section('AEHP'));
+	SpkSection pnam(section('MANP'));
 
 	rootobj = new GameObject("Root", 0x21 /*ZROOM*/);
 	cliprootobj = new GameObject("ClipRoot", 0x21 /*ZROOM*/);
@@ -215,38 +379,81 @@ void Scene::LoadSceneSPK(const std::filesystem::path& fn)
 	rootobj->root = rootobj;
 	cliprootobj->root = cliprootobj;
 
-	// First, create the objects and an ID<->GameObject* map.
-	std::map<uint32_t, GameObject*> idobjmap;
-	std::map<Chunk*, GameObject*> chkobjmap;
-	std::function<void(Chunk*,GameObject*)> z;
-	uint32_t objid = 1;
-	z = [this, &z, &objid, &chkobjmap, &idobjmap, &phea, &pnam](Chunk *c, GameObject *parentobj) {
-		uint32_t pheaoff = c->tag & 0xFFFFFF;
-		uint32_t *p = (uint32_t*)((char*)phea->maindata.data() + pheaoff);
-		uint32_t ot = *(unsigned short*)(&p[5]);
-		char *objname = (char*)pnam->maindata.data() + p[2];
-
-		GameObject *o = new GameObject(objname, ot);
-		chkobjmap[c] = o;
+	// First, create the objects.
+	// The objects are listed in preorder (parents before their children), with their headers and states in parallel columns.
+	// The object of ID i is objects[i - 1].
+	std::vector<GameObject*> objects;
+	std::vector<const SpkObjectHeader*> headers;
+	std::vector<uint8_t> states;
+	std::function<void(ChunkView,GameObject*)> z;
+	z = [&](ChunkView c, GameObject *parentobj) {
+		const SpkObjectHeader& header = phea.object(c.tag());
+		GameObject *o = new GameObject(pnam.string(header.nameOffset), header.type);
+		objects.push_back(o);
+		headers.push_back(&header);
+		states.push_back((c.tag() >> 24) & 255);
 		parentobj->subobj.push_back(o);
 		o->parent = parentobj;
-		idobjmap[objid++] = o;
-		if (c->subchunks.size() > 0)
-			for (uint32_t i = 0; i < (uint32_t)c->subchunks.size(); i++)
-				z(&c->subchunks[i], o);
+		for (ChunkView sub : c.subchunks())
+			z(sub, o);
 	};
 
-	auto y = [z](Chunk *c, GameObject *o) {
-		for (uint32_t i = 0; i < (uint32_t)c->subchunks.size(); i++)
-			z(&c->subchunks[i], o);
+	auto y = [z](ChunkView c, GameObject *o) {
+		for (ChunkView sub : c.subchunks())
+			z(sub, o);
 	};
 
 	y(pclp, cliprootobj);
 	y(prot, rootobj);
+	const size_t numObjects = objects.size();
+	progress.totalObjects = numObjects;
+
+	// Then read/load the object properties, in stages following the order of the sections in Pack.SPK.
+	auto decodeObjects = [&](const char* stage, const auto& func) {
+		progress.stage = stage;
+		progress.objectsDecoded = 0;
+		for (size_t i = 0; i < numObjects; ++i) {
+			func(i, objects[i], *headers[i]);
+			if ((++progress.objectsDecoded & 255) == 0)
+				reportProgress();
+		}
+		reportProgress();
+	};
+
+	// The positions and rotations are gathered into columns and the matrices decoded in one batch
+	SpkSection ppos(section('SOPP'));
+	SpkSection pmtx(section('XTMP'));
+	std::vector<Matrix> matrices(numObjects);
+	{
+		Span<const SpkMatrixQuad> allQuads = pmtx.column<SpkMatrixQuad>();
+		std::vector<SpkMatrixQuad> quads(numObjects);
+		std::vector<Vector3> positions(numObjects);
+		for (size_t i = 0; i < numObjects; ++i) {
+			quads[i] = allQuads[headers[i]->matrixIndex];
+			positions[i] = ppos.at<Vector3>(headers[i]->positionOffset);
+		}
+		MatrixCodec::Decode({ quads.data(), numObjects }, { positions.data(), numObjects }, { matrices.data(), numObjects });
+	}
+	decodeObjects("Transforms", [&](size_t i, GameObject* o, const SpkObjectHeader& header) {
+		uint8_t state = states[i];
+		assert(state >= 0 && state < 4);
+		o->isIncludedScene = state & 2;
+		o->flags = header.flags;
+		o->root = o->parent->root;
+		o->matrix = matrices[i];
+	});
+	matrices = {};
+
+	SpkSection pdbl(section('LBDP'));
+	decodeObjects("DBL", [&](size_t /*index*/, GameObject* o, const SpkObjectHeader& header) {
+		o->dbl.load(pdbl.data() + header.dblOffset, objects);
+		o->dbl.forEachRef([o](GORef& ref) { ref.setOwner(o); });
+	});
 
+	// Objects with the same geometry share the mesh or line
 	using MeshKey = std::array<uint32_t, 8>;
-	auto toMeshKey = [](uint32_t* p) {
-		return MeshKey{ p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[14] };
+	auto toMeshKey = [](const SpkGeometryHeader& geo) {
+		return MeshKey{ geo.vertexIndex, geo.quadIndex, geo.triIndex, geo.ftxOffset, geo.numVertices, geo.numQuads, geo.numTris, geo.weird };
 	};
 	struct MeshKeyHash {
 		size_t operator()(const MeshKey& mi) const noexcept {
@@ -256,90 +463,53 @@ void Scene::LoadSceneSPK(const std::filesystem::path& fn)
 	std::unordered_map<MeshKey, std::shared_ptr<Mesh>, MeshKeyHash> meshMap;
 	std::unordered_map<MeshKey, std::shared_ptr<ObjLine>, MeshKeyHash> lineMap;
 
-	// Then read/load the object properties.
-	std::function<void(Chunk*, GameObject*)> g;
-	g = [&](Chunk *c, GameObject *parentobj) {
-		uint32_t pheaoff = c->tag & 0xFFFFFF;
-		uint32_t *p = (uint32_t*)((char*)phea->maindata.data() + pheaoff);
-		uint32_t ot = *(unsigned short*)(&p[5]);
-		const char *otname = GetObjTypeString(ot);
-		char *objname = (char*)pnam->maindata.data() + p[2];
-
-		GameObject *o = chkobjmap[c];
-		uint8_t state = (c->tag >> 24) & 255;
-		assert(state >= 0 && state < 4);
-		o->isIncludedScene = state & 2;
-		o->flags = *((unsigned short*)(&p[5]) + 1);
-		o->root = o->parent->root;
-
-		Vector3 position = *(Vector3*)((char*)ppos->maindata.data() + p[4]);
-		o->matrix = Matrix::getTranslationMatrix(position);
-		float mc[4];
-		int32_t *mtxoff  = (int32_t*)pmtx->maindata.data() + p[3] * 4;
-		for (int i = 0; i < 4; i++)
-			mc[i] = (float)((double)mtxoff[i] / 1073741824.0); // divide by 2^30
-		Vector3 rv[3];
-		rv[2] = Vector3(mc[0], mc[1], std::sqrt(std::max(0.0f, 1.0f - mc[0]*mc[0] - mc[1]*mc[1])));
-		rv[1] = Vector3(mc[2], mc[3], std::sqrt(std::max(0.0f, 1.0f - mc[2]*mc[2] - mc[3]*mc[3])));
-		if (mtxoff[0] & 1) rv[2].z = -rv[2].z;
-		if (mtxoff[2] & 1) rv[1].z = -rv[1].z;
-		rv[0] = rv[1].cross(rv[2]);
-		for (int i = 0; i < 3; i++)
-			for (int j = 0; j < 3; j++)
-				o->matrix.m[i][j] = rv[i].coord[j];
-
+	SpkSection pver(section('REVP'));
+	SpkSection pfac(section('CAFP'));
+	SpkSection pdat(section('TADP'));
+	SpkSection pftx(section('XTFP'));
+	SpkSection puvc(section('CVUP'));
+	decodeObjects("Geometry", [&](size_t /*index*/, GameObject* o, const SpkObjectHeader& header) {
 		if (o->flags & 0x0020)
 		{
-			o->color = p[13];
-			auto mi = toMeshKey(p);
-			auto [meshIt, isFirstTime] = meshMap.try_emplace(mi);
+			const SpkGeometryHeader& geo = phea.geometry(header);
+			o->color = geo.color;
+			auto [meshIt, isFirstTime] = meshMap.try_emplace(toMeshKey(geo));
 			if (isFirstTime) {
 				meshIt->second = std::make_shared<Mesh>();
 				Mesh* m = meshIt->second.get();
-				m->weird = p[14];
-
-				float* verts = (float*)pver->maindata.data() + p[6];
-				uint16_t* quadInds = (uint16_t*)pfac->maindata.data() + p[7];
-				uint16_t* triInds = (uint16_t*)pfac->maindata.data() + p[8];
-				m->vertices.resize(3 * p[10]);
-				m->quadindices.resize(4 * p[11]);
-				m->triindices.resize(3 * p[12]);
-				memcpy(m->vertices.data(), verts, 4 * m->vertices.size());
-				memcpy(m->quadindices.data(), quadInds, 2 * m->quadindices.size());
-				memcpy(m->triindices.data(), triInds, 2 * m->triindices.size());
+				m->weird = geo.weird;
+
+				auto verts = pver.array<float>(4 * geo.vertexIndex, 3 * geo.numVertices);
+				auto quadInds = pfac.array<uint16_t>(2 * geo.quadIndex, 4 * geo.numQuads);
+				auto triInds = pfac.array<uint16_t>(2 * geo.triIndex, 3 * geo.numTris);
+				m->vertices.assign(verts.begin(), verts.end());
+				m->quadindices.assign(quadInds.begin(), quadInds.end());
+				m->triindices.assign(triInds.begin(), triInds.end());
 
 				uint32_t ftxo = 0;
-				if (p[9] & 0x80000000) {
-					uint32_t* dat1 = (uint32_t*)(pdat->maindata.data() + (p[9] & 0x7FFFFFFF));
-					ftxo = dat1[0];
+				if (geo.ftxOffset & 0x80000000) {
+					const SpkMeshExtension& ext = pdat.at<SpkMeshExtension>(geo.ftxOffset & 0x7FFFFFFF);
+					ftxo = ext.ftxOffset;
 					m->extension = std::make_unique<Mesh::Extension>();
-					m->extension->type = dat1[1];
+					m->extension->type = ext.type;
 					assert(m->extension->type == 3 || m->extension->type == 4);
 					const int numTexAnims = (m->extension->type == 4) ? 2 : 1;
-					for (int i = 0; i < numTexAnims; ++i) {
-						auto& texAnim = m->extension->texAnims[i];
-						const uint8_t* dat2 = pdat->maindata.data() + dat1[2 + i];
-						const uint8_t* ptr2 = dat2;
-						const uint32_t numDings = *(const uint32_t*)ptr2; ptr2 += 4;
+					for (int t = 0; t < numTexAnims; ++t) {
+						auto& texAnim = m->extension->texAnims[t];
+						const uint32_t numDings = pdat.at<uint32_t>(ext.texAnimOffset[t]);
 						texAnim.frames.resize(numDings);
-						memcpy(texAnim.frames.data(), ptr2, 8 * numDings);
-						ptr2 += numDings * 8;
-						texAnim.name = (const char*)ptr2;
+						memcpy(texAnim.frames.data(), pdat.array<uint32_t>(ext.texAnimOffset[t] + 4, 2 * numDings).data(), 8 * numDings);
+						texAnim.name = pdat.string(ext.texAnimOffset[t] + 4 + 8 * numDings);
 					}
 				}
 				else {
-					ftxo = p[9];
+					ftxo = geo.ftxOffset;
 				}
 				if (ftxo != 0) {
-					uint8_t* ftx = pftx->maindata.data() + ftxo - 1;
-					uint32_t uv1off = *(uint32_t*)ftx;
-					uint32_t uv2off = *(uint32_t*)(ftx + 4);
-					uint32_t numFaces = *(uint32_t*)(ftx + 8);
-					assert(numFaces == m->getNumTris() + m->getNumQuads());
-					float* uv1 = (float*)puvc->maindata.data() + uv1off;
-					float* uv2 = (float*)puvc->maindata.data() + uv2off;
-					m->ftxFaces.resize(numFaces);
-					memcpy(m->ftxFaces.data(), ftx + 12, numFaces * 12);
+					const SpkFtxHeader& ftx = pftx.at<SpkFtxHeader>(ftxo - 1);
+					assert(ftx.numFaces == m->getNumTris() + m->getNumQuads());
+					m->ftxFaces.resize(ftx.numFaces);
+					memcpy(m->ftxFaces.data(), pftx.array<uint8_t>(ftxo - 1 + sizeof(SpkFtxHeader), ftx.numFaces * 12).data(), ftx.numFaces * 12);
 					uint32_t numTexturedFaces = 0, numLitFaces = 0;
 					for (auto& face : m->ftxFaces) {
 						if (face[0] & FTXFlag::textureMask)
@@ -347,10 +517,10 @@ void Scene::LoadSceneSPK(const std::filesystem::path& fn)
 						if (face[0] & FTXFlag::lightMapMask)
 							numLitFaces += 1;
 					}
-					m->textureCoords.resize(numTexturedFaces * 8);
-					m->lightCoords.resize(numLitFaces * 8);
-					memcpy(m->textureCoords.data(), uv1, numTexturedFaces * 8 * 4);
-					memcpy(m->lightCoords.data(), uv2, numLitFaces * 8 * 4);
+					auto uv1 = puvc.array<float>(4 * ftx.textureCoordsIndex, numTexturedFaces * 8);
+					auto uv2 = puvc.array<float>(4 * ftx.lightCoordsIndex, numLitFaces * 8);
+					m->textureCoords.assign(uv1.begin(), uv1.end());
+					m->lightCoords.assign(uv2.begin(), uv2.end());
 				}
 			}
 			o->mesh = meshIt->second;
@@ -358,98 +528,97 @@ void Scene::LoadSceneSPK(const std::filesystem::path& fn)
 
 		if (o->flags & 0x0400)
 		{
-			o->color = p[13];
-			auto mi = toMeshKey(p);
-			auto [lineIt, isFirstTime] = lineMap.try_emplace(mi);
+			const SpkGeometryHeader& geo = phea.geometry(header);
+			o->color = geo.color;
+			auto [lineIt, isFirstTime] = lineMap.try_emplace(toMeshKey(geo));
 			if (isFirstTime) {
 				lineIt->second = std::make_shared<ObjLine>();
 				ObjLine* m = lineIt->second.get();
-				assert(p[7] == 0 && p[11] == 0);
-
-				m->vertices.resize(3 * p[10]);
-				m->terms.resize(p[12]);
-				float* verts = (float*)pver->maindata.data() + p[6];
-				memcpy(m->vertices.data(), verts, 4 * m->vertices.size());
-				memcpy(m->terms.data(), pdat->maindata.data() + p[8], 4 * m->terms.size());
-				m->ftxo = p[9];
-				m->weird = p[14];
+				assert(geo.quadIndex == 0 && geo.numQuads == 0);
+
+				auto verts = pver.array<float>(4 * geo.vertexIndex, 3 * geo.numVertices);
+				auto terms = pdat.array<uint32_t>(geo.triIndex, geo.numTris);
+				m->vertices.assign(verts.begin(), verts.end());
+				m->terms.assign(terms.begin(), terms.end());
+				m->ftxo = geo.ftxOffset;
+				m->weird = geo.weird;
 			}
 			o->line = lineIt->second;
 		}
 
 		if (o->flags & 0x0080)
 		{
+			const SpkLightHeader& light = phea.light(header);
 			o->light = std::make_shared<Light>();
-			for (int i = 0; i < 7; i++)
-				o->light->param[i] = p[6 + i];
+			for (int p = 0; p < 7; p++)
+				o->light->param[p] = light.param[p];
 		}
+	});
 
-		uint8_t* dpbeg = pdbl->maindata.data() + p[0];
-		o->dbl.load(dpbeg, idobjmap);
-
-		uint32_t pexcoff = p[1];
-		if (pexcoff != 0) {
+	SpkSection pexc(section('CXEP'));
+	decodeObjects("EXC", [&](size_t /*index*/, GameObject* o, const SpkObjectHeader& header) {
+		if (header.excOffset != 0) {
 			o->excChunk = std::make_shared<Chunk>();
-			o->excChunk->load(pexc->maindata.data() + pexcoff - 1);
-		}
-
-		if (c->subchunks.size() > 0)
-		{
-			for (uint32_t i = 0; i < (uint32_t)c->subchunks.size(); i++)
-				g(&c->subchunks[i], o);
+			o->excChunk->load(pexc.data() + header.excOffset - 1);
 		}
-	};
-
-	auto f = [g](Chunk *c, GameObject *o) {
-		for (uint32_t i = 0; i < (uint32_t)c->subchunks.size(); i++)
-			g(&c->subchunks[i], o);
-	};
+	});
 
-	f(pclp, cliprootobj);
-	f(prot, rootobj);
+	// The rest needs all of Pack.SPK and the asset packs
+	checkErrors();
+	CheckAssetPacks(this);
+	RecordArchivePackGenerations();
+	ChunkView spkchk(oldSpkData.data());
+	lastSpkFilepath = fn;
 
 	// Audio objects
-	Chunk* ands = spkchk.findSubchunk('SDNA');
-	Chunk* sndr = spkchk.findSubchunk('RDNS');
+	ChunkView ands = spkchk.findSubchunk('SDNA');
+	ChunkView sndr = spkchk.findSubchunk('RDNS');
 	assert(ands && sndr);
-	audioMgr.load(*ands, *sndr);
+	audioMgr.load(ands.materialize(), sndr.materialize());
 
 	// ZDefines
-	Chunk* zdef = spkchk.findSubchunk('FEDZ');
+	ChunkView zdef = spkchk.findSubchunk('FEDZ');
 	assert(zdef);
-	zdefNames = (const char*)zdef->multidata[0].data();
-	zdefValues.load(zdef->multidata[1].data(), idobjmap);
-	zdefTypes = (const char*)zdef->multidata[2].data();
+	auto zdefData = zdef.multidata();
+	zdefNames = (const char*)zdefData[0].data();
+	zdefValues.load(zdefData[1].data(), objects);
+	zdefValues.forEachRef([](GORef& ref) { ref.setOwner(GORef::zdefOwner); });
+	zdefTypes = (const char*)zdefData[2].data();
 
 	// Messages
-	Chunk* msgv = spkchk.findSubchunk('VGSM');
-	for (Chunk& msg : msgv->subchunks) {
-		uint32_t id = msg.tag;
-		msgDefinitions[id] = std::make_pair((char*)msg.multidata[0].data(), (char*)msg.multidata[1].data());
+	ChunkView msgv = spkchk.findSubchunk('VGSM');
+	for (ChunkView msg : msgv.subchunks()) {
+		uint32_t id = msg.tag();
+		auto msgData = msg.multidata();
+		msgDefinitions[id] = std::make_pair((const char*)msgData[0].data(), (const char*)msgData[1].data());
 	}
 
 	// Texture to material assignment map
-	Chunk* matl = spkchk.findSubchunk('LTAM');
+	ChunkView matl = spkchk.findSubchunk('LTAM');
 	assert(matl);
-	Chunk* mtlv = matl->findSubchunk('VLTM');
-	assert(mtlv && mtlv->maindata.size() == 4 && *(uint32_t*)mtlv->maindata.data() == 1);
-	for (size_t i = 0; i < matl->multidata.size(); i += 3) {
-		textureMaterialMap.emplace_back((char*)matl->multidata[i].data(), (char*)matl->multidata[i + 1].data(), *(uint32_t*)matl->multidata[i + 2].data());
+	ChunkView mtlv = matl.findSubchunk('VLTM');
+	assert(mtlv && mtlv.maindata().size() == 4 && *(const uint32_t*)mtlv.maindata().data() == 1);
+	auto matlData = matl.multidata();
+	for (auto it = matlData.begin(); it != matlData.end();) {
+		const char* texName = (const char*)(*it).data(); ++it;
+		const char* matName = (const char*)(*it).data(); ++it;
+		uint32_t num = *(const uint32_t*)(*it).data(); ++it;
+		textureMaterialMap.emplace_back(texName, matName, num);
 	}
 
 	// Texture info (last ID)
-	Chunk* ptxi = spkchk.findSubchunk('IXTP');
-	numTextures = *(uint32_t*)ptxi->maindata.data();
+	ChunkView ptxi = spkchk.findSubchunk('IXTP');
+	numTextures = *(const uint32_t*)ptxi.maindata().data();
 
 	// Info string lists
-	Chunk* pzfi = spkchk.findSubchunk('IFZP');
-	Chunk* dlcf = spkchk.findSubchunk('FCLD');
-	Chunk* spat = spkchk.findSubchunk('TAPS');
+	ChunkView pzfi = spkchk.findSubchunk('IFZP');
+	ChunkView dlcf = spkchk.findSubchunk('FCLD');
+	ChunkView spat = spkchk.findSubchunk('TAPS');
 	assert(pzfi && dlcf && spat);
-	auto loadStrList = [](std::vector<std::string>& vec, Chunk* chk) {
-		if (chk->maindata.size())
-			vec.emplace_back((const char*)chk->maindata.data());
-		for (auto& dat : chk->multidata)
+	auto loadStrList = [](std::vector<std::string>& vec, ChunkView chk) {
+		if (chk.maindata().size())
+			vec.emplace_back((const char*)chk.maindata().data());
+		for (Span<const uint8_t> dat : chk.multidata())
 			vec.emplace_back((const char*)dat.data());
 	};
 	loadStrList(zipFilesIncluded, pzfi);
@@ -464,13 +633,12 @@ void Scene::LoadSceneSPK(const std::filesystem::path& fn)
 		'FEDZ', 'VGSM', 'LTAM', 'IXTP',
 		'IFZP', 'FCLD', 'TAPS'
 	};
-	for (auto& chk : spkchk.subchunks) {
-		if (std::find(std::begin(knownChunks), std::end(knownChunks), chk.tag) == std::end(knownChunks)) {
-			remainingChunks.push_back(std::move(chk)); // move since spkchk is going to be destroyed anyway
+	for (ChunkView chk : spkchk.subchunks()) {
+		if (std::find(std::begin(knownChunks), std::end(knownChunks), chk.tag()) == std::end(knownChunks)) {
+			remainingChunks.push_back(chk.materialize());
 		}
 	}
 
-	oldSpkChunk = std::move(spkchk);
 	ready = true;
 }
 
@@ -483,32 +651,113 @@ struct DBLHash
 	}
 };
 
+// Output buffer of a pack section where identical elements are stored only once.
+// Elements are found by content hash, and candidates are compared with the bytes already in the buffer,
+// so no copy of the elements is kept.
 template<typename Unit, uint32_t OffsetUnit, bool IncludeStringNullTerminator = false>
 struct PackBuffer {
 	using Elem = typename Unit::value_type;
+	static constexpr uint32_t offsetUnit = OffsetUnit;
 
-	std::vector<uint8_t> buffer;
-	std::map<Unit, uint32_t> offmap;
+	struct Entry {
+		uint32_t offset;
+		uint32_t size;
+		uint64_t hash;
+	};
+
+	Chunk::DataBuffer buffer;
+	std::vector<Entry> entries; // elements in buffer order
+	std::unordered_multimap<uint64_t, uint32_t> offmap; // content hash -> index in entries
 
 	[[nodiscard]] uint32_t addByteOffset(const Unit& elem) {
-		auto [it, inserted] = offmap.try_emplace(elem, static_cast<uint32_t>(buffer.size()));
-		if (inserted) {
-			const uint8_t* ptr = reinterpret_cast<const uint8_t*>(std::data(elem));
-			const size_t len = sizeof(Elem) * (std::size(elem) + (IncludeStringNullTerminator ? 1 : 0));
-			buffer.insert(buffer.end(), ptr, ptr + len);
-		}
-		return it->second;
+		const uint8_t* ptr = reinterpret_cast<const uint8_t*>(std::data(elem));
+		const size_t len = elemSize(elem);
+		return addBytes(ptr, len, HashBytes(ptr, len));
 	}
 	[[nodiscard]] uint32_t add(const Unit& elem) {
 		return addByteOffset(elem) / OffsetUnit;
 	}
+	// Adds an element whose content hash was computed before with hash
+	[[nodiscard]] uint32_t add(const Unit& elem, uint64_t elemHash) {
+		return addBytes(reinterpret_cast<const uint8_t*>(std::data(elem)), elemSize(elem), elemHash) / OffsetUnit;
+	}
+	static uint64_t hash(const Unit& elem) {
+		return HashBytes(std::data(elem), elemSize(elem));
+	}
+	// Adds the element written directly at the end of buffer from the given byte offset, with its content hash.
+	// If an identical element is already in the buffer, the written one is removed and the other one's offset returned.
+	[[nodiscard]] uint32_t addWritten(size_t start, uint64_t hash) {
+		const uint8_t* ptr = buffer.data() + start;
+		const size_t len = buffer.size() - start;
+		if (const Entry* entry = find(ptr, len, hash)) {
+			buffer.resize(start);
+			return entry->offset / OffsetUnit;
+		}
+		entries.push_back({ static_cast<uint32_t>(start), static_cast<uint32_t>(len), hash });
+		offmap.emplace(hash, static_cast<uint32_t>(entries.size() - 1));
+		return static_cast<uint32_t>(start) / OffsetUnit;
+	}
+	// Adds an element that is not shared with identical ones added before or after,
+	// for elements whose content is changed when merged
+	[[nodiscard]] uint32_t addUnshared(const Unit& elem) {
+		const uint8_t* ptr = reinterpret_cast<const uint8_t*>(std::data(elem));
+		const size_t len = elemSize(elem);
+		return append(ptr, len, HashBytes(ptr, len), false) / OffsetUnit;
+	}
+
+	// Adds the elements of another buffer in their order, sharing them with the identical ones of this buffer.
+	// patch(bytes, entry) can modify an element of other first, and returns true if it did.
+	// newOffsets receives the byte offset in this buffer of each entry of other,
+	// and can already be used by patch for the previous entries.
+	template <class Patch> void merge(PackBuffer& other, std::vector<uint32_t>& newOffsets, const Patch& patch) {
+		newOffsets.resize(other.entries.size());
+		for (size_t i = 0; i < other.entries.size(); ++i) {
+			const Entry& entry = other.entries[i];
+			uint8_t* ptr = other.buffer.data() + entry.offset;
+			const uint64_t hash = patch(ptr, entry) ? HashBytes(ptr, entry.size) : entry.hash;
+			newOffsets[i] = addBytes(ptr, entry.size, hash);
+		}
+	}
+	// Byte offset after merge of the element that was at the given byte offset of other
+	static uint32_t relocate(const PackBuffer& other, const std::vector<uint32_t>& newOffsets, uint32_t otherOffset) {
+		auto it = std::upper_bound(other.entries.begin(), other.entries.end(), otherOffset,
+			[](uint32_t offset, const Entry& entry) { return offset < entry.offset; });
+		assert(it != other.entries.begin() && (it - 1)->offset == otherOffset);
+		return newOffsets[(it - 1) - other.entries.begin()];
+	}
+
+	static size_t elemSize(const Unit& elem) {
+		return sizeof(Elem) * (std::size(elem) + (IncludeStringNullTerminator ? 1 : 0));
+	}
+	uint32_t addBytes(const uint8_t* ptr, size_t len, uint64_t hash) {
+		if (const Entry* entry = find(ptr, len, hash))
+			return entry->offset;
+		return append(ptr, len, hash, true);
+	}
+	const Entry* find(const uint8_t* ptr, size_t len, uint64_t hash) const {
+		auto [first, last] = offmap.equal_range(hash);
+		for (auto it = first; it != last; ++it) {
+			const Entry& entry = entries[it->second];
+			if (entry.size == len && !memcmp(buffer.data() + entry.offset, ptr, len))
+				return &entry;
+		}
+		return nullptr;
+	}
+	uint32_t append(const uint8_t* ptr, size_t len, uint64_t hash, bool shared) {
+		const uint32_t offset = static_cast<uint32_t>(buffer.size());
+		buffer.insert(buffer.end(), ptr, ptr + len);
+		entries.push_back({ offset, static_cast<uint32_t>(len), hash });
+		if (shared)
+			offmap.emplace(hash, static_cast<uint32_t>(entries.size() - 1));
+		return offset;
+	}
 };
 
 template<typename Unit, uint32_t OffsetUnit>
 struct NonsharingPackBuffer {
 	using Elem = typename Unit::value_type;
 
-	std::vector<uint8_t> buffer;
+	Chunk::DataBuffer buffer;
 
 	[[nodiscard]] uint32_t addByteOffset(const Unit& elem) {
 		const uint32_t offset = static_cast<uint32_t>(buffer.size());
@@ -520,15 +769,93 @@ struct NonsharingPackBuffer {
 	[[nodiscard]] uint32_t add(const Unit& elem) {
 		return addByteOffset(elem) / OffsetUnit;
 	}
+	// Appends another buffer, returns the byte offset where it starts
+	uint32_t merge(const NonsharingPackBuffer& other) {
+		const uint32_t offset = static_cast<uint32_t>(buffer.size());
+		buffer.insert(buffer.end(), other.buffer.begin(), other.buffer.end());
+		return offset;
+	}
+};
+
+// Position in a saved DBL of the ID of a referenced object.
+// The object is kept as a handle and serial, as it might be deleted before the cached DBL is saved again.
+struct DBLObjectRef {
+	uint32_t position;
+	uint32_t handle;
+	uint32_t serial;
+
+	DBLObjectRef(uint32_t position, const GameObject* obj)
+		: position(position), handle(obj ? obj->handle : UINT32_MAX), serial(obj ? g_objectTable.serial(obj->handle) : 0) {}
+	// Null for null references and deleted objects
+	GameObject* object() const { return g_objectTable.find(handle, serial); }
+};
+
+// Data of an object encoded for Pack.SPK that doesn't depend on the other objects.
+// It is kept in the Scene's SceneSaveCache after saving, and reused by the next saves while the object's generation is the same,
+// so that only the offsets in the pack sections and the IDs of the referenced objects are computed again.
+// The mesh and line arrays are added to the pack sections as they are, only their hashes are kept.
+struct EncodedObject {
+	uint64_t generation = 0; // of the object when encoded, 0 if not encoded yet
+	SpkMatrixQuad quad;
+	Vector3 position;
+	std::string dbl; // with the referenced objects' IDs of the last save
+	std::vector<DBLObjectRef> dblObjectRefs;
+	std::string ftx; // header, whose PUVC offsets are written at each save, then the faces
+	std::array<std::string, 2> texAnims;
+	std::string exc;
+	uint64_t nameHash = 0, dblHash = 0, verHash = 0, quadHash = 0, triHash = 0;
+	uint64_t textureCoordsHash = 0, lightCoordsHash = 0, termsHash = 0, excHash = 0;
+	std::array<uint64_t, 2> texAnimHashes = {};
+};
+
+struct SceneSaveCache {
+	// By object handle. An entry left by a deleted object has a generation no other object can have.
+	std::vector<EncodedObject> objects;
+	// TORP, PLCP and the pack sections from the last save, with what they depend on besides the objects' generations.
+	// ConstructSPK moves them into the SPK chunk, and KeepObjectSections moves them back once it is saved.
+	std::vector<Chunk> objectChunks;
+	std::vector<uint32_t> objectIDs;
+	uint64_t objRefChanges = 0;
+	uint32_t numTotalFtxFaces = 0;
+};
+
+uint64_t GameObject::newGeneration()
+{
+	static std::atomic<uint64_t> lastGeneration = 0;
+	return ++lastGeneration;
+}
+
+// Object IDs and encoded data of all objects, known before saving them
+struct SceneSaverObjects {
+	// By object handle, 0 for objects not in the scene
+	std::vector<uint32_t> objectIDs;
+	// In the save cache, in object ID order. The transforms are encoded before saving, the rest by the saver of the object's partition.
+	std::vector<EncodedObject*> encoded;
 };
 
 // Struct with all variables used when saving a Scene.
+// The objects can be split into consecutive partitions saved by different SceneSavers,
+// the later ones being merged into the first one.
 struct SceneSaver {
-	uint32_t moc_objcount;
+	// Sections referenced by offsets that are relocated when merging
+	enum class Section : uint8_t { Nam, Pos, Mtx, Dbl, Ver, Fac, Dat, Ftx, Uvc, Exc };
+
+	// Offset written at a position of PHEA, PDAT or PFTX, as (offset in the section's units + bias) | flag
+	struct OffsetFixup {
+		uint32_t position;
+		Section target;
+		uint8_t bias;
+		uint32_t flag;
+	};
+
+	// Each saver only modifies the encoded data of its own objects
+	SceneSaverObjects& objects;
+	// True for the first partition, whose offsets are already the final ones.
+	// The other ones record the fixups needed to merge them.
+	const bool offsetsAreFinal;
 	uint32_t numTotalFtxFaces = 0;
-	std::map<GameObject*, uint32_t> objidmap;
 
-	ByteWriter<std::vector<uint8_t>> heabuf;
+	ByteWriter<Chunk::DataBuffer> heabuf;
 	PackBuffer<std::array<float, 3>, 1> posPackBuf;
 	PackBuffer<std::array<uint32_t, 4>, 16> mtxPackBuf;
 	PackBuffer<std::string, 1, true> namPackBuf;
@@ -540,109 +867,209 @@ struct SceneSaver {
 	PackBuffer<std::vector<float>, 4> uvcPackBuf;
 	PackBuffer<std::string, 1> excPackBuf;
 
+	std::vector<OffsetFixup> heaFixups, datFixups, ftxFixups;
+
+	SceneSaver(SceneSaverObjects& objects, bool offsetsAreFinal) : objects(objects), offsetsAreFinal(offsetsAreFinal) {}
+
+	// 0 for null and objects not in the scene
+	uint32_t getObjectID(GameObject* obj) const {
+		return obj ? objects.objectIDs[obj->handle] : 0;
+	}
+
+	void addFixup(std::vector<OffsetFixup>& fixups, uint32_t position, Section target, uint8_t bias = 0, uint32_t flag = 0)
+	{
+		if (!offsetsAreFinal)
+			fixups.push_back({ position, target, bias, flag });
+	}
+
+	// Encodes the data of the object that doesn't depend on the other objects,
+	// except its transform which is batch-encoded before and its DBL which is encoded directly into PDBL
+	void EncodeObject(EncodedObject& enc, GameObject* o)
+	{
+		enc.nameHash = namPackBuf.hash(o->name);
+
+		assert(!(o->mesh && o->line));
+		if (o->mesh || o->line) {
+			const auto& vertices = o->mesh ? o->mesh->vertices : o->line->vertices;
+			enc.verHash = verPackBuf.hash(vertices);
+		}
+
+		enc.ftx.clear();
+		if (o->mesh) {
+			enc.triHash = facPackBuf.hash(o->mesh->triindices);
+			enc.quadHash = facPackBuf.hash(o->mesh->quadindices);
+			if (!o->mesh->ftxFaces.empty()) {
+				enc.textureCoordsHash = uvcPackBuf.hash(o->mesh->textureCoords);
+				enc.lightCoordsHash = uvcPackBuf.hash(o->mesh->lightCoords);
+				ByteWriter<std::string> sb;
+				uint32_t numFaces = (uint32_t)o->mesh->ftxFaces.size();
+				std::array<uint32_t, 3> header = { 0, 0, numFaces };
+				sb.addData(header.data(), 12);
+				sb.addData(o->mesh->ftxFaces.data(), numFaces * 12);
+				enc.ftx = sb.take();
+			}
+			if (o->mesh->extension) {
+				const int numTexAnims = (o->mesh->extension->type == 4) ? 2 : 1;
+				for (int i = 0; i < numTexAnims; ++i) {
+					const auto& texAnim = o->mesh->extension->texAnims[i];
+
+					ByteWriter<std::string> sb;
+					sb.addU32((uint32_t)texAnim.frames.size());
+					for (auto& [p1, p2] : texAnim.frames) {
+						sb.addU32(p1);
+						sb.addU32(p2);
+					}
+					sb.addStringNT(texAnim.name);
+
+					enc.texAnims[i] = sb.take();
+					enc.texAnimHashes[i] = datPackBuf.hash(enc.texAnims[i]);
+				}
+			}
+		}
+
+		if (o->line)
+			enc.termsHash = HashBytes(o->line->terms.data(), 4 * o->line->terms.size());
+
+		if (o->excChunk) {
+			enc.exc = o->excChunk->saveToString();
+			enc.excHash = excPackBuf.hash(enc.exc);
+		}
+		else
+			enc.exc.clear();
+
+		enc.generation = o->generation;
+	}
+
 	void MakeObjChunk(Chunk* c, GameObject* o, bool isclp)
 	{
-		moc_objcount++;
 		*c = {};
 
+		EncodedObject& enc = *objects.encoded[getObjectID(o) - 1];
+		const bool modified = enc.generation != o->generation;
+		if (modified)
+			EncodeObject(enc, o);
+
 		// Position
-		Vector3 position = o->matrix.getTranslationVector();
-		std::array<float, 3> cpos = { position.x, position.y, position.z };
+		std::array<float, 3> cpos = { enc.position.x, enc.position.y, enc.position.z };
 		uint32_t posoff = posPackBuf.add(cpos);
 
 		// Matrix
 		std::array<uint32_t, 4> cmtx;
-		cmtx[0] = (uint32_t)(o->matrix._31 * 1073741824.0f) & ~1u; // multiply by 2^30
-		cmtx[1] = (uint32_t)(o->matrix._32 * 1073741824.0f);
-		if (o->matrix._33 < 0) cmtx[0] |= 1;
-		cmtx[2] = (uint32_t)(o->matrix._21 * 1073741824.0f) & ~1u;
-		cmtx[3] = (uint32_t)(o->matrix._22 * 1073741824.0f);
-		if (o->matrix._23 < 0) cmtx[2] |= 1;
+		static_assert(sizeof(cmtx) == sizeof(SpkMatrixQuad));
+		memcpy(cmtx.data(), &enc.quad, sizeof(cmtx));
 		uint32_t mtxoff = mtxPackBuf.add(cmtx);
 
-		// DBL
-		std::string dblsav = o->dbl.save(*this);
-		uint32_t dbloff = dblPackBuf.add(dblsav);
+		// DBL, written at the end of PDBL and removed again if identical to a previous one.
+		// The cached one is added directly if it has no IDs of referenced objects to update.
+		uint32_t dbloff;
+		if (modified || !enc.dblObjectRefs.empty()) {
+			auto& pdbl = dblPackBuf.buffer;
+			const size_t start = pdbl.size();
+			if (modified) {
+				enc.dblObjectRefs.clear();
+				o->dbl.save(pdbl, *this, &enc.dblObjectRefs);
+				enc.dbl.assign((const char*)pdbl.data() + start, pdbl.size() - start);
+			}
+			else {
+				pdbl.append((const uint8_t*)enc.dbl.data(), enc.dbl.size());
+				for (const DBLObjectRef& ref : enc.dblObjectRefs) {
+					uint32_t id = getObjectID(ref.object());
+					memcpy(pdbl.data() + start + ref.position, &id, 4);
+				}
+			}
+			const uint64_t hash = HashBytes(pdbl.data() + start, pdbl.size() - start);
+			enc.dblHash = hash;
+			dbloff = dblPackBuf.addWritten(start, hash);
+		}
+		else
+			dbloff = dblPackBuf.add(enc.dbl, enc.dblHash);
 
 		// Name
-		uint32_t namoff = namPackBuf.add(o->name);
+		uint32_t namoff = namPackBuf.add(o->name, enc.nameHash);
 
 		// Vertices (Mesh+Line)
 		uint32_t veroff = 0, trifacoff = 0, quadfacoff = 0, linetermoff = 0, ftxoff = 0;
-		assert(!(o->mesh && o->line));
+		bool hasVertices = false;
+		std::optional<OffsetFixup> ftxoffFixup;
 		if (o->mesh || o->line) {
 			const auto& vertices = o->mesh ? o->mesh->vertices : o->line->vertices;
 			if (!vertices.empty()) {
-				veroff = verPackBuf.add(vertices);
+				veroff = verPackBuf.add(vertices, enc.verHash);
+				hasVertices = true;
 			}
 		}
 
 		// Mesh
 		if (o->mesh) {
 			if (!o->mesh->triindices.empty()) {
-				trifacoff = facPackBuf.add(o->mesh->triindices);
+				trifacoff = facPackBuf.add(o->mesh->triindices, enc.triHash);
 			}
 			if (!o->mesh->quadindices.empty()) {
-				quadfacoff = facPackBuf.add(o->mesh->quadindices);
+				quadfacoff = facPackBuf.add(o->mesh->quadindices, enc.quadHash);
 			}
 			uint32_t realftxoff = 0;
 			if (!o->mesh->ftxFaces.empty()) {
 				uint32_t tcOff = 0, lcOff = 0;
 				if (!o->mesh->textureCoords.empty()) {
-					tcOff = uvcPackBuf.add(o->mesh->textureCoords);
+					tcOff = uvcPackBuf.add(o->mesh->textureCoords, enc.textureCoordsHash);
 				}
 				if (!o->mesh->lightCoords.empty()) {
-					lcOff = uvcPackBuf.add(o->mesh->lightCoords);
+					lcOff = uvcPackBuf.add(o->mesh->lightCoords, enc.lightCoordsHash);
 				}
-				ByteWriter<std::string> sb;
-				uint32_t numFaces = (uint32_t)o->mesh->ftxFaces.size();
-				std::array<uint32_t, 3> header = { tcOff, lcOff, numFaces };
-				sb.addData(header.data(), 12);
-				sb.addData(o->mesh->ftxFaces.data(), numFaces * 12);
-				realftxoff = ftxPackBuf.add(sb.take()) + 1;
-				numTotalFtxFaces += numFaces;
+				memcpy(enc.ftx.data(), &tcOff, 4);
+				memcpy(enc.ftx.data() + 4, &lcOff, 4);
+				realftxoff = ftxPackBuf.add(enc.ftx) + 1;
+				numTotalFtxFaces += (uint32_t)o->mesh->ftxFaces.size();
+				if (!o->mesh->textureCoords.empty())
+					addFixup(ftxFixups, realftxoff - 1, Section::Uvc);
+				if (!o->mesh->lightCoords.empty())
+					addFixup(ftxFixups, realftxoff - 1 + 4, Section::Uvc);
 			}
 			if (o->mesh->extension) {
 				std::array<uint32_t, 4> ext1 = { realftxoff, o->mesh->extension->type, 0, 0 };
 				const int numTexAnims = (o->mesh->extension->type == 4) ? 2 : 1;
 				for (int i = 0; i < numTexAnims; ++i) {
-					const auto& texAnim = o->mesh->extension->texAnims[i];
-
-					ByteWriter<std::string> sb;
-					sb.addU32((uint32_t)texAnim.frames.size());
-					for (auto& [p1, p2] : texAnim.frames) {
-						sb.addU32(p1);
-						sb.addU32(p2);
-					}
-					sb.addStringNT(texAnim.name);
-
-					const uint32_t datFramesOffset = datPackBuf.add(sb.take());
+					const uint32_t datFramesOffset = datPackBuf.add(enc.texAnims[i], enc.texAnimHashes[i]);
 					ext1[2 + i] = datFramesOffset;
 				}
-				uint32_t ext1off = datPackBuf.add(std::string{ (const char*)ext1.data(), 8u + 4 * numTexAnims });
+				// The offsets it holds are relocated when merging, so it can only be shared once they are final
+				std::string ext1str{ (const char*)ext1.data(), 8u + 4 * numTexAnims };
+				uint32_t ext1off = offsetsAreFinal ? datPackBuf.add(ext1str) : datPackBuf.addUnshared(ext1str);
+				if (realftxoff)
+					addFixup(datFixups, ext1off, Section::Ftx, 1);
+				for (int i = 0; i < numTexAnims; ++i)
+					addFixup(datFixups, ext1off + 8 + 4 * i, Section::Dat);
 				ftxoff = ext1off | 0x80000000;
+				ftxoffFixup = OffsetFixup{ 0, Section::Dat, 0, 0x80000000 };
 			}
 			else {
 				ftxoff = realftxoff;
+				if (realftxoff)
+					ftxoffFixup = OffsetFixup{ 0, Section::Ftx, 1, 0 };
 			}
 		}
 
 		// Line
 		if (o->line) {
 			if (!o->line->terms.empty()) {
-				const char* ptr = (const char*)o->line->terms.data();
-				linetermoff = datPackBuf.add(std::string{ ptr, 4 * o->line->terms.size() });
+				linetermoff = datPackBuf.addBytes((const uint8_t*)o->line->terms.data(), 4 * o->line->terms.size(), enc.termsHash);
 			}
 		}
 
 		// EXC
 		uint32_t pexcoff = 0;
 		if (o->excChunk) {
-			pexcoff = excPackBuf.add(o->excChunk->saveToString()) + 1;
+			pexcoff = excPackBuf.add(enc.exc, enc.excHash) + 1;
 		}
 
 		// Object Header
 		uint32_t heaoff = (uint32_t)heabuf.size();
+		addFixup(heaFixups, heaoff, Section::Dbl);
+		if (pexcoff)
+			addFixup(heaFixups, heaoff + 4, Section::Exc, 1);
+		addFixup(heaFixups, heaoff + 8, Section::Nam);
+		addFixup(heaFixups, heaoff + 12, Section::Mtx);
+		addFixup(heaFixups, heaoff + 16, Section::Pos);
 		heabuf.addU32(dbloff);
 		heabuf.addU32(pexcoff);
 		heabuf.addU32(namoff);
@@ -653,6 +1080,14 @@ struct SceneSaver {
 		if (o->flags & 0x0020)
 		{
 			assert(o->mesh);
+			if (hasVertices)
+				addFixup(heaFixups, heaoff + 24, Section::Ver);
+			if (!o->mesh->quadindices.empty())
+				addFixup(heaFixups, heaoff + 28, Section::Fac);
+			if (!o->mesh->triindices.empty())
+				addFixup(heaFixups, heaoff + 32, Section::Fac);
+			if (ftxoffFixup)
+				addFixup(heaFixups, heaoff + 36, ftxoffFixup->target, ftxoffFixup->bias, ftxoffFixup->flag);
 			heabuf.addU32(veroff);
 			heabuf.addU32(quadfacoff);
 			heabuf.addU32(trifacoff);
@@ -669,6 +1104,10 @@ struct SceneSaver {
 		if (o->flags & 0x0400)
 		{
 			assert(o->line);
+			if (hasVertices)
+				addFixup(heaFixups, heaoff + 24, Section::Ver);
+			if (!o->line->terms.empty())
+				addFixup(heaFixups, heaoff + 32, Section::Dat);
 			uint32_t zero = 0;
 			heabuf.addU32(veroff);
 			heabuf.addU32(zero);
@@ -702,80 +1141,304 @@ struct SceneSaver {
 			i++;
 		}
 	}
+
+	// Appends the objects saved by the SceneSaver of the next partition, whose object chunks are given.
+	// Its elements are shared with the identical ones of this saver and the offsets relocated,
+	// giving the same sections as if this saver had saved all the objects.
+	void merge(SceneSaver& part, Span<Chunk* const> partChunks)
+	{
+		assert(!part.offsetsAreFinal);
+		auto noPatch = [](uint8_t*, const auto&) { return false; };
+		std::vector<uint32_t> namOffsets, posOffsets, mtxOffsets, dblOffsets, verOffsets, facOffsets, datOffsets, uvcOffsets, excOffsets;
+		namPackBuf.merge(part.namPackBuf, namOffsets, noPatch);
+		posPackBuf.merge(part.posPackBuf, posOffsets, noPatch);
+		mtxPackBuf.merge(part.mtxPackBuf, mtxOffsets, noPatch);
+		dblPackBuf.merge(part.dblPackBuf, dblOffsets, noPatch);
+		verPackBuf.merge(part.verPackBuf, verOffsets, noPatch);
+		facPackBuf.merge(part.facPackBuf, facOffsets, noPatch);
+		uvcPackBuf.merge(part.uvcPackBuf, uvcOffsets, noPatch);
+		excPackBuf.merge(part.excPackBuf, excOffsets, noPatch);
+		uint32_t ftxBase = 0;
+
+		auto relocateIn = [](const auto& partBuf, const std::vector<uint32_t>& newOffsets, uint32_t offset) {
+			using Buffer = std::decay_t<decltype(partBuf)>;
+			return Buffer::relocate(partBuf, newOffsets, offset * Buffer::offsetUnit) / Buffer::offsetUnit;
+		};
+		auto relocate = [&](Section target, uint32_t offset) -> uint32_t {
+			switch (target) {
+			case Section::Nam: return relocateIn(part.namPackBuf, namOffsets, offset);
+			case Section::Pos: return relocateIn(part.posPackBuf, posOffsets, offset);
+			case Section::Mtx: return relocateIn(part.mtxPackBuf, mtxOffsets, offset);
+			case Section::Dbl: return relocateIn(part.dblPackBuf, dblOffsets, offset);
+			case Section::Ver: return relocateIn(part.verPackBuf, verOffsets, offset);
+			case Section::Fac: return relocateIn(part.facPackBuf, facOffsets, offset);
+			case Section::Dat: return relocateIn(part.datPackBuf, datOffsets, offset);
+			case Section::Ftx: return ftxBase + offset;
+			case Section::Uvc: return relocateIn(part.uvcPackBuf, uvcOffsets, offset);
+			case Section::Exc: return relocateIn(part.excPackBuf, excOffsets, offset);
+			}
+			return offset;
+		};
+		auto applyFixup = [&](uint8_t* field, const OffsetFixup& fixup) {
+			uint32_t value;
+			memcpy(&value, field, 4);
+			value = (relocate(fixup.target, (value & ~fixup.flag) - fixup.bias) + fixup.bias) | fixup.flag;
+			memcpy(field, &value, 4);
+		};
+
+		// PFTX holds offsets to PUVC
+		for (const OffsetFixup& fixup : part.ftxFixups)
+			applyFixup(part.ftxPackBuf.buffer.data() + fixup.position, fixup);
+		ftxBase = ftxPackBuf.merge(part.ftxPackBuf);
+
+		// PDAT elements can hold offsets to PFTX and to the previous PDAT elements, the fixups are in element order
+		size_t nextDatFixup = 0;
+		datPackBuf.merge(part.datPackBuf, datOffsets, [&](uint8_t* data, const auto& entry) {
+			bool patched = false;
+			while (nextDatFixup < part.datFixups.size() && part.datFixups[nextDatFixup].position < entry.offset + entry.size) {
+				const OffsetFixup& fixup = part.datFixups[nextDatFixup++];
+				assert(fixup.position >= entry.offset);
+				applyFixup(data + (fixup.position - entry.offset), fixup);
+				patched = true;
+			}
+			return patched;
+		});
+
+		// PHEA, and the object chunk tags that are offsets in it
+		for (const OffsetFixup& fixup : part.heaFixups)
+			applyFixup(part.heabuf.getPointer(fixup.position), fixup);
+		const uint32_t heaBase = (uint32_t)heabuf.size();
+		heabuf.addData(part.heabuf.getPointer(), part.heabuf.size());
+		auto relocateTags = [heaBase](Chunk* c, const auto& rec) -> void {
+			assert((c->tag & 0xFFFFFF) + heaBase < 0x1000000);
+			c->tag += heaBase;
+			for (Chunk& sub : c->subchunks)
+				rec(&sub, rec);
+		};
+		for (Chunk* c : partChunks)
+			relocateTags(c, relocateTags);
+
+		numTotalFtxFaces += part.numTotalFtxFaces;
+	}
 };
 
-Chunk Scene::ConstructSPK()
+// Saves the objects under rootobj and cliprootobj, in the TORP and PLCP chunks and the pack sections (PHEA to PEXC)
+// added to spk. The objects are split between numThreads threads (0 = number of cores).
+// Returns the total number of FTX faces.
+static uint32_t SaveObjectSections(Chunk& spk, SceneSaverObjects& objects, GameObject* rootobj, GameObject* cliprootobj,
+	uint32_t numRootObjects, uint32_t numClipObjects, unsigned int numThreads)
+{
+	Chunk& nrot = spk.subchunks.emplace_back('TORP');
+	Chunk& nclp = spk.subchunks.emplace_back('PLCP');
+
+	// The objects directly under ROOT then CLIP, saved in that order with their subtrees
+	struct TopObject {
+		Chunk* chunk;
+		GameObject* obj;
+		bool isclp;
+		uint32_t numObjects;
+	};
+	std::vector<TopObject> topObjects;
+	topObjects.reserve(rootobj->subobj.size() + cliprootobj->subobj.size());
+	auto addTopObjects = [cliprootobj, &topObjects, &objects](Chunk& c, GameObject* o) {
+		c.subchunks.resize(o->subobj.size());
+		size_t i = 0;
+		for (GameObject* child : o->subobj) {
+			// the IDs of a subtree follow each other, the next top object's ID is after the last one
+			uint32_t firstID = objects.objectIDs[child->handle];
+			GameObject* last = child;
+			while (!last->subobj.empty())
+				last = last->subobj.back();
+			topObjects.push_back({ &c.subchunks[i++], child, o == cliprootobj, objects.objectIDs[last->handle] - firstID + 1 });
+		}
+	};
+	addTopObjects(nrot, rootobj);
+	addTopObjects(nclp, cliprootobj);
+	nrot.maindata.resize(4);
+	*(uint32_t*)nrot.maindata.data() = numRootObjects;
+	nclp.maindata.resize(4);
+	*(uint32_t*)nclp.maindata.data() = numClipObjects;
+
+	// Split the top objects into partitions of consecutive objects, a few per thread for balancing.
+	// Each one is saved by its own SceneSaver, then merged in order into the first one.
+	if (numThreads == 0)
+		numThreads = std::max(1u, std::thread::hardware_concurrency());
+	static constexpr uint32_t minPartitionObjects = 256;
+	const uint32_t numObjects = numClipObjects + numRootObjects;
+	const uint32_t partitionObjects = (numThreads > 1) ? std::max(minPartitionObjects, numObjects / (4 * numThreads)) : UINT32_MAX;
+	std::vector<std::pair<size_t, size_t>> partitions; // [first, last) in topObjects
+	uint32_t partitionSize = 0;
+	for (size_t i = 0; i < topObjects.size(); ++i) {
+		if (partitions.empty() || partitionSize >= partitionObjects) {
+			partitions.emplace_back(i, i);
+			partitionSize = 0;
+		}
+		partitions.back().second = i + 1;
+		partitionSize += topObjects[i].numObjects;
+	}
+	if (partitions.empty())
+		partitions.emplace_back(0, 0);
+
+	std::vector<std::unique_ptr<SceneSaver>> savers;
+	for (size_t p = 0; p < partitions.size(); ++p)
+		savers.push_back(std::make_unique<SceneSaver>(objects, p == 0));
+	auto savePartition = [&](size_t p) {
+		for (size_t i = partitions[p].first; i < partitions[p].second; ++i)
+			savers[p]->MakeObjChunk(topObjects[i].chunk, topObjects[i].obj, topObjects[i].isclp);
+	};
+	numThreads = (unsigned int)std::min<size_t>(numThreads, partitions.size());
+	if (numThreads <= 1) {
+		for (size_t p = 0; p < partitions.size(); ++p)
+			savePartition(p);
+	}
+	else {
+		std::atomic<size_t> next = 0;
+		auto worker = [&]() {
+			size_t p;
+			while ((p = next++) < partitions.size())
+				savePartition(p);
+		};
+		std::vector<std::thread> threads;
+		for (unsigned int t = 1; t < numThreads; ++t)
+			threads.emplace_back(worker);
+		worker();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	SceneSaver& saver = *savers[0];
+	std::vector<Chunk*> partChunks;
+	for (size_t p = 1; p < partitions.size(); ++p) {
+		partChunks.clear();
+		for (size_t i = partitions[p].first; i < partitions[p].second; ++i)
+			partChunks.push_back(topObjects[i].chunk);
+		saver.merge(*savers[p], { partChunks.data(), partChunks.size() });
+		savers[p].reset();
+	}
+
+	// Final move
+	auto serveChunk = [&](const char* name, Chunk::DataBuffer&& buffer) {
+		Chunk& newChunk = spk.subchunks.emplace_back();
+		newChunk.tag = *(uint32_t*)name;
+		newChunk.maindata = std::move(buffer);
+	};
+	serveChunk("PHEA", saver.heabuf.take());
+	serveChunk("PNAM", std::move(saver.namPackBuf.buffer));
+	serveChunk("PPOS", std::move(saver.posPackBuf.buffer));
+	serveChunk("PMTX", std::move(saver.mtxPackBuf.buffer));
+	serveChunk("PDBL", std::move(saver.dblPackBuf.buffer));
+	serveChunk("PVER", std::move(saver.verPackBuf.buffer));
+	serveChunk("PFAC", std::move(saver.facPackBuf.buffer));
+	serveChunk("PDAT", std::move(saver.datPackBuf.buffer));
+	serveChunk("PFTX", std::move(saver.ftxPackBuf.buffer));
+	serveChunk("PUVC", std::move(saver.uvcPackBuf.buffer));
+	serveChunk("PEXC", std::move(saver.excPackBuf.buffer));
+	return saver.numTotalFtxFaces;
+}
+
+Chunk Scene::ConstructSPK(unsigned int numThreads)
 {
-	SceneSaver saver;
 	Chunk newSpkChunk('SPK');
 	newSpkChunk.subchunks.reserve(30);
 
-	Chunk& nrot = newSpkChunk.subchunks.emplace_back('TORP');
-	Chunk& nclp = newSpkChunk.subchunks.emplace_back('PLCP');
-
-	uint32_t objid = 1;
-	auto z = [&objid,&saver](GameObject *o, auto& rec) -> void {
+	// The encoded data of the objects is kept in the save cache,
+	// and only the objects modified since the last save are encoded again
+	if (!saveCache)
+		saveCache = std::make_shared<SceneSaveCache>();
+	saveCache->objects.resize(g_objectTable.size());
+	SceneSaverObjects objects;
+	objects.objectIDs.resize(g_objectTable.size());
+	objects.encoded.reserve(g_objectTable.size());
+	std::vector<EncodedObject*> modifiedObjects;
+	std::vector<Matrix> modifiedMatrices;
+	auto z = [this,&objects,&modifiedObjects,&modifiedMatrices](GameObject *o, auto& rec) -> void {
 		for (auto e = o->subobj.begin(); e != o->subobj.end(); e++)
 		{
-			saver.objidmap[*e] = objid++;
+			EncodedObject& enc = saveCache->objects[(*e)->handle];
+			objects.encoded.push_back(&enc);
+			objects.objectIDs[(*e)->handle] = (uint32_t)objects.encoded.size();
+			if (enc.generation != (*e)->generation) {
+				modifiedObjects.push_back(&enc);
+				modifiedMatrices.push_back((*e)->matrix);
+			}
 			rec(*e, rec);
 		}
 	};
 	z(cliprootobj, z);
+	const uint32_t numClipObjects = (uint32_t)objects.encoded.size();
 	z(rootobj, z);
+	const uint32_t numRootObjects = (uint32_t)objects.encoded.size() - numClipObjects;
 
-	auto f = [this,&saver](Chunk *c, GameObject *o) {
-		c->subchunks.resize(o->subobj.size());
-		saver.moc_objcount = 0;
-		int i = 0;
-		for (auto e = o->subobj.begin(); e != o->subobj.end(); e++)
-		{
-			Chunk *s = &c->subchunks[i++];
-			saver.MakeObjChunk(s, *e, o==cliprootobj);
-		}
-		c->maindata.resize(4);
-		*(uint32_t*)c->maindata.data() = saver.moc_objcount;
-	};
-	f(&nrot, rootobj);
-	f(&nclp, cliprootobj);
-
-	// Fills a chunk
-	auto fillMaindata = [](uint32_t tag, Chunk *nthg, const auto& buf) {
-		using T = std::remove_reference_t<decltype(buf)>;
-		nthg->tag = tag;
-		nthg->maindata.resize(buf.size() * sizeof(typename T::value_type));
-		memcpy(nthg->maindata.data(), buf.data(), nthg->maindata.size());
-	};
+	// Drop the data of the objects removed since the last save
+	for (size_t handle = 0; handle < saveCache->objects.size(); ++handle) {
+		if (!objects.objectIDs[handle] && saveCache->objects[handle].generation)
+			saveCache->objects[handle] = {};
+	}
+
+	// Encode the transforms of the modified objects in one batch, the rest of their data is encoded by MakeObjChunk
+	std::vector<SpkMatrixQuad> modifiedQuads(modifiedMatrices.size());
+	std::vector<Vector3> modifiedPositions(modifiedMatrices.size());
+	MatrixCodec::Encode({ modifiedMatrices.data(), modifiedMatrices.size() },
+		{ modifiedQuads.data(), modifiedQuads.size() }, { modifiedPositions.data(), modifiedPositions.size() });
+	for (size_t i = 0; i < modifiedObjects.size(); ++i) {
+		modifiedObjects[i]->quad = modifiedQuads[i];
+		modifiedObjects[i]->position = modifiedPositions[i];
+	}
+
+	// With no object modified, added, removed or moved and no reference changed since the last save,
+	// the object chunks and pack sections are the same as the last ones
+	uint32_t numTotalFtxFaces;
+	if (modifiedObjects.empty() && !saveCache->objectChunks.empty() && saveCache->objRefChanges == g_objRefChanges
+		&& saveCache->objectIDs == objects.objectIDs) {
+		newSpkChunk.subchunks.insert(newSpkChunk.subchunks.end(),
+			std::make_move_iterator(saveCache->objectChunks.begin()), std::make_move_iterator(saveCache->objectChunks.end()));
+		saveCache->objectChunks.clear();
+		numTotalFtxFaces = saveCache->numTotalFtxFaces;
+	}
+	else {
+		saveCache->objectChunks.clear();
+		numTotalFtxFaces = SaveObjectSections(newSpkChunk, objects, rootobj, cliprootobj, numRootObjects, numClipObjects, numThreads);
+		saveCache->objectIDs = objects.objectIDs;
+		saveCache->objRefChanges = g_objRefChanges;
+		saveCache->numTotalFtxFaces = numTotalFtxFaces;
+	}
+	newSpkChunk.maindata.resize(8);
+	((uint32_t*)newSpkChunk.maindata.data())[0] = 10;
+	((uint32_t*)newSpkChunk.maindata.data())[1] = numTotalFtxFaces;
 
 	// Chunk comparison
-	auto chkcmp = [](Chunk* chka, Chunk* chkb, const char* name) {
+	auto chkcmp = [](ChunkView chka, Chunk* chkb, const char* name) {
 		printf("----- Comparison of old and new %s -----\n", name);
-		if (chka->tag != chkb->tag)
+		auto chkaMain = chka.maindata();
+		auto chkaMulti = chka.multidata();
+		if (chka.tag() != chkb->tag)
 			printf("Different tag\n");
-		if (chka->multidata.size() != chkb->multidata.size())
-			printf("Different num_datas: %zu -> %zu\n", chka->multidata.size(), chkb->multidata.size());
-		if (chka->maindata.size() != chkb->maindata.size())
-			printf("Different maindata_size: %zu -> %zu\n", chka->maindata.size(), chkb->maindata.size());
-		else if(chka->maindata.size()) {
+		if (chkaMulti.size() != chkb->multidata.size())
+			printf("Different num_datas: %zu -> %zu\n", (size_t)chkaMulti.size(), chkb->multidata.size());
+		if (chkaMain.size() != chkb->maindata.size())
+			printf("Different maindata_size: %zu -> %zu\n", chkaMain.size(), chkb->maindata.size());
+		else if(chkaMain.size()) {
 			uint32_t mdcmp = 0;
-			for (size_t i = 0; i < (size_t)chka->maindata.size(); i++)
-				if (((char*)chka->maindata.data())[i] != ((char*)chkb->maindata.data())[i])
+			for (size_t i = 0; i < chkaMain.size(); i++)
+				if (chkaMain[i] != chkb->maindata[i])
 					mdcmp += 1;
 			if (mdcmp != 0)
 				printf("Different maindata content: %u bytes are different\n", mdcmp);
-			auto sum_a = ComputeBytesum(chka->maindata.data(), chka->maindata.size());
+			auto sum_a = ComputeBytesum(chkaMain.data(), chkaMain.size());
 			auto sum_b = ComputeBytesum(chkb->maindata.data(), chkb->maindata.size());
 			if (sum_a != sum_b)
 				printf("Different bytesum\n");
 			else
 				printf("Same bytesum\n");
 		}
-		else if (chka->multidata.size()) {
-			int numSizeDiff = 0, numContentDiff = 0, numSame = 0, numTotal = (int)chka->multidata.size();
-			for (size_t i = 0; i < chka->multidata.size(); ++i) {
-				if (chka->multidata[i].size() != chkb->multidata[i].size())
+		else if (chkaMulti.size()) {
+			int numSizeDiff = 0, numContentDiff = 0, numSame = 0, numTotal = (int)chkaMulti.size();
+			size_t i = 0;
+			for (Span<const uint8_t> dat : chkaMulti) {
+				Span<const uint8_t> datb = chkb->multidata[i++];
+				if (dat.size() != datb.size())
 					numSizeDiff += 1;
-				else if (memcmp(chka->multidata[i].data(), chkb->multidata[i].data(), chka->multidata[i].size()))
+				else if (memcmp(dat.data(), datb.data(), dat.size()))
 					numContentDiff += 1;
 				else
 					numSame += 1;
@@ -786,27 +1449,6 @@ Chunk Scene::ConstructSPK()
 		}
 	};
 
-	// Final move
-	auto serveChunk = [&](const char* name, const auto& buffer) {
-		Chunk& newChunk = newSpkChunk.subchunks.emplace_back();
-		fillMaindata(*(uint32_t*)name, &newChunk, buffer);
-	};
-	serveChunk("PHEA", saver.heabuf.take());
-	serveChunk("PNAM", saver.namPackBuf.buffer);
-	serveChunk("PPOS", saver.posPackBuf.buffer);
-	serveChunk("PMTX", saver.mtxPackBuf.buffer);
-	serveChunk("PDBL", saver.dblPackBuf.buffer);
-	serveChunk("PVER", saver.verPackBuf.buffer);
-	serveChunk("PFAC", saver.facPackBuf.buffer);
-	serveChunk("PDAT", saver.datPackBuf.buffer);
-	serveChunk("PFTX", saver.ftxPackBuf.buffer);
-	serveChunk("PUVC", saver.uvcPackBuf.buffer);
-	serveChunk("PEXC", saver.excPackBuf.buffer);
-
-	newSpkChunk.maindata.resize(8);
-	((uint32_t*)newSpkChunk.maindata.data())[0] = 10;
-	((uint32_t*)newSpkChunk.maindata.data())[1] = saver.numTotalFtxFaces;
-
 	// Audio stuff
 	auto [andsNew, sndrNew] = audioMgr.save();
 	newSpkChunk.subchunks.emplace_back(std::move(andsNew));
@@ -814,25 +1456,22 @@ Chunk Scene::ConstructSPK()
 
 	// ZDefines
 	Chunk& zdefNew = newSpkChunk.subchunks.emplace_back('FEDZ');
-	zdefNew.multidata.resize(3);
-	auto strValues = zdefValues.save(saver);
-	zdefNew.multidata[0].resize(zdefNames.size() + 1);
-	zdefNew.multidata[1].resize(strValues.size());
-	zdefNew.multidata[2].resize(zdefTypes.size() + 1);
-	memcpy(zdefNew.multidata[0].data(), zdefNames.data(), zdefNew.multidata[0].size());
-	memcpy(zdefNew.multidata[1].data(), strValues.data(), zdefNew.multidata[1].size());
-	memcpy(zdefNew.multidata[2].data(), zdefTypes.data(), zdefNew.multidata[2].size());
+	Chunk::DataBuffer strValues;
+	SceneSaver saver(objects, true); // for the IDs of the referenced objects
+	zdefValues.save(strValues, saver);
+	zdefNew.multidata.reserve(3, zdefNames.size() + strValues.size() + zdefTypes.size() + 2);
+	zdefNew.multidata.appendString(zdefNames);
+	zdefNew.multidata.append(strValues.data(), strValues.size());
+	zdefNew.multidata.appendString(zdefTypes);
 
 	// Messages
 	Chunk& msgvNew = newSpkChunk.subchunks.emplace_back('VGSM');
 	msgvNew.subchunks.reserve(msgDefinitions.size());
 	for (auto& [id, msg] : msgDefinitions) {
 		Chunk& chk = msgvNew.subchunks.emplace_back(id);
-		chk.multidata.resize(2);
-		chk.multidata[0].resize(msg.first.size() + 1);
-		chk.multidata[1].resize(msg.second.size() + 1);
-		memcpy(chk.multidata[0].data(), msg.first.data(), chk.multidata[0].size());
-		memcpy(chk.multidata[1].data(), msg.second.data(), chk.multidata[1].size());
+		chk.multidata.reserve(2, msg.first.size() + msg.second.size() + 2);
+		chk.multidata.appendString(msg.first);
+		chk.multidata.appendString(msg.second);
 	}
 
 	// Texture to material assignment map
@@ -840,15 +1479,11 @@ Chunk Scene::ConstructSPK()
 	Chunk& mtlvNew = matlNew.subchunks.emplace_back('VLTM');
 	mtlvNew.maindata.resize(4);
 	*(uint32_t*)mtlvNew.maindata.data() = 1;
-	matlNew.multidata.resize(3 * textureMaterialMap.size());
-	for (size_t i = 0; i < textureMaterialMap.size(); ++i) {
-		auto& [texName, matName, num] = textureMaterialMap[i];
-		matlNew.multidata[3 * i].resize(texName.size() + 1);
-		matlNew.multidata[3 * i + 1].resize(matName.size() + 1);
-		matlNew.multidata[3 * i + 2].resize(4);
-		memcpy(matlNew.multidata[3 * i].data(), texName.data(), matlNew.multidata[3 * i].size());
-		memcpy(matlNew.multidata[3 * i + 1].data(), matName.data(), matlNew.multidata[3 * i + 1].size());
-		*(uint32_t*)matlNew.multidata[3 * i + 2].data() = num;
+	matlNew.multidata.reserve(3 * textureMaterialMap.size(), 40 * textureMaterialMap.size());
+	for (auto& [texName, matName, num] : textureMaterialMap) {
+		matlNew.multidata.appendString(texName);
+		matlNew.multidata.appendString(matName);
+		matlNew.multidata.append(&num, 4);
 	}
 
 	// Texture info (last ID)
@@ -859,13 +1494,8 @@ Chunk Scene::ConstructSPK()
 	// Scene info String lists
 	auto saveStrList = [&newSpkChunk](const std::vector<std::string>& vec, uint32_t tag) {
 		Chunk& chk = newSpkChunk.subchunks.emplace_back(tag);
-		chk.multidata.resize(vec.size());
-		for (size_t i = 0; i < vec.size(); ++i) {
-			auto& str = vec[i];
-			auto& dat = chk.multidata[i];
-			dat.resize(str.size() + 1);
-			memcpy(dat.data(), str.data(), str.size() + 1);
-		}
+		for (auto& str : vec)
+			chk.multidata.appendString(str);
 	};
 	saveStrList(zipFilesIncluded, 'IFZP');
 	saveStrList(dlcFiles, 'FCLD');
@@ -876,8 +1506,9 @@ Chunk Scene::ConstructSPK()
 		newSpkChunk.subchunks.push_back(rem);
 
 	// Chunk Comparisons
+	ChunkView oldSpkChunk = oldSpkData.size() ? ChunkView(oldSpkData.data()) : ChunkView();
 	for (Chunk& nchunk : newSpkChunk.subchunks) {
-		Chunk* ochunk = oldSpkChunk.findSubchunk(nchunk.tag);
+		ChunkView ochunk = oldSpkChunk.findSubchunk(nchunk.tag);
 		char name[5];
 		*(uint32_t*)name = nchunk.tag;
 		name[4] = 0;
@@ -892,89 +1523,190 @@ Chunk Scene::ConstructSPK()
 	return newSpkChunk;
 }
 
-void Scene::SaveSceneSPK(const std::filesystem::path& fn)
+void Scene::KeepObjectSections(Chunk& spk)
 {
-	mz_zip_archive outzip;
-	mz_zip_zero_struct(&outzip);
-	mz_bool mzr;
-
-	FILE* outputZipFile = nullptr;
-	_wfopen_s(&outputZipFile, fn.c_str(), L"wb");
-	if (!outputZipFile) { warn("Couldn't create the new scene ZIP file for saving."); return; }
-
-	// TEMP
-	struct FileDestructor {
-		FILE* file;
-		FileDestructor(FILE* file) : file(file) {}
-		~FileDestructor() { fclose(file); }
-	};
-	auto _ = FileDestructor(outputZipFile);
-	
-	mzr = mz_zip_writer_init_cfile(&outzip, outputZipFile, 0);
-	if (!mzr) { warn("Could not initialize the ZIP writer for saving."); return; }
-
-	if (!zipmem.empty()) {
-		mz_zip_archive inzip;
-		mz_zip_zero_struct(&inzip);
-		mzr = mz_zip_reader_init_mem(&inzip, zipmem.data(), zipmem.size(), 0);
-		if (!mzr) { warn("Couldn't reopen the original scene ZIP file."); return; }
-
-		int nfiles = mz_zip_reader_get_num_files(&inzip);
-		// Determine files to copy from original ZIP
-		static constexpr const char* nocopyFiles[] = { "Pack.SPK", "Pack.PAL", "Pack.DXT", "Pack.ANM", "Pack.WAV", "Pack.LGT",
-			"PackRepeat.PAL", "PackRepeat.DXT", "PackRepeat.ANM", "PackRepeat.WAV" };
-		std::vector<bool> allowCopy = std::vector<bool>(nfiles, true);
-		for (size_t i = 0; i < std::size(nocopyFiles); ++i) {
-			int x = mz_zip_reader_locate_file(&inzip, nocopyFiles[i], nullptr, 0);
-			if (x != -1)
-				allowCopy[x] = false;
-		}
-		// Copy the files
-		for (int i = 0; i < nfiles; i++)
-			if (allowCopy[i])
-				mz_zip_writer_add_from_zip_reader(&outzip, &inzip, i);
-		mz_zip_reader_end(&inzip);
+	// TORP, PLCP and the 11 pack sections are the first subchunks
+	static constexpr size_t numObjectSections = 13;
+	if (!saveCache || spk.subchunks.size() < numObjectSections || spk.subchunks[0].tag != 'TORP')
+		return;
+	auto sectionsEnd = spk.subchunks.begin() + numObjectSections;
+	saveCache->objectChunks.assign(std::make_move_iterator(spk.subchunks.begin()), std::make_move_iterator(sectionsEnd));
+	spk.subchunks.erase(spk.subchunks.begin(), sectionsEnd);
+}
+
+int GetSaveProfileLevel(SaveProfile profile)
+{
+	switch (profile) {
+	case SaveProfile::Fast: return MZ_BEST_SPEED;
+	case SaveProfile::Release: return MZ_DEFAULT_LEVEL;
 	}
+	return MZ_DEFAULT_LEVEL;
+}
 
-	auto saveChunk = [&outzip](Chunk* chk, const char* filename) {
-		auto str = chk->saveToString();
-		mz_zip_writer_add_mem(&outzip, filename, str.data(), str.size(), MZ_DEFAULT_COMPRESSION);
+const char* GetSaveProfileName(SaveProfile profile)
+{
+	switch (profile) {
+	case SaveProfile::Fast: return "Fast";
+	case SaveProfile::Release: return "Release";
+	}
+	return "?";
+}
+
+void Scene::SaveSceneSPK(const std::filesystem::path& fn, const SaveOptions& options)
+{
+	auto saveStart = std::chrono::steady_clock::now();
+	const int level = GetSaveProfileLevel(options.profile);
+	SaveStats stats;
+	stats.profile = options.profile;
+
+	// A ZIP is written to a temporary file first, as the destination might be
+	// the mapped original ZIP we are copying files from.
+	// The temporary file is removed if the save doesn't complete.
+	std::unique_ptr<SceneArchiveWriter> writer = SceneArchiveWriter::create(fn, level, options.deflateThreads);
+	if (!writer) { warn("Couldn't create the new scene ZIP file for saving."); return; }
+
+	// Copy the other files (scripts...) from the original archive
+	static constexpr const char* nocopyFiles[] = { "Pack.SPK", "Pack.PAL", "Pack.DXT", "Pack.ANM", "Pack.WAV", "Pack.LGT",
+		"PackRepeat.PAL", "PackRepeat.DXT", "PackRepeat.ANM", "PackRepeat.WAV" };
+	if (archive) {
+		for (const std::string& name : archive->listFiles()) {
+			bool allowCopy = std::none_of(std::begin(nocopyFiles), std::end(nocopyFiles), [&name](const char* nocopy) { return _stricmp(name.c_str(), nocopy) == 0; });
+			if (allowCopy && !writer->copyFile(*archive, name, archiveLevel, options.recompressCopies))
+				printf("Couldn't copy %s from the original scene archive\n", name.c_str());
+		}
+	}
+
+	// The chunks to save as full files are serialized and written together at the end,
+	// which lets a ZIP writer deflate them in parallel
+	std::vector<std::pair<std::string, const Chunk*>> chunksToWrite;
+	// A pack not modified since it was read from the original archive is copied as is,
+	// but only if it was stored in the form we are saving it in (full Pack or PackRepeat).
+	// The loader prefers PackRepeat, so a Pack next to a PackRepeat was not the one loaded.
+	// A pack that would have to be compressed again is saved from its chunk instead, with the others.
+	auto copyUnchangedPack = [&](Chunk* chk, const char* ext, bool asPackRepeat) {
+		if (!options.reuseUnchangedPacks || !archive)
+			return false;
+		auto it = archivePackGenerations.find(ext);
+		if (it == archivePackGenerations.end() || it->second != chk->generation)
+			return false;
+		std::string fnPackRepeat = std::string("PackRepeat.") + ext;
+		if (archive->contains(fnPackRepeat) != asPackRepeat)
+			return false;
+		std::string filename = asPackRepeat ? fnPackRepeat : std::string("Pack.") + ext;
+		if (!writer->copiesAsIs(*archive, filename, archiveLevel, options.recompressCopies)
+			|| !writer->copyFile(*archive, filename, archiveLevel, options.recompressCopies))
+			return false;
+		printf("Copied unchanged %s\n", filename.c_str());
+		return true;
+	};
+	// Save the pack as PackRepeat if all of its data can be found in the Repeat file,
+	// else as a full Pack. The file of the other form is removed, so that a folder
+	// doesn't keep an outdated one.
+	auto savePack = [&](Chunk* chk, const char* ext, bool allowPackRepeat = true) {
+		std::string fnPack = std::string("Pack.") + ext;
+		std::string fnPackRepeat = std::string("PackRepeat.") + ext;
+		if (options.usePackRepeat && allowPackRepeat) {
+			std::string fnRepeat = std::string("Repeat.") + ext;
+			if (RepeatFile* repeat = GetRepeatFile(fnRepeat, false)) {
+				if (copyUnchangedPack(chk, ext, true)) {
+					writer->removeFile(fnPack);
+					return;
+				}
+				if (!repeat->index) {
+					repeat->index = std::make_unique<RepeatIndex>(repeat->file.data(), repeat->file.size());
+					repeat->index->addChunkTree();
+				}
+				std::string packRepeat;
+				if (ChunkSerializer(*chk).writePackRepeat(*repeat->index, packRepeat)) {
+					writer->addFile(fnPackRepeat, packRepeat.data(), packRepeat.size());
+					writer->removeFile(fnPack);
+					printf("Saved %s (%zu bytes)\n", fnPackRepeat.c_str(), packRepeat.size());
+					return;
+				}
+			}
+			printf("Some data of %s is not in %s, saving the full pack\n", fnPack.c_str(), fnRepeat.c_str());
+		}
+		if (!copyUnchangedPack(chk, ext, false))
+			chunksToWrite.emplace_back(fnPack, chk);
+		writer->removeFile(fnPackRepeat);
 	};
-	Chunk spkchk = ConstructSPK();
-	saveChunk(&spkchk, "Pack.SPK");
-	oldSpkChunk = std::move(spkchk);
-	saveChunk(&palPack, "Pack.PAL");
-	saveChunk(&dxtPack, "Pack.DXT");
-	saveChunk(&lgtPack, "Pack.LGT");
-	saveChunk(&wavPack, "Pack.WAV");
+	Chunk spkchk = ConstructSPK(options.saverThreads);
+	chunksToWrite.emplace_back("Pack.SPK", &spkchk);
+	ChunkSerializer spkSerializer(spkchk);
+	oldSpkData.resize(spkSerializer.size());
+	spkSerializer.read(0, oldSpkData.data(), oldSpkData.size());
+	savePack(&palPack, "PAL");
+	savePack(&dxtPack, "DXT");
+	savePack(&lgtPack, "LGT", false);
+	savePack(&wavPack, "WAV");
 	if (hasAnmPack)
-		saveChunk(&anmPack, "Pack.ANM");
+		savePack(&anmPack, "ANM");
+
+	bool written = writer->addChunks({ chunksToWrite.data(), chunksToWrite.size() });
+	KeepObjectSections(spkchk);
+	written = writer->finish() && written;
+	stats.compressSecs = writer->compressSeconds();
+	stats.zipSize = writer->writtenSize();
+	if (!written) { warn("Failed to write the new scene ZIP file."); return; }
+
+	// Overwriting the original ZIP: the mapping must be closed before replacing the file,
+	// then the new ZIP is opened instead, as it has the same untouched files
+	std::error_code ec;
+	bool overwritesOriginal = archive && std::filesystem::equivalent(fn, archive->path(), ec);
+	if (overwritesOriginal)
+		archive.reset();
+	if (!writer->commit()) {
+		warn("Couldn't replace the scene ZIP file with the saved one.");
+		if (overwritesOriginal && !(archive = SceneArchive::open(lastSpkFilepath))) ferr("Could not reopen the original scene ZIP file.");
+		return;
+	}
+	if (overwritesOriginal) {
+		archive = SceneArchive::open(fn);
+		if (!archive) ferr("Could not reopen the saved scene ZIP file.");
+		RecordArchivePackGenerations();
+		// Every file of the new ZIP is compressed at least at the profile's level
+		archiveLevel = (archive && !archive->isFolder()) ? level : -1;
+	}
 
-	mz_zip_writer_finalize_archive(&outzip);
-	mz_zip_writer_end(&outzip);
+	stats.totalSecs = std::chrono::duration<double>(std::chrono::steady_clock::now() - saveStart).count();
+	lastSaveStats = stats;
+	printf("Saved %s (%s profile): %.1f ms, %.1f ms compressing, %llu bytes\n", fn.u8string().c_str(), GetSaveProfileName(stats.profile),
+		stats.totalSecs * 1000.0, stats.compressSecs * 1000.0, (unsigned long long)stats.zipSize);
+}
+
+void Scene::RecordArchivePackGenerations()
+{
+	archivePackGenerations.clear();
+	archivePackGenerations["PAL"] = palPack.generation;
+	archivePackGenerations["DXT"] = dxtPack.generation;
+	archivePackGenerations["LGT"] = lgtPack.generation;
+	archivePackGenerations["WAV"] = wavPack.generation;
+	if (hasAnmPack)
+		archivePackGenerations["ANM"] = anmPack.generation;
 }
 
 void Scene::Close()
 {
 	if (!ready)
 		return;
+	// The references are released first, as their counts are in the referenced objects
+	auto releaseRefs = [](GameObject* obj, const auto& rec) -> void {
+		obj->dbl = {};
+		for (GameObject* sub : obj->subobj)
+			rec(sub, rec);
+	};
 	auto destroyObj = [](GameObject* obj, const auto& rec) -> void {
 		for (GameObject* sub : obj->subobj)
 			rec(sub, rec);
 		delete obj;
 	};
-	if (superroot)
+	zdefValues = {};
+	if (superroot) {
+		releaseRefs(superroot, releaseRefs);
 		destroyObj(superroot, destroyObj);
+	}
 	ready = false;
 	*this = {}; // move a default-constructed scene
-
-	// clean ref counts
-	for (auto it = g_objRefCounts.begin(); it != g_objRefCounts.end();) {
-		if (it->second == 0u)
-			it = g_objRefCounts.erase(it);
-		else
-			++it;
-	}
 }
 
 void Scene::RemoveObject(GameObject *o)
@@ -996,6 +1728,7 @@ GameObject* Scene::DuplicateObject(GameObject *o, GameObject *parent)
 	GameObject *d = new GameObject(*o);
 	
 	//d->refcount = 0;
+	d->markModified();
 	d->subobj.clear();
 	d->parent = parent;
 	parent->subobj.push_back(d);
@@ -1016,6 +1749,69 @@ void Scene::GiveObject(GameObject *o, GameObject *t)
 	}
 	t->subobj.push_back(o);
 	o->parent = t;
+	o->markModified();
+}
+
+void Scene::MarkMeshModified(const Mesh* mesh)
+{
+	auto walkObj = [mesh](GameObject* obj, const auto& rec) -> void {
+		if (obj->mesh.get() == mesh)
+			obj->markModified();
+		for (GameObject* sub : obj->subobj)
+			rec(sub, rec);
+	};
+	if (superroot)
+		walkObj(superroot, walkObj);
+}
+
+std::vector<ObjectReference> Scene::GetReferences(const GameObject* obj)
+{
+	auto contains = [](DBLList& dbl, const GORef* ref) {
+		bool found = false;
+		dbl.forEachRef([&found, ref](GORef& other) { found |= &other == ref; });
+		return found;
+	};
+	// Follows the list of references of obj, checking the owner of each one.
+	// Fails if an owner is unknown or doesn't have the reference anymore.
+	std::vector<ObjectReference> refs;
+	auto gather = [&]() {
+		refs.clear();
+		for (const GORef* ref = obj->firstRef; ref; ref = ref->nextRef()) {
+			const uint32_t handle = ref->ownerHandle();
+			if (handle == GORef::outsideOwner)
+				continue;
+			if (handle == GORef::zdefOwner) {
+				if (!contains(zdefValues, ref))
+					return false;
+				refs.push_back({ nullptr, ref });
+				continue;
+			}
+			GameObject* owner = g_objectTable.find(handle, ref->ownerSerial());
+			if (!owner || !contains(owner->dbl, ref))
+				return false;
+			refs.push_back({ owner, ref });
+		}
+		return true;
+	};
+	if (gather())
+		return refs;
+
+	// Find the owners of all references in the scene, the references to obj left unknown are outside of it
+	for (GORef* ref = obj->firstRef; ref; ref = ref->nextRef())
+		ref->setOwner(GORef::unknownOwner);
+	auto walkObj = [](GameObject* obj, const auto& rec) -> void {
+		obj->dbl.forEachRef([obj](GORef& ref) { ref.setOwner(obj); });
+		for (GameObject* sub : obj->subobj)
+			rec(sub, rec);
+	};
+	if (superroot)
+		walkObj(superroot, walkObj);
+	zdefValues.forEachRef([](GORef& ref) { ref.setOwner(GORef::zdefOwner); });
+	for (GORef* ref = obj->firstRef; ref; ref = ref->nextRef())
+		if (ref->ownerHandle() == GORef::unknownOwner)
+			ref->setOwner(GORef::outsideOwner);
+	gather();
+	return refs;
 }
 
 void DBLList::addMembers(const std::vector<ClassInfo::ObjectMember>& members)
@@ -1122,19 +1918,19 @@ const char * DBLEntry::getTypeName(int type)
 	return "?";
 }
 
-void DBLList::load(uint8_t* dpbeg, const std::map<uint32_t, GameObject*>& idobjmap)
+void DBLList::load(const uint8_t* dpbeg, const std::vector<GameObject*>& objects)
 {
 	using ET = DBLEntry::EType;
-	auto decodeRef = [&idobjmap](uint32_t id) -> GameObject* {
+	auto decodeRef = [&objects](uint32_t id) -> GameObject* {
 		if (id != 0)
-			return idobjmap.at(id);
+			return objects.at(id - 1);
 		else
 			return nullptr;
 	};
 
-	uint32_t ds = *(uint32_t*)dpbeg & 0xFFFFFF;
-	flags = (*(uint32_t*)dpbeg >> 24) & 255;
-	uint8_t* dp = dpbeg + 4;
+	uint32_t ds = *(const uint32_t*)dpbeg & 0xFFFFFF;
+	flags = (*(const uint32_t*)dpbeg >> 24) & 255;
+	const uint8_t* dp = dpbeg + 4;
 	while (dp - dpbeg < ds)
 	{
 		if (*dp == 0xFF) {
@@ -1151,16 +1947,16 @@ void DBLList::load(uint8_t* dpbeg, const std::map<uint32_t, GameObject*>& idobjm
 		case ET::UNDEFINED:
 			break;
 		case ET::DOUBLE:
-			e.value = *(double*)dp;
+			e.value = *(const double*)dp;
 			dp += 8;
 			break;
 		case ET::FLOAT:
-			e.value = *(float*)dp;
+			e.value = *(const float*)dp;
 			dp += 4;
 			break;
 		case ET::INT:
 		case ET::MSG:
-			e.value = *(uint32_t*)dp;
+			e.value = *(const uint32_t*)dp;
 			dp += 4;
 			break;
 		case ET::STRING:
@@ -1171,33 +1967,33 @@ void DBLList::load(uint8_t* dpbeg, const std::map<uint32_t, GameObject*>& idobjm
 		case ET::TERMINATOR:
 			break;
 		case ET::DATA: {
-			auto datsize = *(uint32_t*)dp - 4;
+			auto datsize = *(const uint32_t*)dp - 4;
 			e.value.emplace<std::vector<uint8_t>>(dp + 4, dp + 4 + datsize);
-			dp += *(uint32_t*)dp;
+			dp += *(const uint32_t*)dp;
 			break;
 		}
 		case ET::ZGEOMREF:
-			e.value.emplace<GORef>(decodeRef(*(uint32_t*)dp));
+			e.value.emplace<GORef>(decodeRef(*(const uint32_t*)dp));
 			dp += 4;
 			break;
 		case ET::ZGEOMREFTAB: {
-			uint32_t nobjs = (*(uint32_t*)dp - 4) / 4;
+			uint32_t nobjs = (*(const uint32_t*)dp - 4) / 4;
 			std::vector<GORef>& objlist = e.value.emplace<std::vector<GORef>>();
 			for (uint32_t i = 0; i < nobjs; i++)
-				objlist.emplace_back(decodeRef(*(uint32_t*)(dp + 4 + 4 * i)));
-			dp += *(uint32_t*)dp;
+				objlist.emplace_back(decodeRef(*(const uint32_t*)(dp + 4 + 4 * i)));
+			dp += *(const uint32_t*)dp;
 			break;
 		}
 		case ET::SNDREF: {
 			AudioRef& aoref = e.value.emplace<AudioRef>();
-			aoref.id = *(uint32_t*)dp;
+			aoref.id = *(const uint32_t*)dp;
 			dp += 4;
 			break;
 		}
 		case ET::SCRIPT: {
 			DBLList& sublist = e.value.emplace<DBLList>();
-			uint32_t dblsize = *(uint32_t*)dp;
-			sublist.load(dp, idobjmap);
+			uint32_t dblsize = *(const uint32_t*)dp;
+			sublist.load(dp, objects);
 			dp += dblsize;
 			break;
 		}
@@ -1207,10 +2003,11 @@ void DBLList::load(uint8_t* dpbeg, const std::map<uint32_t, GameObject*>& idobjm
 	}
 }
 
-std::string DBLList::save(SceneSaver& sceneSaver)
+void DBLList::save(Chunk::DataBuffer& out, SceneSaver& sceneSaver, std::vector<DBLObjectRef>* objectRefs)
 {
 	using ET = DBLEntry::EType;
-	ByteWriter<std::string> dblsav;
+	ByteWriter<Chunk::DataBuffer&> dblsav(out);
+	const size_t start = dblsav.size();
 	dblsav.addU32(0);
 	for (auto e = entries.begin(); e != entries.end(); e++)
 	{
@@ -1242,7 +2039,9 @@ std::string DBLList::save(SceneSaver& sceneSaver)
 		case ET::ZGEOMREF:
 		{
 			auto& obj = std::get<GORef>(e->value);
-			uint32_t x = sceneSaver.objidmap[obj.get()];
+			uint32_t x = sceneSaver.getObjectID(obj.get());
+			if (objectRefs)
+				objectRefs->emplace_back((uint32_t)(dblsav.size() - start), obj.get());
 			dblsav.addU32(x); break;
 		}
 		case ET::ZGEOMREFTAB:
@@ -1251,7 +2050,9 @@ std::string DBLList::save(SceneSaver& sceneSaver)
 			uint32_t siz = (uint32_t)vec.size() * 4 + 4;
 			dblsav.addU32(siz);
 			for (auto& obj : vec) {
-				uint32_t x = sceneSaver.objidmap[obj.get()];
+				uint32_t x = sceneSaver.getObjectID(obj.get());
+				if (objectRefs)
+					objectRefs->emplace_back((uint32_t)(dblsav.size() - start), obj.get());
 				dblsav.addU32(x);
 			}
 			break;
@@ -1261,17 +2062,51 @@ std::string DBLList::save(SceneSaver& sceneSaver)
 		case ET::SCRIPT:
 		{
 			auto& sublist = std::get<DBLList>(e->value);
-			auto subdblsav = sublist.save(sceneSaver);
-			dblsav.addData(subdblsav.data(), subdblsav.size());
+			const size_t firstSubRef = objectRefs ? objectRefs->size() : 0;
+			const uint32_t subStart = (uint32_t)(dblsav.size() - start);
+			sublist.save(out, sceneSaver, objectRefs);
+			if (objectRefs)
+				for (size_t i = firstSubRef; i < objectRefs->size(); ++i)
+					(*objectRefs)[i].position += subStart;
 			break;
 		}
 		}
 	}
 	if (!entries.empty())
 		dblsav.addU8(0xFF);
-	std::string str = dblsav.take();
-	*(uint32_t*)str.data() = (uint32_t)str.size() | (flags << 24);
-	return str;
+	const uint32_t header = (uint32_t)(dblsav.size() - start) | (flags << 24);
+	memcpy(dblsav.getPointer(start), &header, 4);
+}
+
+uint32_t ObjectTable::add(GameObject* obj)
+{
+	if (freeHandles.empty()) {
+		objects.push_back(obj);
+		serials.push_back(0);
+		return (uint32_t)(objects.size() - 1);
+	}
+	uint32_t handle = freeHandles.back();
+	freeHandles.pop_back();
+	objects[handle] = obj;
+	return handle;
+}
+
+void ObjectTable::remove(uint32_t handle)
+{
+	assert(objects[handle]);
+	objects[handle] = nullptr;
+	serials[handle] += 1;
+	freeHandles.push_back(handle);
+}
+
+// Copies everything but the handle and generation, which are new
+GameObject::GameObject(const GameObject& other)
+	: name(other.name), matrix(other.matrix), type(other.type), flags(other.flags), isIncludedScene(other.isIncludedScene),
+	subobj(other.subobj), parent(other.parent), root(other.root),
+	mesh(other.mesh), line(other.line), color(other.color), light(other.light),
+	dbl(other.dbl), excChunk(other.excChunk)
+{
+	dbl.forEachRef([this](GORef& ref) { ref.setOwner(this); });
 }
 
 std::string GameObject::getPath() const
@@ -8,46 +8,73 @@
 #include <array>
 #include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
-#include <unordered_map>
 #include <variant>
 #include <vector>
 
 #include "chunk.h"
+#include "Span.h"
 #include "vecmat.h"
 #include "AudioManager.h"
 
 struct GameObject;
 struct Chunk;
 struct Scene;
+class SceneArchive;
 
 namespace ClassInfo {
 	struct ObjectMember;
 }
 
-extern std::unordered_map<GameObject*, size_t> g_objRefCounts;
+// Incremented whenever a GORef to an object is set or released, but not when it is only moved
+extern uint64_t g_objRefChanges;
 
+// Counted reference to a GameObject. The references to an object are linked in a list kept by the object,
+// and know which object has them in its DBL (their owner), so that Scene::GetReferences doesn't go through the scene.
 class GORef
 {
 private:
 	GameObject * m_obj = nullptr;
+	// Neighbours in the list of the references to m_obj
+	GORef* m_prev = nullptr;
+	GORef* m_next = nullptr;
+	// Handle and serial (see ObjectTable) of the owner, or one of the owner values below.
+	// Copies don't know their owner, a moved reference keeps the owner of its source and an assigned one its own.
+	uint32_t m_ownerHandle = unknownOwner;
+	uint32_t m_ownerSerial = 0;
+
+	void link() noexcept;
+	void unlink() noexcept;
+	void take(GORef& ref) noexcept;
 public:
+	static constexpr uint32_t unknownOwner = UINT32_MAX;
+	static constexpr uint32_t zdefOwner = UINT32_MAX - 1; // in the ZDEF values of the scene
+	static constexpr uint32_t outsideOwner = UINT32_MAX - 2; // not in the scene, such as references held by the UI
+
 	GameObject * get() const noexcept { return m_obj; }
 	bool valid() const noexcept { return m_obj; }
 	GameObject* operator->() const noexcept { return m_obj; }
 	explicit operator bool() const noexcept { return valid(); }
+	// Next reference to the same object
+	GORef* nextRef() const noexcept { return m_next; }
+
+	uint32_t ownerHandle() const noexcept { return m_ownerHandle; }
+	uint32_t ownerSerial() const noexcept { return m_ownerSerial; }
+	void setOwner(uint32_t handle, uint32_t serial = 0) noexcept { m_ownerHandle = handle; m_ownerSerial = serial; }
+	void setOwner(const GameObject* owner) noexcept;
 
 	void set(GameObject* obj) noexcept;
 	void deref() noexcept;
 	void operator=(const GORef& ref) noexcept { set(ref.m_obj); }
-	void operator=(GORef&& ref) noexcept { deref(); m_obj = ref.m_obj; ref.m_obj = nullptr; }
+	void operator=(GORef&& ref) noexcept { if (this != &ref) { deref(); take(ref); } }
 	void operator=(GameObject* obj) noexcept { set(obj); }
 
-	GORef() noexcept : m_obj(nullptr) {}
+	GORef() noexcept {}
 	GORef(const GORef& ref) noexcept { set(ref.m_obj); }
-	GORef(GORef&& ref) noexcept { m_obj = ref.m_obj; ref.m_obj = nullptr; }
+	GORef(GORef&& ref) noexcept { take(ref); m_ownerHandle = ref.m_ownerHandle; m_ownerSerial = ref.m_ownerSerial; }
 	GORef(GameObject* obj) noexcept { set(obj); }
 	~GORef() noexcept { deref(); }
 };
@@ -115,15 +142,22 @@ struct Light
 };
 
 struct DBLEntry;
+struct DBLObjectRef;
 struct SceneSaver;
+struct SceneSaveCache;
 
 struct DBLList {
 	int flags = 0;
 	std::vector<DBLEntry> entries;
 
-	void load(uint8_t* ptr, const std::map<uint32_t, GameObject*>& idobjmap);
-	std::string save(SceneSaver& sceneSaver);
+	// The object of ID i is objects[i - 1]
+	void load(const uint8_t* ptr, const std::vector<GameObject*>& objects);
+	// Appends the encoded list to out, its size being written once the rest is.
+	// objectRefs receives where the IDs of the referenced objects are written, from the start of the list.
+	void save(Chunk::DataBuffer& out, SceneSaver& sceneSaver, std::vector<DBLObjectRef>* objectRefs = nullptr);
 	void addMembers(const std::vector<ClassInfo::ObjectMember>& members);
+	// Calls func with every object reference of the list, including the ones in script lists
+	template <class Func> void forEachRef(Func&& func);
 };
 
 struct DBLEntry
@@ -152,6 +186,47 @@ struct DBLEntry
 	static const char* getTypeName(int type);
 };
 
+template <class Func> void DBLList::forEachRef(Func&& func)
+{
+	for (DBLEntry& entry : entries) {
+		if (GORef* ref = std::get_if<GORef>(&entry.value))
+			func(*ref);
+		else if (auto* list = std::get_if<std::vector<GORef>>(&entry.value)) {
+			for (GORef& ref : *list)
+				func(ref);
+		}
+		else if (DBLList* sublist = std::get_if<DBLList>(&entry.value))
+			sublist->forEachRef(func);
+	}
+}
+
+// All existing objects, indexed by their handle.
+// The handles of deleted objects are given to the next new ones, so that they stay dense
+// and data per object can be kept in vectors indexed by handle instead of maps keyed by pointer.
+// Objects must be created and deleted on the main thread.
+class ObjectTable {
+public:
+	uint32_t add(GameObject* obj);
+	void remove(uint32_t handle);
+	// Greater than all handles in use
+	size_t size() const { return objects.size(); }
+	// Null for a free handle
+	GameObject* operator[](uint32_t handle) const { return objects[handle]; }
+	// Changes when the handle's object is removed, so that a handle and its serial
+	// identify an object even after the handle is given to another one
+	uint32_t serial(uint32_t handle) const { return serials[handle]; }
+	// The object of the handle if it still has this serial, else null
+	GameObject* find(uint32_t handle, uint32_t serial) const {
+		return (handle < objects.size() && serials[handle] == serial) ? objects[handle] : nullptr;
+	}
+
+private:
+	std::vector<GameObject*> objects;
+	std::vector<uint32_t> serials;
+	std::vector<uint32_t> freeHandles;
+};
+extern ObjectTable g_objectTable;
+
 struct GameObject
 {
 	std::string name;
@@ -173,29 +248,125 @@ struct GameObject
 	DBLList dbl;
 	std::shared_ptr<Chunk> excChunk;
 
-	//uint32_t refcount = 0;
-	size_t getRefCount() { return g_objRefCounts[this]; }
+	// Changes whenever the object's own data is modified, so that saving can reuse the encoded data of the other objects.
+	// Unique among all objects, including the ones freed before.
+	uint64_t generation = newGeneration();
+
+	// Index in g_objectTable, constant for the object's lifetime. A copy gets its own handle.
+	const uint32_t handle = g_objectTable.add(this);
+
+	// Number of GORefs to the object, and the first of them
+	size_t refCount = 0;
+	GORef* firstRef = nullptr;
+	size_t getRefCount() const { return refCount; }
 
 	GameObject(const char *nName = "Unnamed", int nType = 0) : name(nName), type(nType) {}
-	GameObject(const GameObject& other) = default;
-	~GameObject() = default;
+	GameObject(const GameObject& other);
+	GameObject& operator=(const GameObject&) = delete;
+	~GameObject() { g_objectTable.remove(handle); }
 
 	std::string getPath() const;
 	GameObject* findByPath(std::string_view path) const;
 	Matrix getGlobalTransform(GameObject* reference = nullptr) const;
+
+	// To call after changing the name, transform, DBL, mesh, EXC... of the object, or after copying it
+	void markModified() { generation = newGeneration(); }
+	static uint64_t newGeneration();
 };
 
-inline void GORef::deref() noexcept { if (m_obj) { g_objRefCounts[m_obj]--; m_obj = nullptr; } }
-inline void GORef::set(GameObject * obj) noexcept { deref(); m_obj = obj; if (m_obj) g_objRefCounts[m_obj]++; }
+inline void GORef::link() noexcept { m_prev = nullptr; m_next = m_obj->firstRef; if (m_next) m_next->m_prev = this; m_obj->firstRef = this; }
+inline void GORef::unlink() noexcept
+{
+	(m_prev ? m_prev->m_next : m_obj->firstRef) = m_next;
+	if (m_next)
+		m_next->m_prev = m_prev;
+	m_prev = m_next = nullptr;
+}
+// Takes the place of ref in the list of its object, without changing the count
+inline void GORef::take(GORef& ref) noexcept
+{
+	m_obj = ref.m_obj;
+	if (!m_obj)
+		return;
+	m_prev = ref.m_prev;
+	m_next = ref.m_next;
+	(m_prev ? m_prev->m_next : m_obj->firstRef) = this;
+	if (m_next)
+		m_next->m_prev = this;
+	ref.m_obj = nullptr;
+	ref.m_prev = ref.m_next = nullptr;
+}
+inline void GORef::deref() noexcept { if (m_obj) { unlink(); m_obj->refCount--; m_obj = nullptr; ++g_objRefChanges; } }
+inline void GORef::set(GameObject * obj) noexcept { deref(); m_obj = obj; if (m_obj) { link(); m_obj->refCount++; ++g_objRefChanges; } }
+inline void GORef::setOwner(const GameObject* owner) noexcept { setOwner(owner->handle, g_objectTable.serial(owner->handle)); }
+
+// Reference to an object from the DBL of another object of a scene, or from the scene's ZDEF values if object is null
+struct ObjectReference {
+	GameObject* object;
+	const GORef* ref;
+};
+
+enum class SaveProfile {
+	Fast,    // level 1 deflate, for quick saves while editing
+	Release, // default deflate level, smaller ZIP
+};
+
+// Compression level of the ZIP entries for a save profile
+int GetSaveProfileLevel(SaveProfile profile);
+const char* GetSaveProfileName(SaveProfile profile);
+
+struct SaveOptions {
+	SaveProfile profile = SaveProfile::Release;
+	// Save the PAL, DXT, WAV and ANM packs as PackRepeat.* referencing
+	// the game's Repeat.* files when all their data can be found there
+	bool usePackRepeat = false;
+	// Threads deflating the packs (0 = number of cores, 1 = stream each pack on the calling thread)
+	unsigned int deflateThreads = 0;
+	// Copy packs unchanged since loading from the original ZIP instead of recompressing them
+	bool reuseUnchangedPacks = true;
+	// Compress the files copied from the original ZIP again, even those already compressed at least at the profile's level
+	bool recompressCopies = false;
+	// Threads serializing the objects into Pack.SPK (0 = number of cores, 1 = single-threaded)
+	unsigned int saverThreads = 0;
+};
+
+// Timings of the last save
+struct SaveStats {
+	SaveProfile profile = SaveProfile::Release;
+	double totalSecs = 0.0;
+	double compressSecs = 0.0; // deflating on worker threads, 0 when streamed
+	uint64_t zipSize = 0;
+};
+
+struct LoadProgress {
+	// Pack.SPK inflation
+	size_t bytesInflated = 0, totalBytes = 0;
+	// Current object decoding stage
+	const char* stage = nullptr;
+	size_t objectsDecoded = 0, totalObjects = 0;
+};
+
+struct LoadOptions {
+	// Decode the objects while Pack.SPK is still being inflated
+	bool streaming = true;
+	// Called on the loading thread as Pack.SPK is inflated and the objects are decoded
+	std::function<void(const LoadProgress&)> progress;
+};
 
 struct Scene {
-	Chunk oldSpkChunk;
+	Chunk::DataBuffer oldSpkData; // Pack.SPK as loaded or last saved, for comparison
 	GameObject* rootobj = nullptr, * cliprootobj = nullptr, * superroot = nullptr;
 	std::filesystem::path lastSpkFilepath;
-	std::vector<uint8_t> zipmem;
+	std::shared_ptr<SceneArchive> archive; // ZIP or folder the scene was loaded from
+	// Generation of the packs in archive, by extension (PAL, DXT...).
+	// When saving, a pack with the same generation is copied as is from archive.
+	std::map<std::string, uint32_t> archivePackGenerations;
+	// Deflate level that all the files of archive have at least, when it was written by a save, else -1
+	int archiveLevel = -1;
 	Chunk palPack, dxtPack, lgtPack, anmPack, wavPack;
 	bool hasAnmPack = false;
 	bool ready = false;
+	SaveStats lastSaveStats;
 	AudioManager audioMgr;
 
 	std::string zdefNames;
@@ -212,10 +383,21 @@ struct Scene {
 
 	std::vector<Chunk> remainingChunks; // such as PSCR
 
+	// Encoded data of the objects from the last ConstructSPK, reused for the objects not modified since
+	std::shared_ptr<SceneSaveCache> saveCache;
+
 	void LoadEmpty();
-	void LoadSceneSPK(const std::filesystem::path& fn);
-	Chunk ConstructSPK();
-	void SaveSceneSPK(const std::filesystem::path& fn);
+	// fn is a scene ZIP, or a folder with the extracted files of one
+	void LoadSceneSPK(const std::filesystem::path& fn, const LoadOptions& options = {});
+	// The objects are serialized by numThreads threads (0 = number of cores), the result is the same for any number.
+	// The object sections of the result are moved from the save cache, and can be given back with KeepObjectSections.
+	Chunk ConstructSPK(unsigned int numThreads = 0);
+	// Moves the object sections of spk, from the last ConstructSPK, to the save cache once spk has been saved,
+	// so that the next ConstructSPK can reuse them if no object changed
+	void KeepObjectSections(Chunk& spk);
+	// Saves to a ZIP, or into a folder if fn is an existing directory
+	void SaveSceneSPK(const std::filesystem::path& fn, const SaveOptions& options = {});
+	void RecordArchivePackGenerations();
 	void Close();
 	~Scene() { Close(); }
 	
@@ -223,6 +405,11 @@ struct Scene {
 	void RemoveObject(GameObject *o);
 	GameObject* DuplicateObject(GameObject *o, GameObject *parent = nullptr);
 	void GiveObject(GameObject *o, GameObject *t);
+	// Marks all objects using the mesh as modified, after changing it
+	void MarkMeshModified(const Mesh* mesh);
+	// References to obj from the objects of the scene and the ZDEF values, in no particular order.
+	// Only valid until a reference is changed or an object is deleted.
+	std::vector<ObjectReference> GetReferences(const GameObject* obj);
 };
 extern Scene g_scene;
 
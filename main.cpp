@@ -5,6 +5,7 @@
 
 #define _USE_MATH_DEFINES
 #include <charconv>
+#include <chrono>
 #include <cmath>
 #include <ctime>
 #include <filesystem>
@@ -28,6 +29,7 @@
 #include "ModelImporter.h"
 #include "PathfinderInfo.h"
 #include "ScriptParser.h"
+#include "SceneArchive.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
@@ -56,13 +58,25 @@ bool findsel = false;
 uint32_t framesincursec = 0, framespersec = 0, lastfpscheck;
 Vector3 cursorpos(0, 0, 0);
 bool renderExc = false;
+SaveOptions g_saveOptions;
 
 enum class ObjVisibility {
 	Default = 0,
 	Show = 1,
 	Hide = 2
 };
-std::unordered_map<GameObject*, ObjVisibility> objVisibilityMap;
+// Set by the user, by object handle. Empty until a visibility is set for the first time.
+std::vector<ObjVisibility> objVisibilities;
+
+ObjVisibility GetObjVisibility(const GameObject* obj) {
+	return (obj->handle < objVisibilities.size()) ? objVisibilities[obj->handle] : ObjVisibility::Default;
+}
+
+void SetObjVisibility(const GameObject* obj, ObjVisibility vis) {
+	if (obj->handle >= objVisibilities.size())
+		objVisibilities.resize(g_objectTable.size(), ObjVisibility::Default);
+	objVisibilities[obj->handle] = vis;
+}
 bool showZGates = false, showZBounds = false;
 bool showInvisibleObjects = false;
 
@@ -76,13 +90,11 @@ bool IsObjectVisible(GameObject* obj) {
 	if (!showZBounds && obj->type == 28)
 		return false;
 	for (GameObject* par = obj; par != nullptr; par = par->parent) {
-		auto it = objVisibilityMap.find(par);
-		if (it != objVisibilityMap.end()) {
-			if (it->second == ObjVisibility::Show)
-				return true;
-			if (it->second == ObjVisibility::Hide)
-				return false;
-		}
+		ObjVisibility vis = GetObjVisibility(par);
+		if (vis == ObjVisibility::Show)
+			return true;
+		if (vis == ObjVisibility::Hide)
+			return false;
 	}
 	return false;
 }
@@ -136,8 +148,10 @@ bool IGStdStringInput(const char* label, std::string& str) {
 	return ImGui::InputText(label, str.data(), str.capacity() + 1, ImGuiInputTextFlags_CallbackResize, IGStdStringInputCallback, &str);
 }
 
-void IGAudioRef(const char* name, AudioRef& ref)
+// Returns true if ref was changed
+bool IGAudioRef(const char* name, AudioRef& ref)
 {
+	const uint32_t oldId = ref.id;
 	AudioObject* obj = g_scene.audioMgr.getObject(ref.id);
 	std::string preview = std::to_string(ref.id);
 	if (obj) {
@@ -174,10 +188,13 @@ void IGAudioRef(const char* name, AudioRef& ref)
 		}
 		ImGui::EndDragDropTarget();
 	}
+	return ref.id != oldId;
 }
 
-void IGMessageValue(const char* name, uint32_t& ref)
+// Returns true if ref was changed
+bool IGMessageValue(const char* name, uint32_t& ref)
 {
+	const uint32_t oldRef = ref;
 	auto getName = [](int id) -> std::string {
 		auto it = g_scene.msgDefinitions.find(id);
 		if (it != g_scene.msgDefinitions.end()) {
@@ -197,6 +214,7 @@ void IGMessageValue(const char* name, uint32_t& ref)
 		}
 		ImGui::EndCombo();
 	}
+	return ref != oldRef;
 }
 
 class c47editException : public std::runtime_error { using std::runtime_error::runtime_error; };
@@ -242,38 +260,49 @@ void CopyObjectToAnotherScene(Scene& srcScene, Scene& destScene, GameObject* ogO
 		return 0;
 		};
 
-	std::map<GameObject*, GameObject*> cloneMap;
-	auto walkObj = [&cloneMap,&destScene](GameObject* obj, GameObject* parent, auto& rec) -> void {
+	// Clones by handle of the original object
+	std::vector<GameObject*> cloneMap(g_objectTable.size());
+	std::vector<GameObject*> clones;
+	auto walkObj = [&cloneMap,&clones,&destScene](GameObject* obj, GameObject* parent, auto& rec) -> void {
 		GameObject* clone = new GameObject(*obj);
+		clone->markModified();
 		clone->subobj.clear();
 		clone->parent = parent;
 		clone->root = destScene.rootobj;
 		parent->subobj.push_back(clone);
-		cloneMap[obj] = clone;
+		cloneMap[obj->handle] = clone;
+		clones.push_back(clone);
 		for (GameObject* child : obj->subobj)
 			rec(child, clone, rec);
 		};
 	walkObj(ogObject, destScene.rootobj, walkObj);
 
-	if (!srcScene.lgtPack.subchunks.empty() && destScene.lgtPack.subchunks.empty()) // TODO: Improve
+	// The references must all be to objects of the subscene, which are replaced by their clones.
+	// Otherwise the clones are removed before any reference is changed, as the source scene's objects will be deleted.
+	auto findClone = [&cloneMap](const GORef& ref) -> GameObject* {
+		return (ref->handle < cloneMap.size()) ? cloneMap[ref->handle] : nullptr;
+		};
+	bool allRefsCloned = true;
+	for (GameObject* clone : clones)
+		clone->dbl.forEachRef([&](GORef& ref) { if (ref && !findClone(ref)) allRefsCloned = false; });
+	if (!allRefsCloned) {
+		auto& topObjects = destScene.rootobj->subobj;
+		topObjects.erase(std::find(topObjects.begin(), topObjects.end(), clones.front()));
+		for (GameObject* clone : clones)
+			delete clone;
+		throw c47editException("Reference to object outside of the subscene");
+	}
+	for (GameObject* clone : clones)
+		clone->dbl.forEachRef([&](GORef& ref) { if (ref) ref = findClone(ref); });
+
+	if (!srcScene.lgtPack.subchunks.empty() && destScene.lgtPack.subchunks.empty()) { // TODO: Improve
 		destScene.lgtPack.subchunks.emplace_back(srcScene.lgtPack.subchunks[0]);
+		++destScene.lgtPack.generation;
+	}
 	std::map<int, int> textureMap;
-	auto fixref = [&cloneMap](GORef& ref) {
-		if (ref) {
-			auto it = cloneMap.find(ref.get());
-			if (it == cloneMap.end())
-				throw c47editException("Reference to object outside of the subscene");
-			ref = it->second;
-		}
-		};
-	for (const auto& [obj, clone] : cloneMap) {
+	for (GameObject* clone : clones) {
 		for (auto& de : clone->dbl.entries) {
-			if (de.type == DBLEntry::EType::ZGEOMREF)
-				fixref(std::get<GORef>(de.value));
-			else if (de.type == DBLEntry::EType::ZGEOMREFTAB)
-				for (auto& go : std::get<std::vector<GORef>>(de.value))
-					fixref(go);
-			else if (de.type == DBLEntry::EType::SNDREF) {
+			if (de.type == DBLEntry::EType::SNDREF) {
 				std::function<void(AudioRef&)> fixAudioRef;
 				AudioRefReflector arr{ fixAudioRef };
 				fixAudioRef = [&srcScene, &destScene, &getSoundId, &arr](AudioRef& aref) -> void {
@@ -316,6 +345,7 @@ void CopyObjectToAnotherScene(Scene& srcScene, Scene& destScene, GameObject* ogO
 							}
 							// then do the copy
 							destScene.wavPack.subchunks.insert(destScene.wavPack.subchunks.begin() + destWaveIndex, srcScene.wavPack.subchunks.at(srcWaveIndex));
+							++destScene.wavPack.generation;
 						}
 					}
 					aref.id = destId;
@@ -358,10 +388,13 @@ void CopyObjectToAnotherScene(Scene& srcScene, Scene& destScene, GameObject* ogO
 								auto& texCopyDxt = destScene.dxtPack.subchunks.emplace_back(*ogDxt);
 								*(uint32_t*)texCopyPal.maindata.data() = destScene.numTextures;
 								*(uint32_t*)texCopyDxt.maindata.data() = destScene.numTextures;
+								++destScene.palPack.generation;
+								++destScene.dxtPack.generation;
 							}
 							else {
 								auto& texCopyLgt = destScene.lgtPack.subchunks.emplace_back(*ogPal);
 								*(uint32_t*)texCopyLgt.maindata.data() = destScene.numTextures;
+								++destScene.lgtPack.generation;
 							}
 							textureMap[ogTexId] = destScene.numTextures;
 							face[index] = (uint16_t)destScene.numTextures;
@@ -383,14 +416,18 @@ void CmdDuplicateObjectAndAdapt(GameObject* obj)
 	if (isRootObject(obj))
 		return;
 
-	std::unordered_map<GameObject*, GameObject*> cloneMap;
+	// Clones by handle of the original object
+	std::vector<GameObject*> cloneMap(g_objectTable.size());
+	std::vector<GameObject*> clones;
 
 	auto duplicate = [&](GameObject* og, GameObject* parent, const auto& rec) -> GameObject*
 		{
 			GameObject* clone = new GameObject(*og);
+			clone->markModified();
 			clone->subobj.clear();
 			clone->parent = parent;
-			cloneMap[og] = clone;
+			cloneMap[og->handle] = clone;
+			clones.push_back(clone);
 			for (GameObject* child : og->subobj) {
 				GameObject* clonedChild = rec(child, clone, rec);
 				clone->subobj.push_back(clonedChild);
@@ -404,19 +441,21 @@ void CmdDuplicateObjectAndAdapt(GameObject* obj)
 	obj->parent->subobj.insert(it, clone);
 
 	// update references to original objects with clones in the cloned objects
-	auto updateDbl = [&cloneMap](DBLList& dbl, const auto& rec) -> void
+	auto findClone = [&cloneMap](const GORef& ref) -> GameObject*
+		{
+			return (ref && ref->handle < cloneMap.size()) ? cloneMap[ref->handle] : nullptr;
+		};
+	auto updateDbl = [&findClone](DBLList& dbl, const auto& rec) -> void
 		{
 			for (auto& entry : dbl.entries) {
 				if (GORef* ref = std::get_if<GORef>(&entry.value)) {
-					auto it = cloneMap.find(ref->get());
-					if (it != cloneMap.end())
-						*ref = it->second;
+					if (GameObject* clone = findClone(*ref))
+						*ref = clone;
 				}
 				else if (auto* list = std::get_if<std::vector<GORef>>(&entry.value)) {
 					for (GORef& ref : *list) {
-						auto it = cloneMap.find(ref.get());
-						if (it != cloneMap.end())
-							ref = it->second;
+						if (GameObject* clone = findClone(ref))
+							ref = clone;
 					}
 				}
 				else if (auto* inception = std::get_if<DBLList>(&entry.value)) {
@@ -425,7 +464,7 @@ void CmdDuplicateObjectAndAdapt(GameObject* obj)
 			}
 		};
 
-	for (const auto& [_, clone] : cloneMap) {
+	for (GameObject* clone : clones) {
 		updateDbl(clone->dbl, updateDbl);
 	}
 
@@ -456,12 +495,22 @@ void CmdDeleteObjectSafely(GameObject* obj)
 		return;
 
 	if (obj->getRefCount() > 0u) {
-		warn("It's not possible to remove an object that is referenced by other objects!");
+		std::string msg = "It's not possible to remove an object that is referenced by other objects!";
+		std::vector<ObjectReference> refs = g_scene.GetReferences(obj);
+		if (!refs.empty()) {
+			msg += "\nReferenced by:";
+			for (const ObjectReference& ref : refs)
+				msg += "\n" + (ref.object ? ref.object->getPath() : std::string("ZDEF values"));
+		}
+		warn(msg.c_str());
 		return;
 	}
 
 	if (selobj == obj)
 		selobj = nullptr;
+	// the handle will be given to another object
+	if (GetObjVisibility(obj) != ObjVisibility::Default)
+		SetObjVisibility(obj, ObjVisibility::Default);
 
 	g_scene.RemoveObject(obj);
 }
@@ -474,10 +523,10 @@ void IGOTNode(GameObject *o)
 	if (findsel)
 		if (ObjInObj(selobj, o))
 			ImGui::SetNextItemOpen(true, ImGuiCond_Always);
-	auto visibilityIt = objVisibilityMap.find(o);
-	if (visibilityIt != objVisibilityMap.end() && visibilityIt->second != ObjVisibility::Default) {
+	ObjVisibility visibility = GetObjVisibility(o);
+	if (visibility != ObjVisibility::Default) {
 		colorpushed = 1;
-		ImVec4 color = (visibilityIt->second == ObjVisibility::Show) ? ImVec4(0, 1, 0, 1) : ImVec4(1, 0, 0, 1);
+		ImVec4 color = (visibility == ObjVisibility::Show) ? ImVec4(0, 1, 0, 1) : ImVec4(1, 0, 0, 1);
 		ImGui::PushStyleColor(ImGuiCol_Text, color);
 	}
 	op = ImGui::TreeNodeEx(o, (o->subobj.empty() ? ImGuiTreeNodeFlags_Leaf : 0) | ImGuiTreeNodeFlags_OpenOnArrow | ImGuiTreeNodeFlags_OpenOnDoubleClick | ((o == selobj) ? ImGuiTreeNodeFlags_Selected : 0), "%s::%s", ClassInfo::GetObjTypeString(o->type), o->name.c_str());
@@ -489,7 +538,7 @@ void IGOTNode(GameObject *o)
 	if (ImGui::IsItemHovered() && ImGui::IsMouseReleased(0)) {
 		ImGuiIO& io = ImGui::GetIO();
 		if (io.KeyShift)
-			objVisibilityMap[o] = ObjVisibility(((int)objVisibilityMap[o] + 1) % 3);
+			SetObjVisibility(o, ObjVisibility(((int)GetObjVisibility(o) + 1) % 3));
 		else
 		{
 			selobj = o;
@@ -513,11 +562,10 @@ void IGOTNode(GameObject *o)
 	}
 	ImGui::PushID(o);
 	if (ImGui::BeginPopupContextItem("ObjectRightClickMenu", ImGuiPopupFlags_MouseButtonRight)) {
-		auto it = objVisibilityMap.find(o);
-		ObjVisibility vis = (it != objVisibilityMap.end()) ? it->second : ObjVisibility::Default;
-		if (ImGui::MenuItem("Default", nullptr, vis == ObjVisibility::Default)) objVisibilityMap[o] = ObjVisibility::Default;
-		if (ImGui::MenuItem("Show", nullptr, vis == ObjVisibility::Show)) objVisibilityMap[o] = ObjVisibility::Show;
-		if (ImGui::MenuItem("Hide", nullptr, vis == ObjVisibility::Hide)) objVisibilityMap[o] = ObjVisibility::Hide;
+		ObjVisibility vis = GetObjVisibility(o);
+		if (ImGui::MenuItem("Default", nullptr, vis == ObjVisibility::Default)) SetObjVisibility(o, ObjVisibility::Default);
+		if (ImGui::MenuItem("Show", nullptr, vis == ObjVisibility::Show)) SetObjVisibility(o, ObjVisibility::Show);
+		if (ImGui::MenuItem("Hide", nullptr, vis == ObjVisibility::Hide)) SetObjVisibility(o, ObjVisibility::Hide);
 		ImGui::Separator();
 		auto menuItemWhen = [](const char* name, bool enabled)
 			{
@@ -796,8 +844,10 @@ GLuint GetDblImageTexture(GameObject* obj, void* data, int type, int width, int
 
 static GameObject* nextobjtosel = 0;
 
-void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members, const std::vector<ClassInfo::ObjectComponent>* components = nullptr)
+// Returns true if the list was modified (or will be by deferredCommand)
+bool IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members, const std::vector<ClassInfo::ObjectComponent>* components = nullptr)
 {
+	bool modified = false;
 	size_t memberIndex = 0;
 	std::optional<int> nextComponentIndex = (components && !components->empty()) ? std::make_optional(0) : std::nullopt;
 	
@@ -806,7 +856,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 		ImGui::TextColored(ImVec4(1.0f, 1.0f, 0.0f, 1.0f), "The properties do not match with the class and routines!");
 	}
 	
-	ImGui::InputScalar("DBL Flags", ImGuiDataType_U32, &dbl.flags);
+	modified |= ImGui::InputScalar("DBL Flags", ImGuiDataType_U32, &dbl.flags);
 	for (auto e = dbl.entries.begin(); e != dbl.entries.end(); e++)
 	{
 		static const ClassInfo::ClassMember oobClassMember = { "", "OOB" };
@@ -840,6 +890,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				}
 				std::string& routstr = std::get<std::string>(dbl.entries[0].value);
 				routstr = std::move(updatedRouteString);
+				modified = true;
 			}
 			ImGui::SameLine(0.0);
 			ImGui::BeginDisabled(!memberListMatching);
@@ -865,6 +916,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						auto it = dbl.entries.begin() + startIndex;
 						dbl.entries.erase(it, it + numElements);
 					};
+				modified = true;
 			}
 			if (ImGui::IsItemHovered()) {
 				ImGui::SetTooltip("Remove routine");
@@ -882,27 +934,31 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 		case ET::UNDEFINED:
 			ImGui::Text("0"); break;
 		case ET::DOUBLE:
-			ImGui::InputDouble(name.c_str(), &std::get<double>(e->value)); break;
+			modified |= ImGui::InputDouble(name.c_str(), &std::get<double>(e->value)); break;
 		case ET::FLOAT:
-			ImGui::InputFloat(name.c_str(), &std::get<float>(e->value)); break;
+			modified |= ImGui::InputFloat(name.c_str(), &std::get<float>(e->value)); break;
 		case ET::INT:
 		{
 			uint32_t& ref = std::get<uint32_t>(e->value);
 			if (mem->type == "BOOL") {
 				bool val = ref;
-				if (ImGui::Checkbox(name.c_str(), &val))
+				if (ImGui::Checkbox(name.c_str(), &val)) {
 					ref = val ? 1 : 0;
+					modified = true;
+				}
 			}
 			else if (mem->type == "ENUM") {
 				if (ImGui::BeginCombo(name.c_str(), mem->valueChoices[ref].c_str())) {
 					for (size_t i = 0; i < mem->valueChoices.size(); ++i)
-						if (ImGui::Selectable(mem->valueChoices[i].c_str(), ref == (uint32_t)i))
+						if (ImGui::Selectable(mem->valueChoices[i].c_str(), ref == (uint32_t)i)) {
 							ref = (uint32_t)i;
+							modified = true;
+						}
 					ImGui::EndCombo();
 				}
 			}
 			else {
-				ImGui::InputInt(name.c_str(), (int*)&ref);
+				modified |= ImGui::InputInt(name.c_str(), (int*)&ref);
 			}
 			break;
 		}
@@ -911,7 +967,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 		{
 			auto& str = std::get<std::string>(e->value);
 			//IGStdStringInput((e->type == 5) ? "Filename" : "String", str);
-			IGStdStringInput(name.c_str(), str);
+			modified |= IGStdStringInput(name.c_str(), str);
 			break;
 		}
 		case ET::TERMINATOR:
@@ -936,6 +992,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				data.resize(len);
 				fread(data.data(), data.size(), 1, file);
 				fclose(file);
+				modified = true;
 			}
 			if (name == "Squares") {
 				std::string& name = std::get<std::string>((e + 1)->value);
@@ -961,6 +1018,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						picSize = 0;
 						stbi_image_free(image);
 						refresh = true;
+						modified = true;
 					}
 				}
 				if (!data.empty()) {
@@ -991,8 +1049,10 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				ImGui::LabelText(name.c_str(), "Object <Invalid>");
 
 			if (ImGui::BeginPopupContextItem("ObjRefMenu")) {
-				if (ImGui::MenuItem("Clear"))
+				if (ImGui::MenuItem("Clear")) {
 					e->value = GORef();
+					modified = true;
+				}
 				ImGui::EndPopup();
 			}
 			if (ImGui::BeginDragDropTarget())
@@ -1000,6 +1060,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				if (const ImGuiPayload* pl = ImGui::AcceptDragDropPayload("GameObject"))
 				{
 					e->value.emplace<GORef>(*(GameObject**)pl->Data);
+					modified = true;
 				}
 				ImGui::EndDragDropTarget();
 			}
@@ -1019,8 +1080,10 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 					if (ImGui::IsItemHovered() && ImGui::IsMouseDoubleClicked(ImGuiMouseButton_Left))
 						nextobjtosel = obj.get();
 					if (ImGui::BeginPopupContextItem("ObjRefMenu")) {
-						if (ImGui::MenuItem("Nullify"))
+						if (ImGui::MenuItem("Nullify")) {
 							obj.deref();
+							modified = true;
+						}
 						if (ImGui::MenuItem("Remove"))
 							removingIndex = index;
 						ImGui::EndPopup();
@@ -1030,6 +1093,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						if (const ImGuiPayload* pl = ImGui::AcceptDragDropPayload("GameObject"))
 						{
 							obj = *(GameObject**)pl->Data;
+							modified = true;
 						}
 						ImGui::EndDragDropTarget();
 					}
@@ -1042,21 +1106,24 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 				ImGui::Text("%s\n\nCount:", name.c_str());
 				ImGui::SetNextItemWidth(-1.0f);
 				uint32_t listCount = (uint32_t)vec.size();
-				if (ImGui::InputScalar("##ListLabel", ImGuiDataType_U32, &listCount, nullptr, nullptr, nullptr, ImGuiInputTextFlags_EnterReturnsTrue))
+				if (ImGui::InputScalar("##ListLabel", ImGuiDataType_U32, &listCount, nullptr, nullptr, nullptr, ImGuiInputTextFlags_EnterReturnsTrue)) {
 					vec.resize(listCount);
+					modified = true;
+				}
 				ImGui::EndGroup();
 
 				if (removingIndex >= 0) {
 					vec.erase(vec.begin() + removingIndex);
+					modified = true;
 				}
 			}
 			break;
 		}
 		case ET::MSG:
-			IGMessageValue(name.c_str(), std::get<uint32_t>(e->value));
+			modified |= IGMessageValue(name.c_str(), std::get<uint32_t>(e->value));
 			break;
 		case ET::SNDREF: {
-			IGAudioRef(name.c_str(), std::get<AudioRef>(e->value));
+			modified |= IGAudioRef(name.c_str(), std::get<AudioRef>(e->value));
 			break;
 		}
 		case ET::SCRIPT: {
@@ -1118,6 +1185,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 						}
 
 						dbl = std::move(temp);
+						modified = true;
 					}
 					catch (const ScriptParserError& error) {
 						MessageBoxA(hWindow, error.message.c_str(), "Script parser error", 16);
@@ -1136,7 +1204,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 			}
 
 			ImGui::Indent();
-			IGDBLList(dbl, oScriptBody);
+			modified |= IGDBLList(dbl, oScriptBody);
 			ImGui::Unindent();
 			break;
 		}
@@ -1148,6 +1216,7 @@ void IGDBLList(DBLList& dbl, const std::vector<ClassInfo::ObjectMember>& members
 		ImGui::PopID();
 		memberIndex += 1;
 	}
+	return modified;
 }
 
 void IGObjectInfo()
@@ -1185,8 +1254,10 @@ void IGObjectInfo()
 		ImGui::Separator();
 
 		ImGui::Text("%s (%i, %04X) %s", ClassInfo::GetObjTypeString(selobj->type), selobj->type, selobj->flags, selobj->isIncludedScene ? "Included Scene" : "");
-		IGStdStringInput("Name", selobj->name);
-		ImGui::DragFloat3("Position", &selobj->matrix._41);
+		if (IGStdStringInput("Name", selobj->name))
+			selobj->markModified();
+		if (ImGui::DragFloat3("Position", &selobj->matrix._41))
+			selobj->markModified();
 		/*for (int i = 0; i < 3; i++) {
 			ImGui::PushID(i);
 			ImGui::DragFloat3((i==0) ? "Matrix" : "", selobj->matrix.m[i]);
@@ -1201,6 +1272,7 @@ void IGObjectInfo()
 			Matrix mx = Matrix::getRotationXMatrix(rota.x);
 			Matrix mz = Matrix::getRotationZMatrix(rota.z);
 			selobj->matrix = mz * mx * my * Matrix::getTranslationMatrix(selobj->matrix.getTranslationVector());
+			selobj->markModified();
 		}
 		ImGui::Text("Num. references: %zu", selobj->getRefCount());
 		if (ImGui::CollapsingHeader("Properties (DBL)"))
@@ -1234,13 +1306,15 @@ void IGObjectInfo()
 						std::vector<ClassInfo::ObjectMember> objmems;
 						ClassInfo::AddDBLMemberInfo(objmems, memlist);
 						selobj->dbl.addMembers(objmems);
+						selobj->markModified();
 					}
 				}
 				ImGui::EndPopup();
 			}
 			std::vector<ClassInfo::ObjectComponent> components;
 			auto members = ClassInfo::GetMemberNames(selobj, &components);
-			IGDBLList(selobj->dbl, members, &components);
+			if (IGDBLList(selobj->dbl, members, &components))
+				selobj->markModified();
 		}
 		if (selobj->mesh && ImGui::CollapsingHeader("Mesh"))
 		{
@@ -1274,6 +1348,7 @@ void IGObjectInfo()
 						//else
 						//	selobj->excChunk = nullptr;
 						InvalidateMesh(selobj->mesh.get());
+						g_scene.MarkMeshModified(selobj->mesh.get());
 					}
 					// even when mesh import fails, new textures may be imported
 					UncacheAllTextures();
@@ -1338,6 +1413,7 @@ void IGObjectInfo()
 						}
 					}
 					InvalidateMesh(mesh);
+					g_scene.MarkMeshModified(mesh);
 				}
 				ImGui::EndPopup();
 			}
@@ -1345,11 +1421,15 @@ void IGObjectInfo()
 			ImGui::AlignTextToFramePadding();
 			ImGui::Text("Ref count: %li", selobj->mesh.use_count());
 			ImGui::SameLine();
-			if (ImGui::Button("Make unique"))
+			if (ImGui::Button("Make unique")) {
 				selobj->mesh = std::make_unique<Mesh>(*selobj->mesh);
+				selobj->markModified();
+			}
 			ImVec4 c = ImGui::ColorConvertU32ToFloat4(swap_rb(selobj->color));
-			if (ImGui::ColorEdit4("Color", &c.x, 0))
+			if (ImGui::ColorEdit4("Color", &c.x, 0)) {
 				selobj->color = swap_rb(ImGui::ColorConvertFloat4ToU32(c));
+				selobj->markModified();
+			}
 			ImGui::Text("Vertex count: %zu", selobj->mesh->getNumVertices());
 			ImGui::Text("Quad count:   %zu", selobj->mesh->getNumQuads());
 			ImGui::Text("Tri count:    %zu", selobj->mesh->getNumTris());
@@ -1367,8 +1447,10 @@ void IGObjectInfo()
 		}
 		if (selobj->line && ImGui::CollapsingHeader("Line")) {
 			ImVec4 c = ImGui::ColorConvertU32ToFloat4(swap_rb(selobj->color));
-			if (ImGui::ColorEdit4("Color", &c.x, 0))
+			if (ImGui::ColorEdit4("Color", &c.x, 0)) {
 				selobj->color = swap_rb(ImGui::ColorConvertFloat4ToU32(c));
+				selobj->markModified();
+			}
 			ImGui::Text("Vertex count: %zu", selobj->line->getNumVertices());
 			std::string termstr;
 			for (uint32_t t : selobj->line->terms)
@@ -1386,6 +1468,7 @@ void IGObjectInfo()
 					ftxFace += 6;
 				}
 				InvalidateMesh(selobj->mesh.get());
+				g_scene.MarkMeshModified(selobj->mesh.get());
 			}
 			ImGui::SameLine();
 			static Mesh::FTXFace newFace{ 0,0,0,0,0,0 };
@@ -1399,6 +1482,7 @@ void IGObjectInfo()
 					for (auto& ftxFace : selobj->mesh->ftxFaces)
 						ftxFace = newFace;
 					InvalidateMesh(selobj->mesh.get());
+					g_scene.MarkMeshModified(selobj->mesh.get());
 				}
 				ImGui::EndPopup();
 			}
@@ -1438,7 +1522,8 @@ void IGObjectInfo()
 			for (int i = 0; i < 7; i++)
 			{
 				s[6] = '0' + i;
-				ImGui::InputScalar(s, ImGuiDataType_U32, &selobj->light->param[i], 0, 0, "%08X", ImGuiInputTextFlags_CharsHexadecimal);
+				if (ImGui::InputScalar(s, ImGuiDataType_U32, &selobj->light->param[i], 0, 0, "%08X", ImGuiInputTextFlags_CharsHexadecimal))
+					selobj->markModified();
 			}
 		}
 		if (selobj->excChunk && ImGui::CollapsingHeader("EXC")) {
@@ -1448,8 +1533,7 @@ void IGObjectInfo()
 					FILE* file;
 					_wfopen_s(&file, fpath.c_str(), L"wb");
 					if (file) {
-						auto str = selobj->excChunk->saveToString();
-						fwrite(str.data(), str.size(), 1, file);
+						ChunkSerializer(*selobj->excChunk).writeToFile(file);
 						fclose(file);
 					}
 				}
@@ -1457,7 +1541,7 @@ void IGObjectInfo()
 			if (ImGui::Button("Dump HMTX")) {
 				Chunk* hmtx = selobj->excChunk->findSubchunk('HMTX');
 				int mid = 0;
-				for (auto& md : hmtx->multidata) {
+				for (Span<uint8_t> md : hmtx->multidata) {
 					double* mtx = (double*)md.data();
 					printf("--- Matrix %i ---\n", mid++);
 					for (int r = 0; r < 4; ++r) {
@@ -1477,39 +1561,19 @@ void IGObjectInfo()
 			walkChunk(selobj->excChunk.get(), walkChunk);
 		}
 		if (ImGui::CollapsingHeader("Referenced by")) {
-			auto inspectDbl = [](const DBLList& dbl, const GameObject* obj, const auto& rec) -> void {
-				for (const auto& entry : dbl.entries) {
-					if (const GORef* ref = std::get_if<GORef>(&entry.value)) {
-						if (ref->get() == selobj) {
-							ImGui::BulletText("%s", obj->getPath().c_str());
-						}
-					}
-					else if (const auto* list = std::get_if<std::vector<GORef>>(&entry.value)) {
-						for (const GORef& ref : *list) {
-							if (ref.get() == selobj) {
-								ImGui::BulletText("%s", obj->getPath().c_str());
-							}
-						}
-					}
-					else if (const auto* inception = std::get_if<DBLList>(&entry.value)) {
-						rec(*inception, obj, rec);
-					}
-				}
-				};
-			auto walk = [&](const GameObject* obj, const auto& rec) -> void {
-				inspectDbl(obj->dbl, obj, inspectDbl);
-				for (const auto* child : obj->subobj) {
-					rec(child, rec);
-				}
-				};
-			walk(g_scene.superroot, walk);
+			for (const ObjectReference& ref : g_scene.GetReferences(selobj)) {
+				if (ref.object)
+					ImGui::BulletText("%s", ref.object->getPath().c_str());
+				else
+					ImGui::BulletText("ZDEF values");
+			}
 		}
 	}
 	ImGui::End();
 	if (nextobjtosel) selobj = nextobjtosel;
 }
 
-void CmdSaveScene()
+void CmdSaveSceneAsZip(const SaveOptions& options)
 {
 	auto newfn = g_scene.lastSpkFilepath.filename().u8string();
 	size_t atpos = newfn.rfind('@');
@@ -1518,7 +1582,32 @@ void CmdSaveScene()
 
 	auto zipPath = GuiUtils::SaveDialogBox("Scene ZIP archive\0*.zip\0\0\0", "zip", std::filesystem::u8path(newfn), "Save Scene ZIP archive as...");
 	if (!zipPath.empty())
-		g_scene.SaveSceneSPK(zipPath);
+		g_scene.SaveSceneSPK(zipPath, options);
+}
+
+void CmdSaveScene()
+{
+	// A scene opened from a folder is saved back into it
+	if (g_scene.archive && g_scene.archive->isFolder())
+		g_scene.SaveSceneSPK(g_scene.archive->path(), g_saveOptions);
+	else
+		CmdSaveSceneAsZip(g_saveOptions);
+}
+
+void CmdSaveSceneToFolder()
+{
+	auto dirPath = GuiUtils::SelectFolderDialogBox("Save the scene's files uncompressed to:");
+	if (!dirPath.empty())
+		g_scene.SaveSceneSPK(dirPath, g_saveOptions);
+}
+
+// Final ZIP of a scene edited as a folder, always with the Release profile
+void CmdPackSceneToZip()
+{
+	SaveOptions options = g_saveOptions;
+	options.profile = SaveProfile::Release;
+	options.recompressCopies = true;
+	CmdSaveSceneAsZip(options);
 }
 
 void IGMain()
@@ -1530,7 +1619,27 @@ void IGMain()
 		CmdSaveScene();
 	}
 	ImGui::SameLine();
+	ImGui::Checkbox("PackRepeat", &g_saveOptions.usePackRepeat);
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Save textures and sounds found in the game's Repeat.* files\nas references to them instead of copying them.");
+	ImGui::SameLine();
 	ImGui::Text("%4u FPS", framespersec);
+	ImGui::SetNextItemWidth(80.0f);
+	if (ImGui::BeginCombo("Save profile", GetSaveProfileName(g_saveOptions.profile))) {
+		for (SaveProfile profile : { SaveProfile::Fast, SaveProfile::Release })
+			if (ImGui::Selectable(GetSaveProfileName(profile), g_saveOptions.profile == profile))
+				g_saveOptions.profile = profile;
+		ImGui::EndCombo();
+	}
+	if (ImGui::IsItemHovered())
+		ImGui::SetTooltip("Fast: lowest compression, for quick saves while editing.\nRelease: normal compression, smaller ZIP.");
+	if (g_scene.lastSaveStats.totalSecs > 0.0) {
+		const SaveStats& stats = g_scene.lastSaveStats;
+		ImGui::SameLine();
+		ImGui::Text("Last save: %.0f ms, %.1f MB", stats.totalSecs * 1000.0, stats.zipSize / 1e6);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("%s profile\n%.1f ms compressing", GetSaveProfileName(stats.profile), stats.compressSecs * 1000.0);
+	}
 	ImGui::DragFloat("Cam speed", &camspeed, 4.0f, 0.0f, FLT_MAX, "%.f /sec");
 	ImGui::DragFloat3("Cam pos", &campos.x, 1.0f);
 	ImGui::DragFloat2("Cam ori", &camori.x, 0.1f);
@@ -1575,6 +1684,11 @@ void IGTextures()
 			if (!fpath.empty()) {
 				uint32_t tid = *(uint32_t*)palchk->maindata.data();
 				ImportTexture(fpath, *palchk, *dxtchk, tid);
+				// the texture chunks' tags can change (PALN to RGBA)
+				g_scene.palPack.invalidateTagIndex();
+				g_scene.dxtPack.invalidateTagIndex();
+				++g_scene.palPack.generation;
+				++g_scene.dxtPack.generation;
 				InvalidateTexture(tid);
 			}
 		}
@@ -1711,6 +1825,7 @@ void IGSounds()
 
 					Chunk& chk = g_scene.wavPack.subchunks.emplace_back();
 					chk.tag = 'WPCM';
+					++g_scene.wavPack.generation;
 
 					fseek(file, 0, SEEK_END);
 					size_t len = ftell(file);
@@ -1737,6 +1852,7 @@ void IGSounds()
 				chk.maindata.resize(len);
 				fread(chk.maindata.data(), len, 1, file);
 				fclose(file);
+				++g_scene.wavPack.generation;
 			}
 		}
 	}
@@ -1948,6 +2064,7 @@ void IGPathfinderInfo()
 	if (GameObject* pathfinderObject = g_pathfinderObject.get()) {
 		if (ImGui::Button("Update")) {
 			pathfinderObject->dbl.entries.at(14).value = g_pfInfo.toBytes();
+			pathfinderObject->markModified();
 		}
 		ImGui::Text("Num rooms: %zu", g_pfInfo.rooms.size());
 		ImGui::Text("Num room instances: %zu", g_pfInfo.roomInstances.size());
@@ -2253,7 +2370,7 @@ void UIClean()
 	UncacheAllTextures();
 	UncacheAllMeshes();
 	selobj = nullptr;
-	objVisibilityMap.clear();
+	objVisibilities.clear();
 	bestpickobj = nullptr;
 	objtogive = nullptr;
 	nextobjtosel = nullptr;
@@ -2261,17 +2378,40 @@ void UIClean()
 	g_pfInfo = {};
 }
 
+void OpenScene(const std::filesystem::path& path)
+{
+	UIClean();
+	LoadOptions loadOptions;
+	loadOptions.progress = [lastPrint = std::chrono::steady_clock::time_point()](const LoadProgress& progress) mutable {
+		auto now = std::chrono::steady_clock::now();
+		if (now - lastPrint < std::chrono::milliseconds(100))
+			return;
+		lastPrint = now;
+		printf("Loading: %zu/%zu KiB inflated", progress.bytesInflated / 1024, progress.totalBytes / 1024);
+		if (progress.stage)
+			printf(", %s: %zu/%zu objects", progress.stage, progress.objectsDecoded, progress.totalObjects);
+		printf("\n");
+	};
+	g_scene.LoadSceneSPK(path, loadOptions);
+	GlifyAllTextures();
+}
+
 bool CmdOpenScene()
 {
 	auto zipPath = GuiUtils::OpenDialogBox("Scene ZIP archive\0*.zip\0\0\0", "zip", "Select a Scene ZIP archive (containing Pack.SPK)");
 	if (zipPath.empty())
 		return false;
-	UIClean();
-	g_scene.LoadSceneSPK(zipPath);
-	GlifyAllTextures();
+	OpenScene(zipPath);
 	return true;
 }
 
+void CmdOpenSceneFolder()
+{
+	auto dirPath = GuiUtils::SelectFolderDialogBox("Select a folder with the extracted files of a scene (containing Pack.SPK):");
+	if (!dirPath.empty())
+		OpenScene(dirPath);
+}
+
 void CmdNewScene()
 {
 	if (MessageBoxW(hWindow, L"Create a new empty scene?", L"c47edit", MB_ICONWARNING | MB_YESNO) == IDYES) {
@@ -2396,6 +2536,14 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 		exit(-2);
 	}
 
+	for (int i = 1; i < __argc; ++i) {
+		std::string_view arg = __argv[i];
+		if (arg == "--save-profile=fast")
+			g_saveOptions.profile = SaveProfile::Fast;
+		else if (arg == "--save-profile=release")
+			g_saveOptions.profile = SaveProfile::Release;
+	}
+
 	bool appnoquit = true;
 	InitWindow();
 
@@ -2476,8 +2624,10 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 					bestpickdist = std::numeric_limits<float>::infinity();
 					IsRayIntersectingObject(raystart, raydir, g_scene.superroot, Matrix::getIdentity());
 					if (io.KeyAlt) {
-						if (bestpickobj && selobj)
+						if (bestpickobj && selobj) {
 							selobj->matrix.setTranslationVector(bestpickintersectionpnt);
+							selobj->markModified();
+						}
 					}
 					else {
 						selobj = bestpickobj;
@@ -2502,8 +2652,10 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 				for (GameObject* par = selobj->parent; par; par = par->parent)
 					parentMat *= par->matrix;
 				Matrix globalMat = selobj->matrix * parentMat;
-				if (ImGuizmo::Manipulate(lookat.v, persp.v, ImGuizmo::TRANSLATE | ImGuizmo::ROTATE, ImGuizmo::WORLD, globalMat.v))
+				if (ImGuizmo::Manipulate(lookat.v, persp.v, ImGuizmo::TRANSLATE | ImGuizmo::ROTATE, ImGuizmo::WORLD, globalMat.v)) {
 					selobj->matrix = globalMat * parentMat.getInverse4x3();
+					selobj->markModified();
+				}
 			}
 
 			IGMain();
@@ -2523,8 +2675,14 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 						CmdNewScene();
 					if (ImGui::MenuItem("Open..."))
 						CmdOpenScene();
+					if (ImGui::MenuItem("Open folder..."))
+						CmdOpenSceneFolder();
 					if (ImGui::MenuItem("Save as..."))
-						CmdSaveScene();
+						CmdSaveSceneAsZip(g_saveOptions);
+					if (ImGui::MenuItem("Save to folder..."))
+						CmdSaveSceneToFolder();
+					if (ImGui::MenuItem("Pack to ZIP...", nullptr, false, g_scene.archive && g_scene.archive->isFolder()))
+						CmdPackSceneToZip();
 					ImGui::Separator();
 					if (ImGui::MenuItem("Exit"))
 						DestroyWindow(hWindow);
@@ -2611,7 +2769,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 			}
 
 			// First time message
-			if (objVisibilityMap.empty()) {
+			if (objVisibilities.empty()) {
 				ImGui::SetNextWindowPos(ImVec2((float)screen_width * 0.5f, (float)screen_height * 0.5f), ImGuiCond_Always, ImVec2(0.5f, 0.5f));
 				ImGui::SetNextWindowSize(ImVec2(0.0f, 0.0f), ImGuiCond_Always);
 				ImGui::Begin("FirstTimeMessage", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoNav | ImGuiWindowFlags_NoInputs);
@@ -2699,4 +2857,7 @@ int WINAPI WinMain(HINSTANCE hInst, HINSTANCE hPrevInst, char *args, int winmode
 			}
 		}
 	}
+
+	// The references held by the UI are released before the objects are deleted with g_scene
+	UIClean();
 }
\ No newline at end of file
@@ -98,6 +98,8 @@ void UncacheAllTextures()
 std::tuple<uint32_t, Chunk*, Chunk*> AddUninitializedTexture(Scene& scene)
 {
 	uint32_t texId = ++scene.numTextures;
+	++scene.palPack.generation;
+	++scene.dxtPack.generation;
 	Chunk& chk = scene.palPack.subchunks.emplace_back();
 	Chunk& dxtchk = scene.dxtPack.subchunks.emplace_back();
 	return { texId, &chk, &dxtchk };
@@ -130,7 +132,7 @@ void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name
 	int flags = 0x14;
 	int random = 0x12345678;
 
-	ByteWriter<std::vector<uint8_t>> chkdata, dxtdata;
+	ByteWriter<Chunk::DataBuffer> chkdata, dxtdata;
 	chkdata.addU32(texid);
 	chkdata.addU16(height);
 	chkdata.addU16(width);
@@ -141,26 +143,22 @@ void ImportTexture(uint8_t* pixels, int width, int height, std::string_view name
 	dxtdata = chkdata;
 
 	int size = width * height * 4;
+	chkdata.reserve(chkdata.size() + 4 + size);
 	chkdata.addS32(size);
 	chkdata.addData(pixels, size);
 
-	// 1 COPY >_<
 	chk.tag = 'RGBA';
-	auto str = chkdata.take();
-	chk.maindata.resize(str.size());
-	memcpy(chk.maindata.data(), str.data(), str.size());
+	chk.maindata = chkdata.take();
 
 	// DXT
 	size = squish::GetStorageRequirements(width, height, squish::kDxt1);
+	dxtdata.reserve(dxtdata.size() + 4 + size);
 	dxtdata.addS32(size);
 	uint8_t* comp = dxtdata.addEmpty(size);
 	squish::CompressImage(pixels, width, height, comp, squish::kDxt1);
 
-	// 1 COPY >_<
 	dxtchk.tag = 'DXT1';
-	str = dxtdata.take();
-	dxtchk.maindata.resize(str.size());
-	memcpy(dxtchk.maindata.data(), str.data(), str.size());
+	dxtchk.maindata = dxtdata.take();
 }
 
 void ImportTexture(const std::filesystem::path& filepath, Chunk& chk, Chunk& dxtchk, int texid)